@@ -0,0 +1,157 @@
+// Serial realpath() against ResolvePaths() on synthetic trees of 10k and
+// 100k files, spread over 100 directories and listed in shuffled order.
+// Built and run by `./nob bench [dir]`.
+//
+// The pool exists for file systems where every stat is a round trip. A
+// local disk with a warm dentry cache only shows its overhead; to see the
+// case it is for, point it at an NFS, SMB or sshfs mount, ideally one
+// mounted without attribute caching (e.g. NFS with actimeo=0):
+//
+//   ./nob bench /mnt/nfs/scratch
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "arena.h"
+#include "resolve.h"
+
+#define BENCH_DIRS 100
+#define BENCH_RUNS 3
+
+static const size_t BenchCounts[] = { 10000, 100000 };
+
+static double BenchNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void BenchPath(char *out, size_t size, const char *root, size_t i) {
+  snprintf(out, size, "%s/d%03zu/f%06zu", root, i % BENCH_DIRS, i);
+}
+
+static int BenchCreate(const char *root, size_t count) {
+  char path[PATH_MAX];
+  for (size_t d = 0; d < BENCH_DIRS; d++) {
+    snprintf(path, sizeof(path), "%s/d%03zu", root, d);
+    if (mkdir(path, 0700) < 0) return 0;
+  }
+  for (size_t i = 0; i < count; i++) {
+    BenchPath(path, sizeof(path), root, i);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return 0;
+    close(fd);
+  }
+  return 1;
+}
+
+static void BenchRemove(const char *root, size_t count) {
+  char path[PATH_MAX];
+  for (size_t i = 0; i < count; i++) {
+    BenchPath(path, sizeof(path), root, i);
+    unlink(path);
+  }
+  for (size_t d = 0; d < BENCH_DIRS; d++) {
+    snprintf(path, sizeof(path), "%s/d%03zu", root, d);
+    rmdir(path);
+  }
+  rmdir(root);
+}
+
+static double BenchSerial(const PathInput *inputs, size_t count) {
+  char out[PATH_MAX];
+  double start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    if (!realpath(inputs[i].path, out)) return -1;
+  }
+  return BenchNow() - start;
+}
+
+// With 'check', also compares every result with realpath(), untimed.
+static double BenchPool(const PathInput *inputs, size_t count, int check) {
+  Arena *arena = ArenaCreate();
+  if (!arena) return -1;
+  Resolver r;
+  double start = BenchNow();
+  int ok = ResolvePaths(&r, arena, inputs, count);
+  double elapsed = BenchNow() - start;
+
+  char expected[PATH_MAX];
+  for (size_t i = 0; ok && check && i < count; i++) {
+    ok = realpath(inputs[i].path, expected) && !strcmp(expected, ResolvedPath(&r, i));
+  }
+  ArenaDestroy(arena);
+  return ok ? elapsed : -1;
+}
+
+int main(int argc, char **argv) {
+  const char *parent = argc > 1 ? argv[1] : "/tmp";
+  size_t total = BenchCounts[sizeof(BenchCounts) / sizeof(BenchCounts[0]) - 1];
+
+  char root[PATH_MAX / 2];
+  if ((size_t)snprintf(root, sizeof(root), "%s/drag-bench-XXXXXX", parent) >= sizeof(root)) {
+    fprintf(stderr, "%s: path too long\n", parent);
+    return 1;
+  }
+  if (!mkdtemp(root)) {
+    perror(root);
+    return 1;
+  }
+  printf("Creating %zu files in %s...\n", total, root);
+  if (!BenchCreate(root, total)) {
+    perror(root);
+    BenchRemove(root, total);
+    return 1;
+  }
+
+  // Shuffled, so the pool's grouping by parent directory has work to do.
+  size_t stride = strlen(root) + 16;
+  PathInput *inputs = calloc(total, sizeof(*inputs));
+  char *names = malloc(total * stride);
+  if (!inputs || !names) {
+    BenchRemove(root, total);
+    return 1;
+  }
+  srand(1);
+  for (size_t i = 0; i < total; i++) {
+    size_t j = (size_t)rand() % (i + 1);
+    inputs[i] = inputs[j];
+    char *name = names + i * stride;
+    BenchPath(name, stride, root, i);
+    inputs[j] = (PathInput){ name, strlen(name) };
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("%ld cpus, best of %d runs\n", cpus, BENCH_RUNS);
+  printf("%10s %12s %12s %8s\n", "paths", "serial (s)", "pool (s)", "speedup");
+
+  int status = 0;
+  for (size_t c = 0; c < sizeof(BenchCounts) / sizeof(BenchCounts[0]); c++) {
+    size_t count = BenchCounts[c];
+    double serial = 0, pool = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+      double s = BenchSerial(inputs, count);
+      double p = BenchPool(inputs, count, !run);
+      if (s < 0 || p < 0) {
+        fprintf(stderr, "Resolving failed\n");
+        status = 1;
+        break;
+      }
+      if (!run || s < serial) serial = s;
+      if (!run || p < pool) pool = p;
+    }
+    if (status) break;
+    printf("%10zu %12.4f %12.4f %7.2fx\n", count, serial, pool, serial / pool);
+  }
+
+  free(names);
+  free(inputs);
+  BenchRemove(root, total);
+  return status;
+}
@@ -0,0 +1,589 @@
+#ifndef DRAG_ARCHIVE_H
+#define DRAG_ARCHIVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include "macros.h"
+#include "mime.h"
+
+// Members of tar and zip archives as virtual files ("backup.tar:etc/hosts").
+// Startup only reads headers: tar headers are visited with one pread each,
+// seeking over the data, and zip archives, ZIP64 included, are looked up in
+// their central directory. Stored members are then plain byte ranges of the
+// archive and are served like files. Deflated zip members and members of
+// compressed tars are produced on demand by a child process piping through
+// the system gzip/zstd/xz/bzip2, so nothing is decompressed before a target
+// asks and no temp file is written. The headers of a compressed tar cannot be
+// reached without decompressing it, so those members are only looked up
+// when first served, and their type comes from their name.
+
+#define ARCHIVE_BLOCK 512
+
+enum {
+  ARCHIVE_STORED,            // a byte range of the archive
+  ARCHIVE_DEFLATE,           // raw deflate inside a zip
+  ARCHIVE_COMPRESSED_TAR,    // somewhere in a compressed tar stream
+};
+
+typedef struct {
+  const char *archive;
+  const char *name;          // member path inside the archive
+  int kind;
+  int found;
+  off_t offset;              // start of the data, stored and deflated
+  off_t size;                // uncompressed size, -1 until known
+  off_t csize;               // compressed size, deflated only
+  uint32_t crc;              // deflated only
+  const char *decompressor;  // compressed tars only
+  int on_disk;               // written out for a target that wanted a URI
+  size_t index;              // position among the dragged paths, or SIZE_MAX
+} ArchiveMember;
+
+static int ArchiveReadAt(int fd, void *buf, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, (char*)buf + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    done += n;
+  }
+  return 1;
+}
+
+static int ArchiveRead(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (char*)buf + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    done += n;
+  }
+  return 1;
+}
+
+static uint16_t ArchiveLE16(const unsigned char *p) { return p[0] | p[1] << 8; }
+static uint32_t ArchiveLE32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static uint64_t ArchiveLE64(const unsigned char *p) {
+  return ArchiveLE32(p) | (uint64_t)ArchiveLE32(p + 4) << 32;
+}
+
+// Archives list "./a/b" and "a/b" alike.
+static const char* ArchiveTrim(const char *name) {
+  while (name[0] == '.' && name[1] == '/') name += 2;
+  while (name[0] == '/') name++;
+  return name;
+}
+
+static void ArchiveMatch(ArchiveMember *members, size_t count, const char *name,
+                         int kind, off_t offset, off_t size) {
+  name = ArchiveTrim(name);
+  for (size_t i = 0; i < count; i++) {
+    if (members[i].found || strcmp(ArchiveTrim(members[i].name), name) != 0) continue;
+    members[i].found = 1;
+    members[i].kind = kind;
+    members[i].offset = offset;
+    members[i].size = size;
+  }
+}
+
+// Octal, or base-256 when the top bit is set (GNU, for files >= 8 GiB).
+static off_t TarNumber(const unsigned char *p, size_t len) {
+  off_t n = 0;
+  if (p[0] & 0x80) {
+    n = p[0] & 0x7f;
+    for (size_t i = 1; i < len; i++) n = (n << 8) | p[i];
+    return n;
+  }
+  for (size_t i = 0; i < len && p[i]; i++) {
+    if (p[i] >= '0' && p[i] <= '7') n = n * 8 + (p[i] - '0');
+  }
+  return n;
+}
+
+// The "path" record of a pax extended header, if there is one.
+static int TarPaxPath(const char *records, size_t len, char *out) {
+  const char *p = records, *end = records + len;
+  while (p < end) {
+    long n = strtol(p, NULL, 10);
+    if (n <= 0 || p + n > end) return 0;
+    const char *key = memchr(p, ' ', n);
+    if (key && !strncmp(key + 1, "path=", 5)) {
+      size_t value = p + n - (key + 6) - 1; // minus the trailing newline
+      if (value >= PATH_MAX) return 0;
+      memcpy(out, key + 6, value);
+      out[value] = '\0';
+      return 1;
+    }
+    p += n;
+  }
+  return 0;
+}
+
+// Name of the entry in 'header', taking a preceding GNU long name or pax
+// path into account.
+static void TarEntryName(const unsigned char *header, char *long_name, char *out) {
+  if (long_name[0]) {
+    memcpy(out, long_name, PATH_MAX);
+    long_name[0] = '\0';
+    return;
+  }
+  size_t n = 0;
+  if (!memcmp(header + 257, "ustar", 5) && header[345]) {
+    n = strnlen((const char*)header + 345, 155);
+    memcpy(out, header + 345, n);
+    out[n++] = '/';
+  }
+  size_t base = strnlen((const char*)header, 100);
+  memcpy(out + n, header, base);
+  out[n + base] = '\0';
+}
+
+// Reads a long name or pax header body following 'header' from 'read'.
+typedef int (*TarReader)(void *ctx, void *buf, size_t len);
+
+// Only the start of a big pax header (xattrs, ACLs) is kept.
+static int TarMeta(const unsigned char *header, off_t size, TarReader read, void *ctx, char *long_name) {
+  char body[PATH_MAX + 1024], rest[ARCHIVE_BLOCK];
+  off_t padded = (size + ARCHIVE_BLOCK - 1) & ~(off_t)(ARCHIVE_BLOCK - 1);
+  off_t keep = padded < (off_t)sizeof(body) ? padded : (off_t)sizeof(body);
+  if (!read(ctx, body, keep)) return 0;
+  for (off_t done = keep; done < padded; done += sizeof(rest)) {
+    if (!read(ctx, rest, sizeof(rest))) return 0;
+  }
+  if (size > keep) size = keep;
+
+  if (header[156] == 'L') {
+    size_t n = strnlen(body, size);
+    if (n >= PATH_MAX) return 0;
+    memcpy(long_name, body, n);
+    long_name[n] = '\0';
+  } else if (!TarPaxPath(body, size, long_name)) {
+    long_name[0] = '\0';
+  }
+  return 1;
+}
+
+typedef struct {
+  int fd;
+  off_t offset;
+} TarFile;
+
+static int TarFileRead(void *ctx, void *buf, size_t len) {
+  TarFile *t = ctx;
+  if (!ArchiveReadAt(t->fd, buf, len, t->offset)) return 0;
+  t->offset += len;
+  return 1;
+}
+
+static int TarIndex(int fd, ArchiveMember *members, size_t count) {
+  unsigned char header[ARCHIVE_BLOCK];
+  char long_name[PATH_MAX] = "", name[PATH_MAX];
+  TarFile t = { .fd = fd };
+
+  while (TarFileRead(&t, header, sizeof(header)) && header[0]) {
+    off_t size = TarNumber(header + 124, 12);
+    off_t padded = (size + ARCHIVE_BLOCK - 1) & ~(off_t)(ARCHIVE_BLOCK - 1);
+    char type = header[156];
+
+    if (type == 'L' || type == 'x') {
+      if (!TarMeta(header, size, TarFileRead, &t, long_name)) return 0;
+      continue;
+    }
+
+    TarEntryName(header, long_name, name);
+    if (type == '0' || type == '\0' || type == '7') {
+      ArchiveMatch(members, count, name, ARCHIVE_STORED, t.offset, size);
+    }
+    t.offset += padded; // skip the data without reading it
+  }
+  return 1;
+}
+
+// ZIP64: fields that do not fit are stored as all ones, and the real
+// values follow in the central directory entry's 0x0001 extra field, in
+// the order size, compressed size, local header offset, for those that
+// overflowed. Returns 0 if one of them is missing.
+static int ZipExtra64(const unsigned char *extra, size_t len,
+                      uint64_t *size, uint64_t *csize, uint64_t *local) {
+  while (len >= 4) {
+    uint16_t id = ArchiveLE16(extra), n = ArchiveLE16(extra + 2);
+    if (4 + (size_t)n > len) return 0;
+    if (id == 0x0001) {
+      const unsigned char *p = extra + 4, *end = p + n;
+      uint64_t *fields[] = { size, csize, local };
+      for (size_t i = 0; i < 3; i++) {
+        if (*fields[i] != 0xFFFFFFFF) continue;
+        if (p + 8 > end) return 0;
+        *fields[i] = ArchiveLE64(p);
+        p += 8;
+      }
+      return 1;
+    }
+    extra += 4 + n;
+    len -= 4 + n;
+  }
+  return *size != 0xFFFFFFFF && *csize != 0xFFFFFFFF && *local != 0xFFFFFFFF;
+}
+
+// The entry count and central directory offset from the ZIP64 end of
+// central directory record, found through the locator just before the
+// classic record at 'eocd_offset'.
+static int ZipEnd64(int fd, off_t eocd_offset, uint64_t *entries, uint64_t *cd) {
+  unsigned char locator[20], record[56];
+  if (eocd_offset < (off_t)sizeof(locator) ||
+      !ArchiveReadAt(fd, locator, sizeof(locator), eocd_offset - sizeof(locator)) ||
+      memcmp(locator, "PK\6\7", 4)) {
+    return 0;
+  }
+  uint64_t at = ArchiveLE64(locator + 8);
+  if (at > INT64_MAX || !ArchiveReadAt(fd, record, sizeof(record), at) || memcmp(record, "PK\6\6", 4)) {
+    return 0;
+  }
+  *entries = ArchiveLE64(record + 32);
+  *cd = ArchiveLE64(record + 48);
+  return 1;
+}
+
+static int ZipIndex(int fd, off_t file_size, ArchiveMember *members, size_t count) {
+  // The end of central directory record is within the last 64 KiB + 22.
+  unsigned char tail[65536 + 22];
+  off_t tail_size = file_size < (off_t)sizeof(tail) ? file_size : (off_t)sizeof(tail);
+  if (!ArchiveReadAt(fd, tail, tail_size, file_size - tail_size)) return 0;
+
+  const unsigned char *eocd = NULL;
+  for (off_t i = tail_size - 22; i >= 0; i--) {
+    if (!memcmp(tail + i, "PK\5\6", 4)) {
+      eocd = tail + i;
+      break;
+    }
+  }
+  if (!eocd) return 0;
+
+  uint64_t entries = ArchiveLE16(eocd + 10);
+  uint64_t cd = ArchiveLE32(eocd + 16);
+  if (entries == 0xFFFF || cd == 0xFFFFFFFF) {
+    off_t eocd_offset = file_size - tail_size + (eocd - tail);
+    if (!ZipEnd64(fd, eocd_offset, &entries, &cd) || cd > INT64_MAX) {
+      LOG("Broken ZIP64 end of central directory\n");
+      return 0;
+    }
+  }
+  unsigned char entry[46];
+  unsigned char extra[65536];
+  char name[PATH_MAX];
+
+  for (uint64_t i = 0; i < entries; i++) {
+    if (!ArchiveReadAt(fd, entry, sizeof(entry), cd) || memcmp(entry, "PK\1\2", 4)) return 0;
+    uint16_t flags = ArchiveLE16(entry + 8), method = ArchiveLE16(entry + 10);
+    size_t name_len = ArchiveLE16(entry + 28), extra_len = ArchiveLE16(entry + 30);
+    if (name_len >= PATH_MAX || !ArchiveReadAt(fd, name, name_len, cd + 46)) return 0;
+    name[name_len] = '\0';
+    off_t extra_at = cd + 46 + name_len;
+    cd += 46 + name_len + extra_len + ArchiveLE16(entry + 32);
+
+    // Encrypted entries and methods other than store/deflate are skipped.
+    if ((flags & 1) || (method != 0 && method != 8)) continue;
+
+    int wanted = 0;
+    for (size_t j = 0; j < count; j++) {
+      wanted |= !members[j].found && !strcmp(ArchiveTrim(members[j].name), ArchiveTrim(name));
+    }
+    if (!wanted) continue;
+
+    uint64_t size = ArchiveLE32(entry + 24), csize = ArchiveLE32(entry + 20);
+    uint64_t local_offset = ArchiveLE32(entry + 42);
+    if (size == 0xFFFFFFFF || csize == 0xFFFFFFFF || local_offset == 0xFFFFFFFF) {
+      if (!ArchiveReadAt(fd, extra, extra_len, extra_at) ||
+          !ZipExtra64(extra, extra_len, &size, &csize, &local_offset)) {
+        LOG("Member %s has no ZIP64 sizes, not serving it\n", name);
+        continue;
+      }
+    }
+    if (size > INT64_MAX || csize > INT64_MAX || local_offset > INT64_MAX) continue;
+
+    unsigned char local[30];
+    if (!ArchiveReadAt(fd, local, sizeof(local), local_offset) || memcmp(local, "PK\3\4", 4)) return 0;
+    off_t data = local_offset + 30 + ArchiveLE16(local + 26) + ArchiveLE16(local + 28);
+
+    for (size_t j = 0; j < count; j++) {
+      if (members[j].found || strcmp(ArchiveTrim(members[j].name), ArchiveTrim(name))) continue;
+      members[j].found = 1;
+      members[j].kind = method == 0 ? ARCHIVE_STORED : ARCHIVE_DEFLATE;
+      members[j].offset = data;
+      members[j].size = size;
+      members[j].csize = csize;
+      members[j].crc = ArchiveLE32(entry + 16);
+    }
+  }
+  return 1;
+}
+
+static const char* ArchiveDecompressor(const char *type) {
+  if (!strcmp(type, "application/gzip")) return "gzip";
+  if (!strcmp(type, "application/zstd")) return "zstd";
+  if (!strcmp(type, "application/x-xz")) return "xz";
+  if (!strcmp(type, "application/x-bzip2")) return "bzip2";
+  return NULL;
+}
+
+// Looks up every member of one archive, all sharing members[0].archive.
+// Returns 0 if the archive cannot be read or a member is missing.
+int ArchiveIndex(ArchiveMember *members, size_t count) {
+  const char *path = members[0].archive;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG("Cannot open archive %s\n", path);
+    return 0;
+  }
+
+  struct stat sb;
+  unsigned char head[ARCHIVE_BLOCK] = {0};
+  ssize_t n = fstat(fd, &sb) == 0 ? pread(fd, head, sizeof(head), 0) : -1;
+  if (n <= 0) {
+    close(fd);
+    return 0;
+  }
+
+  const char *type = MimeSniff(head, n, path);
+  const char *decompressor = ArchiveDecompressor(type);
+  int ok;
+  if (!strcmp(type, "application/x-tar")) {
+    ok = TarIndex(fd, members, count);
+  } else if (!strcmp(type, "application/zip")) {
+    ok = ZipIndex(fd, sb.st_size, members, count);
+  } else if (decompressor) {
+    for (size_t i = 0; i < count; i++) {
+      members[i].found = 1;
+      members[i].kind = ARCHIVE_COMPRESSED_TAR;
+      members[i].size = -1;
+      members[i].decompressor = decompressor;
+    }
+    ok = 1;
+  } else {
+    LOG("Not a tar or zip archive: %s\n", path);
+    ok = 0;
+  }
+  close(fd);
+
+  for (size_t i = 0; ok && i < count; i++) {
+    if (!members[i].found) {
+      LOG("No member %s in %s\n", members[i].name, path);
+      ok = 0;
+    }
+  }
+  return ok;
+}
+
+static int WriteAll(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// Copies 'len' bytes (or up to EOF when len < 0) from a pipe to 'out'.
+static int ArchiveCopyStream(int in, off_t len, int out) {
+  char buf[65536];
+  while (len != 0) {
+    size_t want = len < 0 || len > (off_t)sizeof(buf) ? sizeof(buf) : (size_t)len;
+    ssize_t n = splice(in, NULL, out, NULL, want, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINVAL) {
+      n = read(in, buf, want); // 'out' cannot be spliced to
+      if (n > 0 && !WriteAll(out, buf, n)) return 0;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return 0;
+    if (n == 0) return len < 0;
+    if (len > 0) len -= n;
+  }
+  return 1;
+}
+
+static pid_t ArchiveExec(const char *program, const char *arg, int in, int out) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (in >= 0) dup2(in, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    execlp(program, program, "-dcq", arg, (char*)NULL);
+    _exit(127);
+  }
+  return pid;
+}
+
+typedef struct {
+  int fd;
+} TarPipe;
+
+static int TarPipeRead(void *ctx, void *buf, size_t len) {
+  return ArchiveRead(((TarPipe*)ctx)->fd, buf, len);
+}
+
+// Runs in the child: finds the member in the decompressed tar stream.
+static int ArchiveStreamMember(const ArchiveMember *m, int out) {
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) < 0) return 0;
+  pid_t pid = ArchiveExec(m->decompressor, m->archive, -1, p[1]);
+  close(p[1]);
+  if (pid < 0) return 0;
+
+  unsigned char header[ARCHIVE_BLOCK];
+  char long_name[PATH_MAX] = "", name[PATH_MAX];
+  TarPipe t = { .fd = p[0] };
+  int ok = 0;
+
+  while (TarPipeRead(&t, header, sizeof(header)) && header[0]) {
+    off_t size = TarNumber(header + 124, 12);
+    off_t padded = (size + ARCHIVE_BLOCK - 1) & ~(off_t)(ARCHIVE_BLOCK - 1);
+    char type = header[156];
+
+    if (type == 'L' || type == 'x') {
+      if (!TarMeta(header, size, TarPipeRead, &t, long_name)) break;
+      continue;
+    }
+
+    TarEntryName(header, long_name, name);
+    if ((type == '0' || type == '\0' || type == '7') &&
+        !strcmp(ArchiveTrim(name), ArchiveTrim(m->name))) {
+      ok = ArchiveCopyStream(p[0], size, out);
+      break;
+    }
+
+    char skip[ARCHIVE_BLOCK * 16];
+    while (padded > 0) {
+      size_t n = padded > (off_t)sizeof(skip) ? sizeof(skip) : (size_t)padded;
+      if (!ArchiveRead(p[0], skip, n)) break;
+      padded -= n;
+    }
+    if (padded > 0) break;
+  }
+
+  close(p[0]);
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  return ok;
+}
+
+// Runs in the child: wraps the raw deflate data in a gzip header and
+// trailer and lets gzip inflate and verify it.
+static int ArchiveInflateMember(const ArchiveMember *m, int out) {
+  int fd = open(m->archive, O_RDONLY | O_CLOEXEC);
+  int p[2];
+  if (fd < 0 || pipe2(p, O_CLOEXEC) < 0) return 0;
+  pid_t pid = ArchiveExec("gzip", "-", p[0], out);
+  close(p[0]);
+  if (pid < 0) return 0;
+
+  static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+  unsigned char trailer[8];
+  for (int i = 0; i < 4; i++) {
+    trailer[i] = m->crc >> (8 * i);
+    trailer[4 + i] = (uint32_t)m->size >> (8 * i);
+  }
+
+  int ok = write(p[1], header, sizeof(header)) == sizeof(header);
+  off_t offset = m->offset, end = m->offset + m->csize;
+  while (ok && offset < end) {
+    ssize_t n = sendfile(p[1], fd, &offset, end - offset);
+    if (n < 0 && errno == EINTR) continue;
+    ok = n > 0;
+  }
+  ok = ok && write(p[1], trailer, sizeof(trailer)) == sizeof(trailer);
+  close(p[1]);
+  close(fd);
+
+  int status;
+  waitpid(pid, &status, 0);
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int ArchiveWriteMember(const ArchiveMember *m, int out) {
+  signal(SIGPIPE, SIG_DFL);
+  if (m->kind == ARCHIVE_DEFLATE) return ArchiveInflateMember(m, out);
+  if (m->kind == ARCHIVE_COMPRESSED_TAR) return ArchiveStreamMember(m, out);
+
+  int fd = open(m->archive, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  off_t offset = m->offset, end = m->offset + m->size;
+  while (offset < end) {
+    ssize_t n = sendfile(out, fd, &offset, end - offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+  }
+  return 1;
+}
+
+// Writes the member's bytes to 'out' from a child process. With 'detach'
+// the writer is orphaned right away and nothing has to wait for it;
+// otherwise the caller waits for the returned pid. Returns -1 on failure.
+pid_t ArchiveSpawn(const ArchiveMember *m, int out, int detach) {
+  pid_t pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    if (detach && fork() != 0) _exit(0);
+    // The decompressors must still die on SIGTERM, which the parent blocks.
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    // Don't hold other transfers' pipes open for as long as this runs.
+    if (out != 3) {
+      dup2(out, 3);
+      out = 3;
+    }
+    syscall(SYS_close_range, 4, ~0U, 0);
+    _exit(ArchiveWriteMember(m, out) ? 0 : 1);
+  }
+  if (detach) waitpid(pid, NULL, 0);
+  return pid;
+}
+
+// Sniffs the first bytes of a member without extracting the rest. A
+// member of a compressed tar can only be reached by decompressing
+// everything before it, so its type comes from its name instead.
+const char* ArchiveMime(const ArchiveMember *m) {
+  if (m->kind == ARCHIVE_COMPRESSED_TAR) return MimeFromName(m->name);
+
+  unsigned char buf[MIME_SNIFF_SIZE];
+  ssize_t n = 0;
+
+  if (m->kind == ARCHIVE_STORED) {
+    int fd = open(m->archive, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return MIME_UNKNOWN;
+    size_t want = m->size < (off_t)sizeof(buf) ? (size_t)m->size : sizeof(buf);
+    n = ArchiveReadAt(fd, buf, want, m->offset) ? (ssize_t)want : -1;
+    close(fd);
+  } else {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) return MIME_UNKNOWN;
+    pid_t pid = ArchiveSpawn(m, p[1], 0);
+    close(p[1]);
+    while (pid > 0 && n < (ssize_t)sizeof(buf)) {
+      ssize_t r = read(p[0], buf + n, sizeof(buf) - n);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) break;
+      n += r;
+    }
+    close(p[0]); // the writer stops on EPIPE
+    if (pid > 0) waitpid(pid, NULL, 0);
+  }
+
+  if (n < 0) return MIME_UNKNOWN;
+  return n ? MimeSniff(buf, n, m->name) : "text/plain";
+}
+
+#endif // DRAG_ARCHIVE_H
@@ -0,0 +1,168 @@
+#ifndef DRAG_ARENA_H
+#define DRAG_ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "macros.h"
+
+// Per-session bump allocator. Every allocation made for one drag comes from
+// here and the whole session is released by one ArenaDestroy(). Small
+// allocations are bumped out of shared mmap'd blocks; large ones get a
+// mapping of their own so ArenaGrow() can mremap() them without copying.
+// Memory comes from fresh anonymous mappings and is never reused, so every
+// allocation starts zeroed. Not thread-safe: worker threads use their own
+// arena and ArenaAdopt() it.
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_LARGE (256 << 10)
+#define ARENA_ALIGN 16
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  struct ArenaBlock *prev;
+  size_t size;
+  size_t used;
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock *blocks;    // every mapping owned by the session
+  ArenaBlock *current;   // where small allocations are bumped from
+  size_t allocs;
+  size_t mappings;
+  size_t bytes;
+} Arena;
+
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static size_t ArenaRound(size_t n, size_t to) {
+  return (n + to - 1) & ~(to - 1);
+}
+
+static void ArenaLink(Arena *a, ArenaBlock *b) {
+  b->prev = NULL;
+  b->next = a->blocks;
+  if (a->blocks) a->blocks->prev = b;
+  a->blocks = b;
+}
+
+static ArenaBlock* ArenaMap(Arena *a, size_t size) {
+  size = ArenaRound(size, 4096);
+  ArenaBlock *b = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b == MAP_FAILED) return NULL;
+  b->size = size;
+  b->used = ARENA_HEADER;
+  ArenaLink(a, b);
+  a->mappings++;
+  return b;
+}
+
+void* ArenaAlloc(Arena *a, size_t size) {
+  size = ArenaRound(size ? size : 1, ARENA_ALIGN);
+  a->allocs++;
+  a->bytes += size;
+
+  if (size >= ARENA_LARGE) {
+    ArenaBlock *b = ArenaMap(a, ARENA_HEADER + size);
+    if (!b) return NULL;
+    b->used = b->size;
+    return (char*)b + ARENA_HEADER;
+  }
+
+  ArenaBlock *b = a->current;
+  if (!b || b->used + size > b->size) {
+    b = ArenaMap(a, ARENA_BLOCK_SIZE);
+    if (!b) return NULL;
+    a->current = b;
+  }
+
+  void *p = (char*)b + b->used;
+  b->used += size;
+  return p;
+}
+
+// Resizes an allocation of 'old' bytes. Grows in place when 'ptr' is the
+// last bump allocation, remaps large allocations, and copies otherwise.
+void* ArenaGrow(Arena *a, void *ptr, size_t old, size_t size) {
+  if (!ptr) return ArenaAlloc(a, size);
+
+  old = ArenaRound(old ? old : 1, ARENA_ALIGN);
+  size = ArenaRound(size, ARENA_ALIGN);
+  if (size <= old) return ptr;
+
+  if (old >= ARENA_LARGE) {
+    ArenaBlock *b = (ArenaBlock*)((char*)ptr - ARENA_HEADER);
+    size_t mapped = ArenaRound(ARENA_HEADER + size, 4096);
+    ArenaBlock *n = mremap(b, b->size, mapped, MREMAP_MAYMOVE);
+    if (n == MAP_FAILED) return NULL;
+    n->size = n->used = mapped;
+    if (n->prev) n->prev->next = n; else a->blocks = n;
+    if (n->next) n->next->prev = n;
+    a->bytes += size - old;
+    return (char*)n + ARENA_HEADER;
+  }
+
+  ArenaBlock *b = a->current;
+  if (b && (char*)ptr + old == (char*)b + b->used &&
+      size < ARENA_LARGE && b->used - old + size <= b->size) {
+    b->used += size - old;
+    a->bytes += size - old;
+    return ptr;
+  }
+
+  void *p = ArenaAlloc(a, size);
+  if (p) memcpy(p, ptr, old);
+  return p;
+}
+
+char* ArenaStrndup(Arena *a, const char *s, size_t len) {
+  char *p = ArenaAlloc(a, len + 1);
+  if (!p) return NULL;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+// Creates an arena that lives inside its own first block.
+Arena* ArenaCreate(void) {
+  Arena tmp = {0};
+  Arena *a = ArenaAlloc(&tmp, sizeof(Arena));
+  if (!a) return NULL;
+  *a = tmp;
+  return a;
+}
+
+// Moves every block of 'src' into 'dst'. 'src' must not be used afterwards.
+void ArenaAdopt(Arena *dst, Arena *src) {
+  dst->allocs += src->allocs;
+  dst->mappings += src->mappings;
+  dst->bytes += src->bytes;
+
+  for (ArenaBlock *b = src->blocks, *next; b; b = next) {
+    next = b->next;
+    ArenaLink(dst, b);
+  }
+}
+
+void ArenaReport(const Arena *a, const char *label) {
+  LOG("%s: %zu allocations, %zu mappings, %zu bytes\n",
+      label, a->allocs, a->mappings, a->bytes);
+  if (getenv("DRAG_STATS")) {
+    fprintf(stderr, "drag: %s: %zu allocations, %zu mappings, %zu bytes\n",
+            label, a->allocs, a->mappings, a->bytes);
+  }
+}
+
+void ArenaDestroy(Arena *a) {
+  if (!a) return;
+  ArenaBlock *b = a->blocks;
+  while (b) {
+    ArenaBlock *next = b->next;
+    munmap(b, b->size);
+    b = next;
+  }
+}
+
+#endif // DRAG_ARENA_H
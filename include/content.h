@@ -0,0 +1,124 @@
+#ifndef DRAG_CONTENT_H
+#define DRAG_CONTENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "macros.h"
+
+// Zero-copy transfer of file contents to a receiver's fd. Bytes move from
+// the page cache into the pipe with splice(), or sendfile() when the fd is
+// not a pipe, so even multi-GB files never pass through our memory. The
+// cursor is resumable: on a non-blocking fd it returns as soon as the
+// receiver stops reading and picks up at the same offset later.
+
+#define CONTENT_STEP (1 << 20)
+
+typedef struct {
+  int in;
+  off_t offset;
+  off_t end;
+  int use_sendfile;
+} ContentCursor;
+
+// Checks that 'fd' is a regular file and resolves a negative 'size' to
+// the rest of the file.
+static int ContentRange(int fd, off_t offset, off_t *size) {
+  struct stat sb;
+  if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) return 0;
+  if (*size < 0) *size = sb.st_size - offset;
+  return offset + *size <= sb.st_size;
+}
+
+// Serves 'size' bytes of 'fd' from 'offset', or the whole file when size
+// is negative. Takes ownership of 'fd', which may be -1 after a failed open.
+int ContentOpen(ContentCursor *c, int fd, off_t offset, off_t size) {
+  *c = (ContentCursor){ .in = fd, .offset = offset };
+  if (c->in < 0) return 0;
+
+  if (!ContentRange(fd, offset, &size)) {
+    close(c->in);
+    c->in = -1;
+    return 0;
+  }
+  c->end = offset + size;
+  posix_fadvise(c->in, offset, size, POSIX_FADV_SEQUENTIAL);
+  return 1;
+}
+
+// Moves bytes into 'out' until it is done or would block.
+// Returns 1 when everything was sent, 0 to be called again once 'out' is
+// writable and -1 on error.
+int ContentStep(ContentCursor *c, int out) {
+  while (c->offset < c->end) {
+    size_t want = c->end - c->offset;
+    if (want > CONTENT_STEP) want = CONTENT_STEP;
+
+    ssize_t n;
+    if (!c->use_sendfile) {
+      n = splice(c->in, &c->offset, out, NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0 && errno == EINVAL) {
+        c->use_sendfile = 1; // not a pipe
+        continue;
+      }
+    } else {
+      n = sendfile(out, c->in, &c->offset, want);
+    }
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return 0;
+      return -1;
+    }
+    if (n == 0) return -1; // file shrank under us
+  }
+  return 1;
+}
+
+void ContentClose(ContentCursor *c) {
+  if (c->in >= 0) close(c->in);
+  c->in = -1;
+}
+
+// Maps a file read-only for protocols that need the bytes in our address
+// space, like X11 properties. Pages are read in by the kernel on demand and
+// dropped again under memory pressure, nothing is copied to the heap.
+// Empty ranges map to a NULL pointer with size 0. Takes the same range
+// arguments as ContentOpen() and closes 'fd'.
+int ContentMap(int fd, off_t offset, off_t size, const char **data, size_t *len) {
+  if (fd < 0) return 0;
+  if (!ContentRange(fd, offset, &size)) {
+    close(fd);
+    return 0;
+  }
+
+  *len = size;
+  *data = NULL;
+  if (size > 0) {
+    off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t mapped = size + (offset - start);
+    char *map = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE, fd, start);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return 0;
+    }
+    madvise(map, mapped, MADV_SEQUENTIAL);
+    *data = map + (offset - start);
+  }
+  close(fd);
+  return 1;
+}
+
+void ContentUnmap(const char *data, size_t len) {
+  if (!data) return;
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)data & ~(page - 1);
+  munmap((void*)start, len + ((uintptr_t)data - start));
+}
+
+#endif // DRAG_CONTENT_H
@@ -0,0 +1,538 @@
+#ifndef DRAG_CORE_H
+#define DRAG_CORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "macros.h"
+#include "arena.h"
+#include "shared.h"
+
+// The session loop both backends run in. A backend describes how to talk
+// to its display server in a DragBackend; the core owns everything else:
+// the poll loop, the watchdog's deadlines and signals, the --daemon
+// client, the background metadata for the label, and the counters a
+// DEBUG build prints at the end of each session. Whatever is added here,
+// like a new timer or a new kind of fd to wait on, works for both.
+
+typedef struct Core Core;
+typedef void (*CoreHandler)(Core *core, void *ctx, short revents);
+
+typedef struct {
+  const char *name;           // "X11": the daemon socket and library names
+  const char *display_env;    // the variable naming the display, e.g. "DISPLAY"
+  const char *display_default;
+
+  // The connection and what is looked up on it once, shared by every
+  // session of a --daemon or a library. NULL when it can't connect.
+  void* (*connect)(void);
+  void (*disconnect)(void *context);
+  int (*get_fd)(void *context);
+  // Between --daemon sessions, when get_fd() is readable. 0 once the
+  // connection is gone.
+  int (*idle)(void *context);
+
+  // Shows the label, drop target or clipboard owner for core->file. Each
+  // session ends with end_drag(), also when this fails.
+  int (*start_drag)(Core *core);
+  // Redraws the label, e.g. once the totals are known.
+  void (*create_icon)(Core *core, const char *text);
+  // Before every poll: handles the events already queued, flushes
+  // requests and adds this round's fds with CoreWatch(). 0 on a broken
+  // connection.
+  int (*prepare)(Core *core);
+  // After every successful prepare(), with get_fd()'s revents, or 0 when
+  // the round ended without a poll. 0 on a broken connection.
+  int (*dispatch)(Core *core, short revents);
+  // Transfers still moving data, which hold off the drop timeout.
+  int (*busy)(Core *core);
+  // Tears the session down. It may still change core->reason.
+  void (*end_drag)(Core *core);
+} DragBackend;
+
+typedef struct {
+  CoreHandler handler;
+  void *ctx;
+} CoreSource;
+
+typedef struct {
+  uint64_t started;           // WatchdogNow() when the session started
+  uint64_t wakeups;           // poll() returns
+  uint64_t display_wakeups;   // ... with events from the display server
+  uint64_t longest_ms;        // the longest round of handling them
+} CoreStats;
+
+// The fixed pollfds; CoreWatch() ones follow.
+enum { CORE_DISPLAY, CORE_TIMER, CORE_SIGNAL, CORE_CLIENT, CORE_META, CORE_FIXED };
+
+struct Core {
+  const DragBackend *backend;
+  void *context;              // from connect()
+  void *session;              // the backend's own, for this session
+  FileInfo *file;
+  Arena *arena;               // this session's, only used on the loop's thread
+  Watchdog watchdog;
+  ExitReason reason;          // set to end the session
+  int client;                 // --daemon client or library cancel fd, -1
+  int meta_fd;
+  uint64_t deadline;          // the backend's earliest own deadline, from prepare()
+  struct pollfd *fds;
+  CoreSource *sources;        // CoreWatch() handlers, parallel to fds[CORE_FIXED..]
+  size_t count;
+  size_t capacity;
+  CoreStats stats;
+};
+
+// Ends the session, unless something already did.
+static inline void CoreStop(Core *core, ExitReason reason) {
+  if (core->reason == EXIT_REASON_NONE) core->reason = reason;
+}
+
+// Waits for 'fd' in this round only; prepare() adds it again for the next.
+// 'handler' runs once poll() returns with any of 'events' or an error.
+int CoreWatch(Core *core, int fd, short events, CoreHandler handler, void *ctx) {
+  if (core->count == core->capacity) {
+    size_t capacity = core->capacity * 2;
+    struct pollfd *fds = ArenaGrow(
+      core->arena, core->fds,
+      (CORE_FIXED + core->capacity) * sizeof(struct pollfd), (CORE_FIXED + capacity) * sizeof(struct pollfd)
+    );
+    if (!fds) return 0;
+    core->fds = fds;
+    CoreSource *sources = ArenaGrow(
+      core->arena, core->sources,
+      core->capacity * sizeof(CoreSource), capacity * sizeof(CoreSource)
+    );
+    if (!sources) return 0;
+    core->sources = sources;
+    core->capacity = capacity;
+  }
+  core->fds[CORE_FIXED + core->count] = (struct pollfd){ .fd = fd, .events = events };
+  core->sources[core->count++] = (CoreSource){ handler, ctx };
+  return 1;
+}
+
+static void CoreLoop(Core *core) {
+  const DragBackend *b = core->backend;
+  while (core->reason == EXIT_REASON_NONE) {
+    core->count = 0;
+    core->deadline = 0;
+    if (!b->prepare(core)) {
+      CoreStop(core, EXIT_REASON_ERROR);
+      break;
+    }
+    if (core->reason != EXIT_REASON_NONE) {
+      b->dispatch(core, 0);
+      break;
+    }
+
+    core->fds[CORE_DISPLAY] = (struct pollfd){ .fd = b->get_fd(core->context), .events = POLLIN };
+    core->fds[CORE_TIMER] = (struct pollfd){ .fd = core->watchdog.timer_fd, .events = POLLIN };
+    core->fds[CORE_SIGNAL] = (struct pollfd){ .fd = core->watchdog.signal_fd, .events = POLLIN };
+    core->fds[CORE_CLIENT] = (struct pollfd){ .fd = core->client, .events = POLLIN };
+    core->fds[CORE_META] = (struct pollfd){ .fd = core->meta_fd, .events = POLLIN };
+
+    WatchdogArm(&core->watchdog, core->deadline);
+    int ready = poll(core->fds, CORE_FIXED + core->count, -1);
+    if (ready < 0) {
+      b->dispatch(core, 0);
+      if (errno == EINTR) continue;
+      CoreStop(core, EXIT_REASON_ERROR);
+      break;
+    }
+
+    uint64_t woke = WatchdogNow();
+    core->stats.wakeups++;
+    short display = core->fds[CORE_DISPLAY].revents;
+    if (display) core->stats.display_wakeups++;
+    if (!b->dispatch(core, display)) {
+      CoreStop(core, EXIT_REASON_ERROR);
+      break;
+    }
+
+    if (core->fds[CORE_SIGNAL].revents & POLLIN) CoreStop(core, WatchdogSignaled(&core->watchdog));
+    if (core->fds[CORE_CLIENT].revents) CoreStop(core, EXIT_REASON_CANCELLED);
+    if (core->reason != EXIT_REASON_NONE) break;
+
+    if (core->fds[CORE_META].revents & POLLIN) {
+      FinishMetadata(core->file, core->arena);
+      b->create_icon(core, core->file->name);
+      core->meta_fd = -1;
+    }
+
+    // Handlers may add sources for the next round, never this one.
+    size_t count = core->count;
+    for (size_t i = 0; i < count; i++) {
+      short revents = core->fds[CORE_FIXED + i].revents;
+      if (revents) core->sources[i].handler(core, core->sources[i].ctx, revents);
+    }
+
+    if (core->fds[CORE_TIMER].revents & POLLIN) {
+      CoreStop(core, WatchdogExpired(&core->watchdog, b->busy(core)));
+    }
+
+    uint64_t spent = WatchdogNow() - woke;
+    if (spent > core->stats.longest_ms) core->stats.longest_ms = spent;
+  }
+}
+
+// Runs one drag, drop target or clipboard session for 'file' on a
+// connection from backend->connect(). 'client' ends it once readable.
+// Returns the exit status and, unless NULL, why it ended in 'reason'.
+int CoreRun(const DragBackend *backend, void *context, FileInfo *file, int client, ExitReason *reason) {
+  Core core = {
+    .backend = backend,
+    .context = context,
+    .file = file,
+    .client = client,
+    .meta_fd = -1,
+    .capacity = 16,
+  };
+  core.arena = ArenaCreate();
+  if (!core.arena) return 1;
+
+  core.fds = ArenaAlloc(core.arena, (CORE_FIXED + core.capacity) * sizeof(struct pollfd));
+  core.sources = ArenaAlloc(core.arena, core.capacity * sizeof(CoreSource));
+  const Options *o = &file->options;
+  if (!core.fds || !core.sources ||
+      !WatchdogInit(&core.watchdog, o->idle_timeout, o->drop_timeout, o->transfer_timeout,
+                    !o->embedded && o->signal_fd < 0)) {
+    WatchdogClose(&core.watchdog);
+    ArenaDestroy(core.arena);
+    return 1;
+  }
+  if (o->signal_fd >= 0) WatchdogFollow(&core.watchdog, o->signal_fd);
+  core.stats.started = WatchdogNow();
+
+  if (!backend->start_drag(&core)) {
+    CoreStop(&core, EXIT_REASON_ERROR);
+  } else if (!o->receive && !o->copy) {
+    // The label gets its totals once the background stat pass is done.
+    core.meta_fd = StartMetadata(file);
+  }
+  CoreLoop(&core);
+  backend->end_drag(&core);
+
+  LOG("%s session: %llu ms, %llu wakeups, %llu from the display, longest round %llu ms\n",
+      backend->name,
+      (unsigned long long)(WatchdogNow() - core.stats.started),
+      (unsigned long long)core.stats.wakeups,
+      (unsigned long long)core.stats.display_wakeups,
+      (unsigned long long)core.stats.longest_ms);
+
+  int status = WatchdogReport(&core.watchdog, core.reason);
+  WatchdogClose(&core.watchdog);
+  ArenaDestroy(core.arena);
+  if (reason) *reason = core.reason;
+  return status;
+}
+
+typedef struct {
+  const DragBackend *backend;
+  void *context;
+} CoreDaemon;
+
+static int CoreDaemonIdle(void *arg) {
+  CoreDaemon *d = arg;
+  return d->backend->idle(d->context);
+}
+
+static int CoreDaemonSession(void *arg, int argc, char **argv, int client, int signal_fd) {
+  CoreDaemon *d = arg;
+  FileInfo *file = CommandLineArguments(argc, argv);
+  if (!file) return 1;
+  file->options.signal_fd = signal_fd;
+  int status = CoreRun(d->backend, d->context, file, client, NULL);
+  FileInfoFree(file);
+  return status;
+}
+
+// drag --session: many drags on one connection, scripted over stdin with
+// one command per line. The paths collected with 'add' stay until 'clear';
+// each 'start' copies them into a job that runs CoreRun() on a worker
+// thread, like a libdrag session, and prints one JSON line on stdout when
+// it ends. The connection, its atoms, cursors and shm pools are set up
+// once, as for --daemon.
+
+typedef struct {
+  Arena *arena;           // the job's argv, gone once it has ended
+  FileInfo *file;
+  const DragBackend *backend;
+  void *context;
+  size_t paths;
+  int cancel_fd;
+  int done_fd;
+  pthread_t thread;
+  int running;
+  int status;
+  ExitReason reason;
+  uint64_t started;
+} CoreJob;
+
+static void* CoreJobThread(void *arg) {
+  CoreJob *job = arg;
+  job->status = CoreRun(job->backend, job->context, job->file, job->cancel_fd, &job->reason);
+  uint64_t one = 1;
+  if (write(job->done_fd, &one, sizeof(one)) < 0) LOG("Cannot signal the end of the drag\n");
+  return NULL;
+}
+
+static const char* CoreReasonName(ExitReason reason) {
+  switch (reason) {
+    case EXIT_REASON_NONE:
+    case EXIT_REASON_DROPPED: return "dropped";
+    case EXIT_REASON_CANCELLED: return "cancelled";
+    case EXIT_REASON_IDLE: return "idle-timeout";
+    case EXIT_REASON_DROP_TIMEOUT: return "drop-timeout";
+    case EXIT_REASON_SIGNAL: return "signal";
+    case EXIT_REASON_ERROR: return "error";
+  }
+  return "error";
+}
+
+static void CoreJobReport(CoreJob *job, unsigned long number) {
+  printf("{\"drag\":%lu,\"paths\":%zu,\"status\":%d,\"result\":\"%s\",\"ms\":%llu}\n",
+         number, job->paths, job->status, CoreReasonName(job->reason),
+         (unsigned long long)(WatchdogNow() - job->started));
+  fflush(stdout);
+}
+
+// Joins the job once 'done' fired and reports it.
+static void CoreJobFinish(CoreJob *job, unsigned long number) {
+  uint64_t value;
+  pthread_join(job->thread, NULL);
+  if (read(job->done_fd, &value, sizeof(value)) < 0) LOG("Cannot reset the done eventfd\n");
+  // A cancel that came too late for this job must not end the next one.
+  if (read(job->cancel_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) LOG("Cannot reset the cancel eventfd\n");
+  FileInfoFree(job->file);
+  ArenaDestroy(job->arena);
+  job->file = NULL;
+  job->arena = NULL;
+  job->running = 0;
+  CoreJobReport(job, number);
+}
+
+static int CoreJobStart(CoreJob *job, const char **paths, size_t count, unsigned long number) {
+  job->arena = ArenaCreate();
+  job->paths = count;
+  job->status = 1;
+  job->reason = EXIT_REASON_ERROR;
+  job->started = WatchdogNow();
+  // Copied, so that a 'clear' can't pull them from under the job.
+  char **argv = job->arena ? ArenaAlloc(job->arena, (count + 3) * sizeof(char*)) : NULL;
+  int argc = 0;
+  if (argv) {
+    argv[argc++] = "drag";
+    argv[argc++] = "--";
+    for (size_t i = 0; i < count && argv; i++) {
+      argv[argc] = ArenaStrndup(job->arena, paths[i], strlen(paths[i]));
+      if (!argv[argc++]) argv = NULL;
+    }
+  }
+  if (argv) {
+    argv[argc] = NULL;
+    job->file = CommandLineArguments(argc, argv);
+  }
+  if (job->file) {
+    // Signals stay with the session's own watchdog.
+    job->file->options.embedded = 1;
+    if (pthread_create(&job->thread, NULL, CoreJobThread, job) == 0) {
+      job->running = 1;
+      return 1;
+    }
+    FileInfoFree(job->file);
+    job->file = NULL;
+  }
+  if (job->arena) ArenaDestroy(job->arena);
+  job->arena = NULL;
+  CoreJobReport(job, number);
+  return 0;
+}
+
+// Reads and runs commands until quit, the end of stdin or a signal.
+static ExitReason CoreSessionLoop(CoreJob *job, Watchdog *watchdog) {
+  const DragBackend *backend = job->backend;
+  void *context = job->context;
+  Arena *arena = ArenaCreate();
+  if (!arena) return EXIT_REASON_ERROR;
+
+  const char **paths = NULL;
+  size_t count = 0, capacity = 0;
+  unsigned long drags = 0;
+  char line[PATH_MAX + 16];
+  size_t length = 0;
+  int waiting = 0, quitting = 0, eof = 0;
+  ExitReason reason = EXIT_REASON_NONE;
+
+  while (reason == EXIT_REASON_NONE) {
+    // Commands already read go first; 'wait' holds the rest back.
+    char *newline;
+    while (!waiting && !quitting && (newline = memchr(line, '\n', length))) {
+      *newline = '\0';
+      char *command = line;
+      size_t consumed = newline - line + 1;
+
+      if (!strncmp(command, "add ", 4) && command[4]) {
+        if (count == capacity) {
+          size_t grown = capacity ? capacity * 2 : 16;
+          const char **p = ArenaGrow(arena, paths, capacity * sizeof(char*), grown * sizeof(char*));
+          if (p) {
+            paths = p;
+            capacity = grown;
+          }
+        }
+        const char *path = count < capacity ? ArenaStrndup(arena, command + 4, strlen(command + 4)) : NULL;
+        if (path) paths[count++] = path;
+        else fprintf(stderr, "drag: out of memory for %s\n", command + 4);
+      } else if (!strcmp(command, "clear")) {
+        // The copies of a running job live in its own arena.
+        ArenaDestroy(arena);
+        arena = ArenaCreate();
+        if (!arena) reason = EXIT_REASON_ERROR;
+        paths = NULL;
+        count = capacity = 0;
+      } else if (!strcmp(command, "start")) {
+        if (job->running) fprintf(stderr, "drag: a drag is still running\n");
+        else if (!count) fprintf(stderr, "drag: nothing to drag, add paths first\n");
+        else CoreJobStart(job, paths, count, ++drags);
+      } else if (!strcmp(command, "wait")) {
+        waiting = job->running;
+      } else if (!strcmp(command, "quit")) {
+        quitting = 1;
+      } else if (command[0]) {
+        fprintf(stderr, "drag: unknown session command: %s\n", command);
+      }
+      memmove(line, line + consumed, length - consumed);
+      length -= consumed;
+    }
+    if (reason != EXIT_REASON_NONE) break;
+    if ((quitting || eof) && !job->running) break;
+
+    if (length == sizeof(line)) {
+      fprintf(stderr, "drag: session command too long\n");
+      length = 0;
+    }
+
+    struct pollfd fds[4] = {
+      { .fd = waiting || quitting || eof ? -1 : STDIN_FILENO, .events = POLLIN },
+      { .fd = watchdog->signal_fd, .events = POLLIN },
+      { .fd = job->done_fd, .events = POLLIN },
+      // A running job's thread owns the connection.
+      { .fd = job->running ? -1 : backend->get_fd(context), .events = POLLIN },
+    };
+    if (poll(fds, 4, -1) < 0) {
+      if (errno == EINTR) continue;
+      reason = EXIT_REASON_ERROR;
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) reason = WatchdogSignaled(watchdog);
+    if (fds[2].revents & POLLIN) {
+      CoreJobFinish(job, drags);
+      waiting = 0;
+    }
+    if (fds[3].revents && !backend->idle(context)) reason = EXIT_REASON_ERROR;
+    if (fds[0].revents) {
+      ssize_t n = read(STDIN_FILENO, line + length, sizeof(line) - length);
+      if (n > 0) {
+        length += n;
+      } else if (n == 0 || errno != EINTR) {
+        // A last command without its newline still counts.
+        if (length && length < sizeof(line)) line[length++] = '\n';
+        eof = n == 0;
+        if (n < 0) reason = EXIT_REASON_ERROR;
+      }
+    }
+  }
+
+  if (job->running) {
+    uint64_t one = 1;
+    if (reason != EXIT_REASON_NONE && write(job->cancel_fd, &one, sizeof(one)) < 0) {
+      LOG("Cannot cancel the running drag\n");
+    }
+    CoreJobFinish(job, drags);
+  }
+  if (arena) ArenaDestroy(arena);
+  return reason;
+}
+
+static int CoreSession(const DragBackend *backend, void *context) {
+  CoreJob job = {
+    .backend = backend,
+    .context = context,
+    .cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK),
+    .done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK),
+  };
+  // Blocked before the first job's thread starts, which inherits the mask.
+  Watchdog watchdog;
+  int status = 1;
+  if (WatchdogInit(&watchdog, 0, 0, 0, 1) && job.cancel_fd >= 0 && job.done_fd >= 0) {
+    status = WatchdogReport(&watchdog, CoreSessionLoop(&job, &watchdog));
+  }
+  WatchdogClose(&watchdog);
+  if (job.cancel_fd >= 0) close(job.cancel_fd);
+  if (job.done_fd >= 0) close(job.done_fd);
+  return status;
+}
+
+// The drag itself, once no --daemon took it: connects and runs the
+// session, becomes the daemon, or serves a --session.
+int CoreServe(const DragBackend *backend, int argc, char **argv) {
+  // A receiver closing its end early must not kill us mid-write.
+  signal(SIGPIPE, SIG_IGN);
+
+  const char *display = getenv(backend->display_env);
+  if (!display) display = backend->display_default;
+  char socket_path[PATH_MAX];
+  int daemon = DaemonRequested(argc, argv);
+  int session = argc == 2 && !strcmp(argv[1], "--session");
+  if (daemon && !DaemonPath(socket_path, sizeof(socket_path), backend->name, display)) {
+    fprintf(stderr, "drag: --daemon needs XDG_RUNTIME_DIR\n");
+    return 1;
+  }
+
+  FileInfo *file = NULL;
+  if (!daemon && !session) {
+    file = CommandLineArguments(argc, argv);
+    if (!file) return 1;
+  }
+
+  void *context = backend->connect();
+  if (!context) {
+    if (file) FileInfoFree(file);
+    return 1;
+  }
+
+  int status;
+  if (daemon) {
+    CoreDaemon d = { backend, context };
+    status = DaemonRun(socket_path, backend->get_fd(context), CoreDaemonIdle, CoreDaemonSession, &d);
+  } else if (session) {
+    status = CoreSession(backend, context);
+  } else {
+    status = CoreRun(backend, context, file, -1, NULL);
+  }
+  // Disconnected before 'file' goes, whose arena may hold transfers.
+  backend->disconnect(context);
+  if (file) FileInfoFree(file);
+  return status;
+}
+
+// The whole program of a drag-<backend> binary.
+int CoreMain(const DragBackend *backend, int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+  const char *display = getenv(backend->display_env);
+  int status = DaemonHandOff(backend->name, display ? display : backend->display_default, argc, argv);
+  if (status >= 0) return status;
+  return CoreServe(backend, argc, argv);
+}
+
+#endif // DRAG_CORE_H
@@ -0,0 +1,351 @@
+#ifndef DRAG_DAEMON_H
+#define DRAG_DAEMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "macros.h"
+#include "archive.h"
+#include "watchdog.h"
+
+// drag --daemon: keeps the display connection and everything looked up on
+// it (atoms, globals, the cursor, buffers) open between drags, behind a
+// unix socket in $XDG_RUNTIME_DIR. A plain drag first tries that socket.
+// When a daemon answers, it hands over its arguments, its stdin, stdout,
+// stderr and working directory, then waits for the exit status. The drag
+// then starts after one round trip instead of a connection setup. Without
+// a daemon it runs on its own as before.
+//
+// Both ends must belong to the same user. The daemon runs one drag at a
+// time; a client it doesn't acknowledge quickly runs on its own instead
+// of queueing behind a drag in progress.
+
+#define DAEMON_MAGIC 0x67617264u      // "drag"
+#define DAEMON_ACK_MS 250             // wait for a busy daemon at most this long
+#define DAEMON_ARGS_MAX (1 << 21)     // like ARG_MAX
+
+enum { DAEMON_STDIN, DAEMON_STDOUT, DAEMON_STDERR, DAEMON_CWD, DAEMON_FD_COUNT };
+
+// Sent with the client's fds, followed by 'size' bytes of NUL-terminated
+// arguments once the daemon acknowledged it.
+typedef struct {
+  uint32_t magic;
+  uint32_t argc;
+  uint64_t size;
+} DaemonRequest;
+
+// Runs one drag for a client with the usual argv. 'client' is the
+// connection, which becomes readable if the client goes away mid-drag.
+// 'signal_fd' is the daemon's signalfd: the drag ends on the daemon's
+// signals but leaves them to it. Returns the exit status.
+typedef int (*DaemonSession)(void *ctx, int argc, char **argv, int client, int signal_fd);
+
+// The display connection is readable between drags. Returns 0 once it is
+// gone, which ends the daemon.
+typedef int (*DaemonIdle)(void *ctx);
+
+int DaemonRequested(int argc, char **argv) {
+  return argc == 2 && strcmp(argv[1], "--daemon") == 0;
+}
+
+// "$XDG_RUNTIME_DIR/drag-X11-:0.sock": one daemon per backend and display.
+// Returns 0 without a runtime directory, since /tmp is shared.
+int DaemonPath(char *out, size_t size, const char *backend, const char *display) {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (!dir || !*dir) return 0;
+  char name[64];
+  snprintf(name, sizeof(name), "%s", display && *display ? display : "default");
+  for (char *p = name; *p; p++) {
+    if (*p == '/') *p = '_';
+  }
+  int n = snprintf(out, size, "%s/drag-%s-%s.sock", dir, backend, name);
+  return n > 0 && (size_t)n < sizeof(((struct sockaddr_un*)0)->sun_path) && (size_t)n < size;
+}
+
+static int DaemonConnect(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Whoever is at the other end runs as this user, so nobody else's daemon
+// gets our fds and nobody else gets a drag out of ours.
+static int DaemonSameUser(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid();
+}
+
+static int DaemonReadAll(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    p += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// The client side. Returns the daemon's exit status for the drag, or -1
+// when there is no daemon to take it and the caller runs it itself.
+int DaemonForward(const char *path, int argc, char **argv) {
+  int fd = DaemonConnect(path);
+  if (fd < 0) return -1;
+  if (!DaemonSameUser(fd)) {
+    LOG("Ignoring %s, owned by another user\n", path);
+    close(fd);
+    return -1;
+  }
+
+  // A closed stdio fd can't be passed; the daemon gets /dev/null instead.
+  int fds[DAEMON_FD_COUNT], opened[DAEMON_FD_COUNT] = { -1, -1, -1, -1 };
+  for (int i = 0; i < DAEMON_CWD; i++) {
+    fds[i] = i;
+    if (fcntl(i, F_GETFD) < 0) fds[i] = opened[i] = open("/dev/null", O_RDWR | O_CLOEXEC);
+  }
+  fds[DAEMON_CWD] = opened[DAEMON_CWD] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+  DaemonRequest req = { .magic = DAEMON_MAGIC, .argc = argc - 1 };
+  for (int i = 1; i < argc; i++) req.size += strlen(argv[i]) + 1;
+
+  union { char buf[CMSG_SPACE(sizeof(fds))]; struct cmsghdr align; } control;
+  struct iovec iov = { .iov_base = &req, .iov_len = sizeof(req) };
+  struct msghdr msg = {
+    .msg_iov = &iov, .msg_iovlen = 1,
+    .msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  int valid = fds[DAEMON_CWD] >= 0 && req.size <= DAEMON_ARGS_MAX;
+  for (int i = 0; i < DAEMON_CWD; i++) valid &= fds[i] >= 0;
+  ssize_t sent = valid ? sendmsg(fd, &msg, MSG_NOSIGNAL) : -1;
+  for (int i = 0; i < DAEMON_FD_COUNT; i++) {
+    if (opened[i] >= 0) close(opened[i]);
+  }
+
+  // A daemon busy with another drag doesn't answer; run this one alone.
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  char ack;
+  if (sent != sizeof(req) || poll(&pfd, 1, DAEMON_ACK_MS) != 1 || read(fd, &ack, 1) != 1) {
+    LOG("No answer from the daemon, dragging without it\n");
+    close(fd);
+    return -1;
+  }
+
+  int ok = 1;
+  for (int i = 1; i < argc && ok; i++) {
+    ok = WriteAll(fd, argv[i], strlen(argv[i]) + 1);
+  }
+  int32_t status;
+  if (!ok || !DaemonReadAll(fd, &status, sizeof(status))) {
+    fprintf(stderr, "drag: lost the daemon during the drag\n");
+    status = 1;
+  }
+  close(fd);
+  return status;
+}
+
+// --copy holds the clipboard and --receive its window for as long as the
+// user takes, which would keep the daemon from every other drag.
+static int DaemonLongLived(int argc, char **argv) {
+  for (int i = 1; i < argc && strcmp(argv[i], "--"); i++) {
+    if (!strcmp(argv[i], "--copy") || !strcmp(argv[i], "--receive")) return 1;
+  }
+  return 0;
+}
+
+// What a plain drag does first: hands the command line to the daemon for
+// 'backend' on 'display', if one runs. Returns its exit status, or -1 to
+// run the drag here.
+int DaemonHandOff(const char *backend, const char *display, int argc, char **argv) {
+  char path[PATH_MAX];
+  // A --session keeps its own connection for all of its drags.
+  if (argc == 2 && !strcmp(argv[1], "--session")) return -1;
+  if (DaemonLongLived(argc, argv)) return -1;
+  if (DaemonRequested(argc, argv) || !DaemonPath(path, sizeof(path), backend, display)) return -1;
+  return DaemonForward(path, argc, argv);
+}
+
+// Takes the request header and the client's fds. Anything unexpected
+// drops the connection.
+static int DaemonReceive(int client, DaemonRequest *req, int *fds) {
+  union { char buf[CMSG_SPACE(DAEMON_FD_COUNT * sizeof(int))]; struct cmsghdr align; } control;
+  struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+  struct msghdr msg = {
+    .msg_iov = &iov, .msg_iovlen = 1,
+    .msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t n = recvmsg(client, &msg, MSG_CMSG_CLOEXEC);
+
+  int count = 0;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+    int got = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < got; i++) {
+      int passed;
+      memcpy(&passed, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+      if (count < DAEMON_FD_COUNT) fds[count++] = passed;
+      else close(passed);
+    }
+  }
+  if (n == sizeof(*req) && count == DAEMON_FD_COUNT && !(msg.msg_flags & MSG_CTRUNC) &&
+      req->magic == DAEMON_MAGIC && req->size <= DAEMON_ARGS_MAX) {
+    return 1;
+  }
+  for (int i = 0; i < count; i++) close(fds[i]);
+  return 0;
+}
+
+// Splits the NUL-terminated arguments into an argv with "drag" in front.
+static char** DaemonArgv(char *args, size_t size, uint32_t argc) {
+  if (size && args[size - 1] != '\0') return NULL;
+  size_t count = 0;
+  for (size_t i = 0; i < size; i++) count += args[i] == '\0';
+  if (count != argc) return NULL;
+
+  char **argv = malloc((argc + 2) * sizeof(char*));
+  if (!argv) return NULL;
+  argv[0] = "drag";
+  for (uint32_t i = 0; i < argc; i++) {
+    argv[i + 1] = args;
+    args += strlen(args) + 1;
+  }
+  argv[argc + 1] = NULL;
+  return argv;
+}
+
+// Runs one client's drag in its working directory and on its stdio, then
+// puts the daemon's own back. 'home' is the daemon's own directory and
+// 'stdio' its own stdin, stdout and stderr.
+static void DaemonServeClient(
+  int listener, int home, const int *stdio, int signal_fd, DaemonSession session, void *ctx
+) {
+  int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+  if (client < 0) return;
+
+  // A client that connects and then stalls can't hold up the daemon.
+  struct timeval tv = { .tv_sec = 1 };
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  DaemonRequest req;
+  int fds[DAEMON_FD_COUNT];
+  if (!DaemonSameUser(client) || !DaemonReceive(client, &req, fds)) {
+    LOG("Rejected a daemon client\n");
+    close(client);
+    return;
+  }
+
+  char *args = malloc(req.size + 1);
+  char **argv = NULL;
+  char ack = 1;
+  if (args && send(client, &ack, 1, MSG_NOSIGNAL) == 1 && DaemonReadAll(client, args, req.size)) {
+    argv = DaemonArgv(args, req.size, req.argc);
+  }
+
+  if (argv) {
+    tv.tv_sec = 0;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    for (int i = 0; i < DAEMON_CWD; i++) dup2(fds[i], i);
+    int32_t status = fchdir(fds[DAEMON_CWD]) == 0 ? session(ctx, req.argc + 1, argv, client, signal_fd) : 1;
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < DAEMON_CWD; i++) dup2(stdio[i], i);
+    if (fchdir(home) < 0) LOG("Cannot return to the daemon's directory\n");
+    LOG("Drag finished with status %d\n", (int)status);
+    if (send(client, &status, sizeof(status), MSG_NOSIGNAL) != sizeof(status)) {
+      LOG("The client left before the drag ended\n");
+    }
+  }
+
+  free(argv);
+  free(args);
+  for (int i = 0; i < DAEMON_FD_COUNT; i++) close(fds[i]);
+  close(client);
+}
+
+// The daemon side: serves drags on 'path' until a termination signal
+// arrives or the display connection 'display_fd' goes away.
+int DaemonRun(const char *path, int display_fd, DaemonIdle idle, DaemonSession session, void *ctx) {
+  int running = DaemonConnect(path);
+  if (running >= 0) {
+    close(running);
+    fprintf(stderr, "drag: a daemon is already listening on %s\n", path);
+    return 1;
+  }
+  unlink(path);
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  mode_t mask = umask(0077);
+  int bound = listener >= 0 && bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+  umask(mask);
+  if (!bound || listen(listener, 16) < 0) {
+    fprintf(stderr, "drag: cannot listen on %s: %s\n", path, strerror(errno));
+    if (listener >= 0) close(listener);
+    return 1;
+  }
+
+  // A client's stdout may be a pipe that is closed before the drag ends.
+  signal(SIGPIPE, SIG_IGN);
+
+  Watchdog w;
+  int home = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  int stdio[DAEMON_CWD];
+  for (int i = 0; i < DAEMON_CWD; i++) stdio[i] = fcntl(i, F_DUPFD_CLOEXEC, DAEMON_FD_COUNT);
+  int ok = WatchdogInit(&w, 0, 0, 0, 1) && home >= 0;
+  for (int i = 0; i < DAEMON_CWD; i++) ok &= stdio[i] >= 0;
+  if (ok) LOG("Daemon listening on %s\n", path);
+
+  struct pollfd fds[3] = {
+    { .fd = listener, .events = POLLIN },
+    { .fd = w.signal_fd, .events = POLLIN },
+    { .fd = display_fd, .events = POLLIN },
+  };
+  ExitReason reason = ok ? EXIT_REASON_NONE : EXIT_REASON_ERROR;
+  while (reason == EXIT_REASON_NONE) {
+    if (poll(fds, 3, -1) < 0) {
+      if (errno == EINTR) continue;
+      reason = EXIT_REASON_ERROR;
+      break;
+    }
+    if (fds[1].revents & POLLIN) reason = WatchdogSignaled(&w);
+    else if ((fds[2].revents & (POLLIN | POLLHUP | POLLERR)) && !idle(ctx)) reason = EXIT_REASON_ERROR;
+    else if (fds[0].revents & POLLIN) DaemonServeClient(listener, home, stdio, w.signal_fd, session, ctx);
+  }
+
+  close(listener);
+  unlink(path);
+  if (home >= 0) close(home);
+  for (int i = 0; i < DAEMON_CWD; i++) {
+    if (stdio[i] >= 0) close(stdio[i]);
+  }
+  int status = WatchdogReport(&w, reason);
+  WatchdogClose(&w);
+  // Stopped by a signal is how a daemon is meant to end.
+  return reason == EXIT_REASON_SIGNAL ? 0 : status;
+}
+
+#endif // DRAG_DAEMON_H
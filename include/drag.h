@@ -0,0 +1,74 @@
+#ifndef DRAG_H
+#define DRAG_H
+
+// libdrag: drags, drop targets and clipboard copies from inside another
+// program, without starting the drag binary for each one. Link
+// libdrag-X11 or libdrag-Wayland, the same backends as the binaries.
+//
+// A session takes paths and the command line's options and runs on a
+// thread of its own. The host either calls drag_session_run(), or polls
+// drag_session_get_fd() in its own loop and calls drag_session_step()
+// whenever it is readable. The done callback runs inside that call, on the
+// host's thread. The display connection is opened by the first session
+// and kept for the next, until drag_shutdown(). One session runs at a time.
+//
+// Unlike the binary, the library leaves SIGINT, SIGTERM and SIGHUP to the
+// host. It ignores SIGPIPE, unless the host already handles it, since a
+// receiver may close its pipe halfway through a transfer. On X11 it calls
+// XInitThreads() and installs an error handler.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DRAG_API __attribute__((visibility("default")))
+
+typedef struct DragSession DragSession;
+
+// 'status' is what the binary would exit with: 0 once the drop went
+// through, 1 when it was cancelled or failed, 124 on a timeout.
+typedef void (*DragDoneCallback)(DragSession *session, int status, void *user);
+
+DRAG_API DragSession* drag_session_new(void);
+
+// Adds a path to drag, as on the command line. Returns 0 on failure.
+DRAG_API int drag_session_add_path(DragSession *session, const char *path);
+
+// Adds a command line option, e.g. ("--recursive", NULL) or
+// ("--idle-timeout", "30"). Returns 0 on failure.
+DRAG_API int drag_session_add_option(DragSession *session, const char *option, const char *value);
+
+// Where --receive writes its paths; stdout by default.
+DRAG_API void drag_session_set_output(DragSession *session, int fd);
+
+DRAG_API void drag_session_on_done(DragSession *session, DragDoneCallback done, void *user);
+
+// Starts the drag in the background. Returns 0 if it could not start, also
+// when another session is still running.
+DRAG_API int drag_session_start(DragSession *session);
+
+// Readable once the drag has ended and drag_session_step() has work to do.
+DRAG_API int drag_session_get_fd(const DragSession *session);
+
+// Never blocks. Returns 1 while the drag runs and 0 once it has ended,
+// after calling the done callback.
+DRAG_API int drag_session_step(DragSession *session);
+
+// Starts the drag if needed and waits for it. Returns its status.
+DRAG_API int drag_session_run(DragSession *session);
+
+// Ends a running drag as if it had been cancelled.
+DRAG_API void drag_session_cancel(DragSession *session);
+
+// Cancels the drag if it still runs, waits for it and frees the session.
+DRAG_API void drag_session_free(DragSession *session);
+
+// Closes the display connection, unless a drag still runs. The next
+// session opens a new one.
+DRAG_API void drag_shutdown(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DRAG_H
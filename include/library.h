@@ -0,0 +1,218 @@
+#ifndef DRAG_LIBRARY_H
+#define DRAG_LIBRARY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "macros.h"
+#include "arena.h"
+#include "shared.h"
+#include "core.h"
+#include "drag.h"
+
+// The libdrag API on top of a backend, built with -DDRAG_LIBRARY. The
+// backend that includes this file defines 'Backend' below. A session
+// collects an argv like the command line's and hands it to
+// CommandLineArguments() on a worker thread, which runs CoreRun() on the
+// backend's connection. It ends through two eventfds: 'cancel' sits in the
+// loop's client slot, like a --daemon client that left, and 'done' tells
+// the host's poll loop it is over.
+
+static const DragBackend Backend;
+
+struct DragSession {
+  Arena *arena;
+  const char **options;   // argv[1..] up to "--"
+  size_t option_count;
+  size_t option_capacity;
+  const char **paths;
+  size_t path_count;
+  size_t path_capacity;
+  int output;
+  DragDoneCallback done;
+  void *user;
+  int done_fd;
+  int cancel_fd;
+  pthread_t thread;
+  int started;
+  int finished;           // joined and reported
+  int status;
+};
+
+static pthread_mutex_t LibraryLock = PTHREAD_MUTEX_INITIALIZER;
+static void *LibraryContext;   // the backend's connection, under LibraryLock
+static int LibraryBusy;        // a session is running, under LibraryLock
+
+static int LibraryPush(Arena *arena, const char ***list, size_t *count, size_t *capacity, const char *s) {
+  if (*count == *capacity) {
+    size_t grown = *capacity ? *capacity * 2 : 16;
+    const char **p = ArenaGrow(arena, *list, *capacity * sizeof(char*), grown * sizeof(char*));
+    if (!p) return 0;
+    *list = p;
+    *capacity = grown;
+  }
+  const char *copy = ArenaStrndup(arena, s, strlen(s));
+  if (!copy) return 0;
+  (*list)[(*count)++] = copy;
+  return 1;
+}
+
+DragSession* drag_session_new(void) {
+  DragSession *s = calloc(1, sizeof(*s));
+  if (!s) return NULL;
+  s->arena = ArenaCreate();
+  s->output = STDOUT_FILENO;
+  s->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  s->cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (!s->arena || s->done_fd < 0 || s->cancel_fd < 0) {
+    drag_session_free(s);
+    return NULL;
+  }
+  return s;
+}
+
+int drag_session_add_path(DragSession *s, const char *path) {
+  if (s->started) return 0;
+  return LibraryPush(s->arena, &s->paths, &s->path_count, &s->path_capacity, path);
+}
+
+int drag_session_add_option(DragSession *s, const char *option, const char *value) {
+  if (s->started || strncmp(option, "--", 2) != 0 || !strcmp(option, "--")) return 0;
+  return LibraryPush(s->arena, &s->options, &s->option_count, &s->option_capacity, option) &&
+         (!value || LibraryPush(s->arena, &s->options, &s->option_count, &s->option_capacity, value));
+}
+
+void drag_session_set_output(DragSession *s, int fd) {
+  s->output = fd;
+}
+
+void drag_session_on_done(DragSession *s, DragDoneCallback done, void *user) {
+  s->done = done;
+  s->user = user;
+}
+
+int drag_session_get_fd(const DragSession *s) {
+  return s->done_fd;
+}
+
+static void* LibraryThread(void *arg) {
+  DragSession *s = arg;
+  int argc = 2 + s->option_count + s->path_count;
+  char **argv = ArenaAlloc(s->arena, (argc + 1) * sizeof(char*));
+  s->status = 1;
+
+  FileInfo *file = NULL;
+  if (argv) {
+    int n = 0;
+    argv[n++] = "drag";
+    for (size_t i = 0; i < s->option_count; i++) argv[n++] = (char*)s->options[i];
+    argv[n++] = "--";
+    for (size_t i = 0; i < s->path_count; i++) argv[n++] = (char*)s->paths[i];
+    argv[n] = NULL;
+    file = CommandLineArguments(argc, argv);
+  }
+
+  if (file) {
+    file->options.output = s->output;
+    file->options.embedded = 1;
+    pthread_mutex_lock(&LibraryLock);
+    if (!LibraryContext) LibraryContext = Backend.connect();
+    void *context = LibraryContext;
+    pthread_mutex_unlock(&LibraryLock);
+    if (context) s->status = CoreRun(&Backend, context, file, s->cancel_fd, NULL);
+    FileInfoFree(file);
+  }
+
+  pthread_mutex_lock(&LibraryLock);
+  LibraryBusy = 0;
+  pthread_mutex_unlock(&LibraryLock);
+  uint64_t one = 1;
+  if (write(s->done_fd, &one, sizeof(one)) < 0) LOG("Cannot signal the end of the drag\n");
+  return NULL;
+}
+
+int drag_session_start(DragSession *s) {
+  // Without paths or options the command line would read stdin, which is
+  // the host's.
+  if (s->started || (!s->path_count && !s->option_count)) return 0;
+
+  pthread_mutex_lock(&LibraryLock);
+  int busy = LibraryBusy;
+  LibraryBusy = 1;
+  pthread_mutex_unlock(&LibraryLock);
+  if (busy) {
+    LOG("Another drag is still running\n");
+    return 0;
+  }
+
+  struct sigaction pipe_action;
+  if (sigaction(SIGPIPE, NULL, &pipe_action) == 0 && pipe_action.sa_handler == SIG_DFL) {
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  if (pthread_create(&s->thread, NULL, LibraryThread, s) != 0) {
+    pthread_mutex_lock(&LibraryLock);
+    LibraryBusy = 0;
+    pthread_mutex_unlock(&LibraryLock);
+    return 0;
+  }
+  s->started = 1;
+  return 1;
+}
+
+int drag_session_step(DragSession *s) {
+  if (!s->started || s->finished) return 0;
+  uint64_t ended;
+  if (read(s->done_fd, &ended, sizeof(ended)) != sizeof(ended)) return 1;
+
+  pthread_join(s->thread, NULL);
+  s->finished = 1;
+  if (s->done) s->done(s, s->status, s->user);
+  return 0;
+}
+
+int drag_session_run(DragSession *s) {
+  if (!s->started && !drag_session_start(s)) return 1;
+  struct pollfd pfd = { .fd = s->done_fd, .events = POLLIN };
+  while (drag_session_step(s)) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
+  }
+  return s->status;
+}
+
+void drag_session_cancel(DragSession *s) {
+  uint64_t one = 1;
+  if (s->started && !s->finished && write(s->cancel_fd, &one, sizeof(one)) < 0) {
+    LOG("Cannot cancel the drag\n");
+  }
+}
+
+void drag_session_free(DragSession *s) {
+  if (!s) return;
+  if (s->started && !s->finished) {
+    drag_session_cancel(s);
+    pthread_join(s->thread, NULL);
+  }
+  if (s->done_fd >= 0) close(s->done_fd);
+  if (s->cancel_fd >= 0) close(s->cancel_fd);
+  if (s->arena) ArenaDestroy(s->arena);
+  free(s);
+}
+
+void drag_shutdown(void) {
+  pthread_mutex_lock(&LibraryLock);
+  if (LibraryContext && !LibraryBusy) {
+    Backend.disconnect(LibraryContext);
+    LibraryContext = NULL;
+  }
+  pthread_mutex_unlock(&LibraryLock);
+}
+
+#endif // DRAG_LIBRARY_H
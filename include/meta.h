@@ -0,0 +1,307 @@
+#ifndef DRAG_META_H
+#define DRAG_META_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "macros.h"
+#include "arena.h"
+
+// Background metadata stage for the drag label ("1,204 files · 38 GB").
+// All statx() calls go through one io_uring so thousands of lookups on cold
+// network storage overlap instead of running back to back. Kernels or
+// sandboxes without io_uring fall back to a small thread pool. The drag
+// never waits for it: the job signals an eventfd the backend polls and the
+// label is redrawn when the totals are in.
+
+#define META_RING_ENTRIES 256
+#define META_MAX_THREADS 16
+#define META_COPY_BATCH 64
+
+typedef struct {
+  // The paths region of a FileInfo. The buffer may be moved by another
+  // thread, so it is only read through 'data' while holding 'lock'.
+  char *const *data;
+  size_t paths_size;
+  pthread_mutex_t *lock;
+
+  int fd;                 // eventfd, readable once the job is done
+  pthread_t thread;
+  Arena *arena;
+
+  size_t offset;          // next unread path, under 'lock'
+  atomic_int stop;
+  atomic_size_t files;
+  atomic_ullong bytes;
+  int used_uring;
+} MetaJob;
+
+// Copies up to 'max' paths into fixed PATH_MAX slots. The kernel may read
+// a statx path after submission, so it must not point into a buffer that
+// can move.
+static size_t MetaTakePaths(MetaJob *job, char (*slots)[PATH_MAX], size_t max) {
+  if (atomic_load_explicit(&job->stop, memory_order_relaxed)) return 0;
+  pthread_mutex_lock(job->lock);
+  size_t n = 0;
+  while (n < max && job->offset < job->paths_size) {
+    const char *path = *job->data + job->offset;
+    size_t len = strlen(path);
+    memcpy(slots[n++], path, len + 1);
+    job->offset += len + 1;
+  }
+  pthread_mutex_unlock(job->lock);
+  return n;
+}
+
+static void MetaAccount(MetaJob *job, const struct statx *st) {
+  atomic_fetch_add(&job->files, 1);
+  if (S_ISREG(st->stx_mode)) atomic_fetch_add(&job->bytes, st->stx_size);
+}
+
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_size, cq_size, sqes_size;
+} MetaRing;
+
+static void MetaRingClose(MetaRing *r) {
+  if (r->sqes) munmap(r->sqes, r->sqes_size);
+  if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_size);
+  if (r->sq_map) munmap(r->sq_map, r->sq_size);
+  if (r->fd >= 0) close(r->fd);
+}
+
+static int MetaRingOpen(MetaRing *r, unsigned entries) {
+  struct io_uring_params p = {0};
+  memset(r, 0, sizeof(*r));
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0) return 0;
+
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+    r->cq_size = r->sq_size;
+  }
+
+  r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED) {
+    r->sq_map = NULL;
+    MetaRingClose(r);
+    return 0;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_map = r->sq_map;
+  } else {
+    r->cq_map = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_map == MAP_FAILED) {
+      r->cq_map = NULL;
+      MetaRingClose(r);
+      return 0;
+    }
+  }
+
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    MetaRingClose(r);
+    return 0;
+  }
+
+  char *sq = r->sq_map, *cq = r->cq_map;
+  r->sq_head = (unsigned*)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + p.sq_off.array);
+  r->cq_head = (unsigned*)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return 1;
+}
+
+// Returns 0 when io_uring or IORING_OP_STATX turns out to be unavailable,
+// also after some results were counted: the caller then throws away the
+// partial totals and counts the whole list again on the thread pool.
+static int MetaRunUring(MetaJob *job) {
+  MetaRing ring;
+  if (!MetaRingOpen(&ring, META_RING_ENTRIES)) return 0;
+
+  char (*paths)[PATH_MAX] = ArenaAlloc(job->arena, META_RING_ENTRIES * PATH_MAX);
+  struct statx *results = ArenaAlloc(job->arena, META_RING_ENTRIES * sizeof(struct statx));
+  unsigned free_slots[META_RING_ENTRIES];
+  if (!paths || !results) {
+    MetaRingClose(&ring);
+    return 0;
+  }
+
+  unsigned nfree = META_RING_ENTRIES;
+  for (unsigned i = 0; i < META_RING_ENTRIES; i++) free_slots[i] = i;
+
+  int ok = 1;
+  size_t inflight = 0;
+  char batch[META_COPY_BATCH][PATH_MAX];
+
+  while (ok) {
+    // Fill every free slot, one batch of copied paths at a time.
+    unsigned tail = *ring.sq_tail, queued = 0;
+    while (nfree >= META_COPY_BATCH) {
+      size_t n = MetaTakePaths(job, batch, META_COPY_BATCH);
+      for (size_t i = 0; i < n; i++) {
+        unsigned slot = free_slots[--nfree];
+        memcpy(paths[slot], batch[i], strlen(batch[i]) + 1);
+
+        unsigned idx = tail & *ring.sq_mask;
+        struct io_uring_sqe *sqe = &ring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)paths[slot];
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->off = (uintptr_t)&results[slot];
+        sqe->user_data = slot;
+        ring.sq_array[idx] = idx;
+        tail++;
+        queued++;
+      }
+      if (n < META_COPY_BATCH) break;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+    inflight += queued;
+    if (!inflight) break;
+
+    // Entries left over by an interrupted or short submit go again.
+    unsigned pending = tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    int rc = syscall(__NR_io_uring_enter, ring.fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (rc < 0 && errno != EINTR) {
+      ok = 0;
+      break;
+    }
+
+    unsigned head = *ring.cq_head;
+    unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; head++) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      unsigned slot = (unsigned)cqe->user_data;
+      if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+        ok = 0;
+      } else if (cqe->res == 0) {
+        MetaAccount(job, &results[slot]);
+      } else {
+        atomic_fetch_add(&job->files, 1); // vanished or unreadable, still dragged
+      }
+      free_slots[nfree++] = slot;
+      inflight--;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  MetaRingClose(&ring);
+  return ok;
+}
+
+static void* MetaPoolThread(void *arg) {
+  MetaJob *job = arg;
+  char batch[META_COPY_BATCH][PATH_MAX];
+  size_t n;
+  while ((n = MetaTakePaths(job, batch, META_COPY_BATCH)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      struct statx st;
+      if (statx(AT_FDCWD, batch[i], 0, STATX_TYPE | STATX_SIZE, &st) == 0) {
+        MetaAccount(job, &st);
+      } else {
+        atomic_fetch_add(&job->files, 1);
+      }
+    }
+  }
+  return NULL;
+}
+
+static void MetaRunPool(MetaJob *job) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = cpus > 0 ? (size_t)cpus * 2 : 4;
+  if (threads > META_MAX_THREADS) threads = META_MAX_THREADS;
+
+  pthread_t tids[META_MAX_THREADS];
+  size_t started = 0;
+  for (size_t i = 1; i < threads; i++) {
+    if (pthread_create(&tids[i], NULL, MetaPoolThread, job) != 0) break;
+    started = i;
+  }
+  MetaPoolThread(job);
+  for (size_t i = 1; i <= started; i++) pthread_join(tids[i], NULL);
+}
+
+static void* MetaThread(void *arg) {
+  MetaJob *job = arg;
+
+  job->used_uring = MetaRunUring(job);
+  if (!job->used_uring) {
+    // Start over; whatever io_uring counted covers only part of the list.
+    job->offset = 0;
+    atomic_store(&job->files, 0);
+    atomic_store(&job->bytes, 0);
+    MetaRunPool(job);
+  }
+
+  uint64_t one = 1;
+  if (write(job->fd, &one, sizeof(one)) < 0) LOG("Cannot signal metadata completion\n");
+  return NULL;
+}
+
+// Starts collecting metadata in the background. Returns the eventfd to poll
+// or -1 if the job could not be started.
+int MetaStart(MetaJob *job, char *const *data, size_t paths_size, pthread_mutex_t *lock) {
+  *job = (MetaJob){ .data = data, .paths_size = paths_size, .lock = lock, .fd = -1 };
+
+  job->arena = ArenaCreate();
+  if (!job->arena) return -1;
+
+  job->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (job->fd < 0 || pthread_create(&job->thread, NULL, MetaThread, job) != 0) {
+    if (job->fd >= 0) close(job->fd);
+    ArenaDestroy(job->arena);
+    job->fd = -1;
+    job->arena = NULL;
+    return -1;
+  }
+  return job->fd;
+}
+
+// Joins the job and hands its memory to 'arena'. A job that is still
+// running stops after the paths it already took.
+void MetaFinish(MetaJob *job, Arena *arena) {
+  if (job->fd < 0) return;
+  atomic_store(&job->stop, 1);
+  pthread_join(job->thread, NULL);
+  close(job->fd);
+  job->fd = -1;
+  ArenaAdopt(arena, job->arena);
+  job->arena = NULL;
+  LOG("Metadata: %zu files, %llu bytes (%s)\n",
+      (size_t)job->files, (unsigned long long)job->bytes,
+      job->used_uring ? "io_uring" : "thread pool");
+}
+
+#endif // DRAG_META_H
@@ -0,0 +1,263 @@
+#ifndef DRAG_MIME_H
+#define DRAG_MIME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Content type detection from the first bytes of a file. Binary formats are
+// recognized by their magic numbers. Text formats have none, so once the
+// header looks like text the extension decides between them.
+
+#define MIME_SNIFF_SIZE 4096
+#define MIME_DIRECTORY "inode/directory"
+#define MIME_UNKNOWN "application/octet-stream"
+
+typedef struct {
+  size_t offset;
+  const char *magic;
+  size_t len;
+  const char *type;
+} MimeMagic;
+
+#define MAGIC(off, bytes, type) { off, bytes, sizeof(bytes) - 1, type }
+
+// Only magics text can't start with by accident: four bytes or more, or
+// JPEG's three, whose 0xff bytes never begin UTF-8 text. Other short ones
+// are checked with their header in MimeSniffHeader().
+static const MimeMagic MIME_MAGIC[] = {
+  MAGIC(0, "\x89PNG\r\n\x1a\n", "image/png"),
+  MAGIC(0, "\xff\xd8\xff", "image/jpeg"),
+  MAGIC(0, "GIF87a", "image/gif"),
+  MAGIC(0, "GIF89a", "image/gif"),
+  MAGIC(0, "II*\0", "image/tiff"),
+  MAGIC(0, "MM\0*", "image/tiff"),
+  MAGIC(0, "\0\0\1\0", "image/vnd.microsoft.icon"),
+  MAGIC(0, "%PDF-", "application/pdf"),
+  MAGIC(0, "%!PS", "application/postscript"),
+  MAGIC(0, "\xfd" "7zXZ\0", "application/x-xz"),
+  MAGIC(0, "\x28\xb5\x2f\xfd", "application/zstd"),
+  MAGIC(0, "7z\xbc\xaf\x27\x1c", "application/x-7z-compressed"),
+  MAGIC(0, "Rar!\x1a\x07", "application/vnd.rar"),
+  MAGIC(0, "PK\3\4", "application/zip"),
+  MAGIC(0, "PK\5\6", "application/zip"),
+  MAGIC(257, "ustar", "application/x-tar"),
+  MAGIC(0, "\x7f" "ELF", "application/x-executable"),
+  MAGIC(0, "OggS", "audio/ogg"),
+  MAGIC(0, "fLaC", "audio/flac"),
+  MAGIC(0, "\x1a\x45\xdf\xa3", "video/x-matroska"),
+  MAGIC(0, "wOFF", "font/woff"),
+  MAGIC(0, "wOF2", "font/woff2"),
+  MAGIC(0, "SQLite format 3\0", "application/vnd.sqlite3"),
+};
+
+#undef MAGIC
+
+typedef struct {
+  const char *ext;
+  const char *type;
+} MimeExtension;
+
+// Consulted for files whose header looks like text, and by MimeFromName().
+static const MimeExtension MIME_TEXT_EXTENSIONS[] = {
+  { "html", "text/html" },
+  { "htm", "text/html" },
+  { "css", "text/css" },
+  { "csv", "text/csv" },
+  { "md", "text/markdown" },
+  { "js", "text/javascript" },
+  { "json", "application/json" },
+  { "xml", "application/xml" },
+  { "svg", "image/svg+xml" },
+};
+
+// For contents that can't be read cheaply, where the name is all there is.
+static const MimeExtension MIME_EXTENSIONS[] = {
+  { "png", "image/png" },
+  { "jpg", "image/jpeg" },
+  { "jpeg", "image/jpeg" },
+  { "gif", "image/gif" },
+  { "bmp", "image/bmp" },
+  { "tif", "image/tiff" },
+  { "tiff", "image/tiff" },
+  { "ico", "image/vnd.microsoft.icon" },
+  { "webp", "image/webp" },
+  { "avif", "image/avif" },
+  { "heic", "image/heic" },
+  { "pdf", "application/pdf" },
+  { "ps", "application/postscript" },
+  { "gz", "application/gzip" },
+  { "bz2", "application/x-bzip2" },
+  { "xz", "application/x-xz" },
+  { "zst", "application/zstd" },
+  { "7z", "application/x-7z-compressed" },
+  { "rar", "application/vnd.rar" },
+  { "zip", "application/zip" },
+  { "tar", "application/x-tar" },
+  { "ogg", "audio/ogg" },
+  { "flac", "audio/flac" },
+  { "mp3", "audio/mpeg" },
+  { "wav", "audio/wav" },
+  { "m4a", "audio/mp4" },
+  { "avi", "video/x-msvideo" },
+  { "mkv", "video/x-matroska" },
+  { "mp4", "video/mp4" },
+  { "mov", "video/quicktime" },
+  { "woff", "font/woff" },
+  { "woff2", "font/woff2" },
+  { "sqlite", "application/vnd.sqlite3" },
+  { "txt", "text/plain" },
+};
+
+static const char* MimeFindExtension(const MimeExtension *table, size_t count, const char *name) {
+  const char *slash = name ? strrchr(name, '/') : NULL;
+  const char *dot = name ? strrchr(slash ? slash : name, '.') : NULL;
+  if (!dot) return NULL;
+  for (size_t i = 0; i < count; i++) {
+    if (strcasecmp(dot + 1, table[i].ext) == 0) return table[i].type;
+  }
+  return NULL;
+}
+
+// The type of 'name' from its extension alone, MIME_UNKNOWN if it has none
+// we know.
+const char* MimeFromName(const char *name) {
+  const char *type = MimeFindExtension(MIME_EXTENSIONS, sizeof(MIME_EXTENSIONS) / sizeof(MIME_EXTENSIONS[0]), name);
+  if (!type) {
+    type = MimeFindExtension(MIME_TEXT_EXTENSIONS, sizeof(MIME_TEXT_EXTENSIONS) / sizeof(MIME_TEXT_EXTENSIONS[0]), name);
+  }
+  return type ? type : MIME_UNKNOWN;
+}
+
+static int MimeHas(const unsigned char *buf, size_t len, size_t offset, const char *magic, size_t n) {
+  return offset + n <= len && memcmp(buf + offset, magic, n) == 0;
+}
+
+// NUL bytes or control characters other than whitespace mean binary.
+// UTF-8 sequences are not validated; they are never control bytes.
+static int MimeLooksLikeText(const unsigned char *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = buf[i];
+    if (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != 0x1b) return 0;
+    if (c == 0x7f) return 0;
+  }
+  return 1;
+}
+
+static uint32_t MimeLE32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Types that need more than a fixed prefix: short magics, which must be
+// followed by a valid header, and RIFF and ISO media containers.
+static const char* MimeSniffHeader(const unsigned char *buf, size_t len) {
+  // BITMAPFILEHEADER, then a DIB header of one of the known sizes, which
+  // the pixel data follows.
+  if (MimeHas(buf, len, 0, "BM", 2) && len >= 18) {
+    uint32_t dib = MimeLE32(buf + 14), data = MimeLE32(buf + 10);
+    if ((dib == 12 || dib == 40 || dib == 52 || dib == 56 || dib == 64 || dib == 108 || dib == 124) &&
+        data >= 14 + dib) {
+      return "image/bmp";
+    }
+  }
+  // Deflate is the only compression method gzip defines; no reserved flags.
+  if (MimeHas(buf, len, 0, "\x1f\x8b\x08", 3) && len >= 4 && !(buf[3] & 0xe0)) return "application/gzip";
+  // A block size digit, then the first block's or the end of stream's magic.
+  if (MimeHas(buf, len, 0, "BZh", 3) && len >= 10 && buf[3] >= '1' && buf[3] <= '9' &&
+      (MimeHas(buf, len, 4, "\x31\x41\x59\x26\x53\x59", 6) || MimeHas(buf, len, 4, "\x17\x72\x45\x38\x50\x90", 6))) {
+    return "application/x-bzip2";
+  }
+  // ID3v2.2 to 2.4, with a version byte below 0xff.
+  if (MimeHas(buf, len, 0, "ID3", 3) && len >= 5 && buf[3] >= 2 && buf[3] <= 4 && buf[4] != 0xff) {
+    return "audio/mpeg";
+  }
+
+  if (MimeHas(buf, len, 0, "RIFF", 4)) {
+    if (MimeHas(buf, len, 8, "WEBP", 4)) return "image/webp";
+    if (MimeHas(buf, len, 8, "WAVE", 4)) return "audio/wav";
+    if (MimeHas(buf, len, 8, "AVI ", 4)) return "video/x-msvideo";
+  }
+  if (MimeHas(buf, len, 4, "ftyp", 4) && len >= 12) {
+    const unsigned char *brand = buf + 8;
+    if (!memcmp(brand, "avif", 4) || !memcmp(brand, "avis", 4)) return "image/avif";
+    if (!memcmp(brand, "heic", 4) || !memcmp(brand, "heix", 4) || !memcmp(brand, "mif1", 4)) {
+      return "image/heic";
+    }
+    if (!memcmp(brand, "qt  ", 4)) return "video/quicktime";
+    if (!memcmp(brand, "M4A ", 4)) return "audio/mp4";
+    return "video/mp4";
+  }
+  // MPEG audio frame header without an ID3 tag: frame sync, then no
+  // reserved version, layer, bitrate or sample rate.
+  if (len >= 4 && buf[0] == 0xff && (buf[1] & 0xe0) == 0xe0 &&
+      (buf[1] & 0x18) != 0x08 && (buf[1] & 0x06) &&
+      (buf[2] & 0xf0) != 0xf0 && (buf[2] & 0x0c) != 0x0c) {
+    return "audio/mpeg";
+  }
+  return NULL;
+}
+
+static const char* MimeSniffText(const unsigned char *buf, size_t len, const char *name) {
+  const char *type = MimeFindExtension(MIME_TEXT_EXTENSIONS, sizeof(MIME_TEXT_EXTENSIONS) / sizeof(MIME_TEXT_EXTENSIONS[0]), name);
+  if (type) return type;
+
+  size_t i = 0;
+  if (MimeHas(buf, len, 0, "\xef\xbb\xbf", 3)) i = 3;
+  while (i < len && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == '\n' || buf[i] == '\r')) i++;
+  const char *s = (const char*)buf + i;
+  if ((len - i >= 14 && !strncasecmp(s, "<!doctype html", 14)) ||
+      (len - i >= 5 && !strncasecmp(s, "<html", 5))) {
+    return "text/html";
+  }
+  if (MimeHas(buf, len, i, "<?xml", 5)) return "application/xml";
+  if (MimeHas(buf, len, i, "<svg", 4)) return "image/svg+xml";
+  return "text/plain";
+}
+
+// Returns a static type string for the first 'len' bytes of a file.
+// 'name' is only used to tell text formats apart and may be NULL.
+const char* MimeSniff(const unsigned char *buf, size_t len, const char *name) {
+  for (size_t i = 0; i < sizeof(MIME_MAGIC) / sizeof(MIME_MAGIC[0]); i++) {
+    const MimeMagic *m = &MIME_MAGIC[i];
+    if (MimeHas(buf, len, m->offset, m->magic, m->len)) return m->type;
+  }
+
+  const char *type = MimeSniffHeader(buf, len);
+  if (type) return type;
+
+  if (MimeLooksLikeText(buf, len)) return MimeSniffText(buf, len, name);
+  return MIME_UNKNOWN;
+}
+
+// Reads at most MIME_SNIFF_SIZE bytes of 'path'.
+const char* MimeSniffFile(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) return MIME_UNKNOWN;
+
+  struct stat sb;
+  if (fstat(fd, &sb) < 0) {
+    close(fd);
+    return MIME_UNKNOWN;
+  }
+  if (S_ISDIR(sb.st_mode)) {
+    close(fd);
+    return MIME_DIRECTORY;
+  }
+  if (!S_ISREG(sb.st_mode)) {
+    close(fd);
+    return MIME_UNKNOWN; // never block on a fifo or device
+  }
+
+  unsigned char buf[MIME_SNIFF_SIZE];
+  ssize_t n = pread(fd, buf, sizeof(buf), 0);
+  close(fd);
+  if (n < 0) return MIME_UNKNOWN;
+  if (n == 0) return "text/plain";
+  return MimeSniff(buf, n, path);
+}
+
+#endif // DRAG_MIME_H
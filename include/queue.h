@@ -0,0 +1,74 @@
+#ifndef DRAG_QUEUE_H
+#define DRAG_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "arena.h"
+
+// Single-producer single-consumer ring of fixed-size messages between two
+// threads. Each side only writes its own index, so a push or pop is a
+// memcpy and one release store, with no lock a busy thread could hold up.
+// The eventfd wakes a consumer sleeping in poll(); it is a counter, so
+// any number of pushes cost the consumer a single read.
+
+#define QUEUE_CAPACITY 64 // power of two
+
+typedef struct {
+  _Alignas(64) atomic_size_t head;  // next slot to pop, written by the consumer
+  _Alignas(64) atomic_size_t tail;  // next slot to push, written by the producer
+  char *items;
+  size_t item_size;
+  int fd;
+} Queue;
+
+int QueueInit(Queue *q, Arena *arena, size_t item_size) {
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  q->item_size = item_size;
+  q->items = ArenaAlloc(arena, QUEUE_CAPACITY * item_size);
+  q->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  return q->items && q->fd >= 0;
+}
+
+void QueueClose(Queue *q) {
+  if (q->fd >= 0) close(q->fd);
+  q->fd = -1;
+}
+
+// Producer side. Returns 0 when the ring is full.
+int QueuePush(Queue *q, const void *item) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  if (tail - head == QUEUE_CAPACITY) return 0;
+
+  memcpy(q->items + (tail & (QUEUE_CAPACITY - 1)) * q->item_size, item, q->item_size);
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+  uint64_t one = 1;
+  while (write(q->fd, &one, sizeof(one)) < 0 && errno == EINTR);
+  return 1;
+}
+
+// Consumer side. Returns 0 when the ring is empty.
+int QueuePop(Queue *q, void *item) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if (head == tail) return 0;
+
+  memcpy(item, q->items + (head & (QUEUE_CAPACITY - 1)) * q->item_size, q->item_size);
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return 1;
+}
+
+// Consumer side, once its poll() reports the eventfd readable.
+void QueueAck(Queue *q) {
+  uint64_t count;
+  while (read(q->fd, &count, sizeof(count)) < 0 && errno == EINTR);
+}
+
+#endif // DRAG_QUEUE_H
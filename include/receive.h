@@ -0,0 +1,146 @@
+#ifndef DRAG_RECEIVE_H
+#define DRAG_RECEIVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <unistd.h>
+#include "macros.h"
+#include "uri.h"
+#include "archive.h"
+
+// Turns a text/uri-list that arrives in chunks of any size into
+// NUL-delimited local paths on an fd, for --receive. Lines are decoded
+// straight out of the chunk they arrived in; only a line split across two
+// chunks is copied into 'line' first. Paths are batched in 'out' and
+// written when it fills up, so a drop of many thousands of files costs a
+// handful of writes and never sits in memory as a whole.
+
+#define RECEIVE_LINE_MAX (3 * PATH_MAX + 64) // longest file:// URI accepted
+#define RECEIVE_OUT_SIZE 65536
+
+typedef struct {
+  int fd;
+  int ok;             // 0 once a write failed
+  int overflow;       // the line being carried is too long and is skipped
+  size_t count;       // paths written
+  size_t line_len;
+  size_t out_len;
+  char host[HOST_NAME_MAX + 1];
+  char line[RECEIVE_LINE_MAX];
+  char out[RECEIVE_OUT_SIZE];
+} Receiver;
+
+void ReceiverInit(Receiver *r, int fd) {
+  r->fd = fd;
+  r->ok = 1;
+  r->overflow = 0;
+  r->count = r->line_len = r->out_len = 0;
+  if (gethostname(r->host, sizeof(r->host)) < 0) r->host[0] = '\0';
+  r->host[sizeof(r->host) - 1] = '\0';
+}
+
+static int ReceiverFlush(Receiver *r) {
+  if (r->ok && r->out_len && !WriteAll(r->fd, r->out, r->out_len)) {
+    LOG("Cannot write received paths\n");
+    r->ok = 0;
+  }
+  r->out_len = 0;
+  return r->ok;
+}
+
+// Only file URIs on this machine have a local path: "file:/p",
+// "file:///p", "file://localhost/p" or "file://HOSTNAME/p".
+static const char* ReceiverLocalPath(Receiver *r, const char *s, size_t *n) {
+  if (*n < 5 || strncasecmp(s, "file:", 5) != 0) return NULL;
+  const char *end = s + *n;
+  s += 5;
+
+  if (end - s >= 2 && s[0] == '/' && s[1] == '/') {
+    const char *host = s + 2;
+    const char *slash = memchr(host, '/', end - host);
+    if (!slash) return NULL;
+    size_t len = slash - host;
+    if (len && !(len == 9 && !strncasecmp(host, "localhost", 9)) &&
+        !(len == strlen(r->host) && !strncasecmp(host, r->host, len))) {
+      return NULL;
+    }
+    s = slash;
+  }
+  if (s == end || s[0] != '/') return NULL;
+  *n = end - s;
+  return s;
+}
+
+static void ReceiverLine(Receiver *r, const char *s, size_t n) {
+  if (n && s[n - 1] == '\r') n--;
+  if (!n || s[0] == '#') return;
+  if (n > RECEIVE_LINE_MAX) {
+    LOG("Skipping a %zu byte URI\n", n);
+    return;
+  }
+
+  const char *path = ReceiverLocalPath(r, s, &n);
+  if (!path) {
+    LOG("Skipping non-local URI %.*s\n", (int)(n < 256 ? n : 256), s);
+    return;
+  }
+
+  if (r->out_len + n + 1 > RECEIVE_OUT_SIZE && !ReceiverFlush(r)) return;
+  char *p = r->out + r->out_len;
+  size_t len = UriDecode(p, path, n);
+  // "%00" can't be part of a path and would split the output record.
+  if (memchr(p, '\0', len)) {
+    LOG("Skipping URI with an embedded NUL\n");
+    return;
+  }
+  p[len] = '\0';
+  r->out_len += len + 1;
+  r->count++;
+}
+
+static void ReceiverCarry(Receiver *r, const char *data, size_t n) {
+  if (r->overflow || r->line_len + n > RECEIVE_LINE_MAX) {
+    r->overflow = 1;
+    return;
+  }
+  memcpy(r->line + r->line_len, data, n);
+  r->line_len += n;
+}
+
+// Feeds the next chunk of the list. Returns 0 once output can't be written.
+int ReceiverFeed(Receiver *r, const char *data, size_t len) {
+  while (len && r->ok) {
+    const char *nl = memchr(data, '\n', len);
+    if (!nl) {
+      ReceiverCarry(r, data, len);
+      break;
+    }
+
+    size_t n = nl - data;
+    if (r->line_len || r->overflow) {
+      ReceiverCarry(r, data, n);
+      if (!r->overflow) ReceiverLine(r, r->line, r->line_len);
+      r->line_len = 0;
+      r->overflow = 0;
+    } else {
+      ReceiverLine(r, data, n);
+    }
+    data += n + 1;
+    len -= n + 1;
+  }
+  return r->ok;
+}
+
+// The list ended: takes a last line without a newline and flushes.
+int ReceiverFinish(Receiver *r) {
+  if (r->line_len && !r->overflow) ReceiverLine(r, r->line, r->line_len);
+  r->line_len = 0;
+  r->overflow = 0;
+  LOG("Received %zu paths\n", r->count);
+  return ReceiverFlush(r);
+}
+
+#endif // DRAG_RECEIVE_H
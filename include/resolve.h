@@ -0,0 +1,224 @@
+#ifndef DRAG_RESOLVE_H
+#define DRAG_RESOLVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "macros.h"
+#include "arena.h"
+
+// Canonicalizes a list of paths on a small worker pool. On NFS/FUSE every
+// realpath() is several lstat round trips, so the work is spread over
+// threads and paths are grouped by parent directory: the parent is resolved
+// and opened once, then each entry costs a single fstatat() next to it.
+
+#define RESOLVE_BLOCK 256
+#define RESOLVE_MAX_THREADS 16
+
+typedef struct {
+  const char *path;
+  size_t len;   // path[len] is readable and either '\0' or a separator
+} PathInput;
+
+typedef struct {
+  Arena *arena;
+  char *data;
+  size_t size;
+  size_t capacity;
+} ResolveBuffer;
+
+typedef struct {
+  const PathInput *inputs;
+  size_t count;
+  const size_t *order;   // indices grouped by parent directory
+  size_t *result;        // (offset << 5) | worker + 1, 0 on failure
+  ResolveBuffer buffers[RESOLVE_MAX_THREADS];
+  atomic_size_t next;
+  atomic_int failed;
+} Resolver;
+
+typedef struct {
+  Resolver *r;
+  int id;
+} ResolveWorker;
+
+static size_t DirLength(const PathInput *in) {
+  for (size_t i = in->len; i > 0; i--) {
+    if (in->path[i - 1] == '/') return i - 1;
+  }
+  return 0;
+}
+
+static int CompareByDir(const void *a, const void *b, void *ctx) {
+  const PathInput *inputs = ctx;
+  size_t ia = *(const size_t*)a, ib = *(const size_t*)b;
+  size_t la = DirLength(&inputs[ia]), lb = DirLength(&inputs[ib]);
+  int c = memcmp(inputs[ia].path, inputs[ib].path, la < lb ? la : lb);
+  if (c) return c;
+  if (la != lb) return la < lb ? -1 : 1;
+  return ia < ib ? -1 : ia > ib;
+}
+
+static int ResolveBufferAppend(ResolveBuffer *b, const char *s, size_t len) {
+  if (b->size + len + 1 > b->capacity) {
+    size_t capacity = b->capacity ? b->capacity : 16384;
+    while (capacity < b->size + len + 1) capacity *= 2;
+    char *data = ArenaGrow(b->arena, b->data, b->capacity, capacity);
+    if (!data) return 0;
+    b->data = data;
+    b->capacity = capacity;
+  }
+  memcpy(b->data + b->size, s, len);
+  b->data[b->size + len] = '\0';
+  b->size += len + 1;
+  return 1;
+}
+
+typedef struct {
+  char raw[PATH_MAX];     // unresolved parent, as given
+  size_t raw_len;
+  char real[PATH_MAX];    // its canonical form
+  size_t real_len;
+  int fd;
+} ParentCache;
+
+// Writes the canonical form of 'in' to 'out'. Entries whose last component
+// is a plain file or directory reuse the cached parent; symlinks, '.', '..'
+// and trailing slashes fall back to realpath().
+static int ResolveOne(ParentCache *cache, const PathInput *in, char *out) {
+  char raw[PATH_MAX];
+  if (in->len >= PATH_MAX) return 0;
+  memcpy(raw, in->path, in->len);
+  raw[in->len] = '\0';
+
+  const char *slash = strrchr(raw, '/');
+  const char *base = slash ? slash + 1 : raw;
+  const char *dir = slash ? raw : ".";
+  size_t dir_len = slash ? (size_t)(slash - raw) : 1;
+  if (slash == raw) dir_len = 1; // "/name"
+
+  if (!*base || !strcmp(base, ".") || !strcmp(base, "..")) {
+    return realpath(raw, out) != NULL;
+  }
+
+  if (cache->fd < 0 || cache->raw_len != dir_len || memcmp(cache->raw, dir, dir_len)) {
+    if (cache->fd >= 0) close(cache->fd);
+    cache->fd = -1;
+
+    memcpy(cache->raw, dir, dir_len);
+    cache->raw[dir_len] = '\0';
+    cache->raw_len = dir_len;
+
+    if (!realpath(cache->raw, cache->real)) return 0;
+    cache->real_len = strlen(cache->real);
+    if (cache->real_len == 1) cache->real_len = 0; // root, avoid "//name"
+    cache->fd = open(cache->real, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cache->fd < 0) return 0;
+  }
+
+  struct stat sb;
+  if (fstatat(cache->fd, base, &sb, AT_SYMLINK_NOFOLLOW) < 0) return 0;
+  if (S_ISLNK(sb.st_mode)) return realpath(raw, out) != NULL;
+
+  size_t base_len = strlen(base);
+  if (cache->real_len + 1 + base_len >= PATH_MAX) return 0;
+  memcpy(out, cache->real, cache->real_len);
+  out[cache->real_len] = '/';
+  memcpy(out + cache->real_len + 1, base, base_len + 1);
+  return 1;
+}
+
+static void* ResolveThread(void *arg) {
+  ResolveWorker *w = arg;
+  Resolver *r = w->r;
+  ResolveBuffer *buf = &r->buffers[w->id];
+  ParentCache cache = { .fd = -1 };
+  char out[PATH_MAX];
+
+  buf->arena = ArenaCreate();
+  if (!buf->arena) {
+    atomic_store(&r->failed, 1);
+    return NULL;
+  }
+
+  while (!atomic_load_explicit(&r->failed, memory_order_relaxed)) {
+    size_t begin = atomic_fetch_add(&r->next, RESOLVE_BLOCK);
+    if (begin >= r->count) break;
+    size_t end = begin + RESOLVE_BLOCK < r->count ? begin + RESOLVE_BLOCK : r->count;
+
+    for (size_t i = begin; i < end; i++) {
+      size_t index = r->order[i];
+      size_t offset = buf->size;
+      if (!ResolveOne(&cache, &r->inputs[index], out) ||
+          !ResolveBufferAppend(buf, out, strlen(out))) {
+        LOG("Error resolving path %.*s\n", (int)r->inputs[index].len, r->inputs[index].path);
+        atomic_store(&r->failed, 1);
+        break;
+      }
+      r->result[index] = (offset << 5) | (size_t)(w->id + 1);
+    }
+  }
+
+  if (cache.fd >= 0) close(cache.fd);
+  return NULL;
+}
+
+static const char* ResolvedPath(const Resolver *r, size_t index) {
+  size_t v = r->result[index];
+  return r->buffers[(v & 31) - 1].data + (v >> 5);
+}
+
+// Resolves every input. On success ResolvedPath(r, i) is the canonical
+// form of inputs[i], in input order. Results and the per-worker buffers are
+// owned by 'arena'.
+int ResolvePaths(Resolver *r, Arena *arena, const PathInput *inputs, size_t count) {
+  memset(r, 0, sizeof(*r));
+  r->inputs = inputs;
+  r->count = count;
+  if (count == 0) return 1;
+
+  size_t *order = ArenaAlloc(arena, count * sizeof(size_t));
+  r->result = ArenaAlloc(arena, count * sizeof(size_t));
+  if (!order || !r->result) return 0;
+  for (size_t i = 0; i < count; i++) order[i] = i;
+  if (count > RESOLVE_BLOCK) {
+    qsort_r(order, count, sizeof(size_t), CompareByDir, (void*)inputs);
+  }
+  r->order = order;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  // Mostly waiting on the file system, so oversubscribe the cores.
+  size_t threads = cpus > 0 ? (size_t)cpus * 2 : 4;
+  if (threads > RESOLVE_MAX_THREADS) threads = RESOLVE_MAX_THREADS;
+  size_t blocks = (count + RESOLVE_BLOCK - 1) / RESOLVE_BLOCK;
+  if (threads > blocks) threads = blocks;
+
+  ResolveWorker workers[RESOLVE_MAX_THREADS];
+  pthread_t tids[RESOLVE_MAX_THREADS];
+  size_t started = 0;
+
+  for (size_t i = 1; i < threads; i++) {
+    workers[i] = (ResolveWorker){ .r = r, .id = (int)i };
+    if (pthread_create(&tids[i], NULL, ResolveThread, &workers[i]) != 0) break;
+    started++;
+  }
+
+  workers[0] = (ResolveWorker){ .r = r, .id = 0 };
+  ResolveThread(&workers[0]);
+
+  for (size_t i = 1; i <= started; i++) pthread_join(tids[i], NULL);
+
+  for (size_t i = 0; i < threads; i++) {
+    if (r->buffers[i].arena) ArenaAdopt(arena, r->buffers[i].arena);
+  }
+
+  return !atomic_load(&r->failed);
+}
+
+#endif // DRAG_RESOLVE_H
@@ -0,0 +1,237 @@
+#ifndef DRAG_SAVE_H
+#define DRAG_SAVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "macros.h"
+#include "archive.h"
+
+// Saving dropped data into a directory, for --receive --into DIR. Content
+// a source sends through a pipe is spliced into the destination file, so
+// it never passes through user space. Dropped local files are copied with
+// copy_file_range(), which can share extents or let the filesystem do the
+// copy, by a few threads at once. Whenever the size is known up front the
+// file is preallocated, so a large copy does not fragment or find the disk
+// full halfway.
+
+#define SAVE_TYPES_MAX 8          // content types fetched from one drop
+#define SAVE_STEP (1 << 20)       // bytes per splice() or copy_file_range()
+#define SAVE_PIPE_SIZE (1 << 20)  // fewer wakeups for a big payload
+#define SAVE_MAX_THREADS 4
+
+typedef struct {
+  int fd;               // the destination, -1 when closed
+  int in;               // the pipe the source writes into, or -1
+  off_t size;           // bytes written so far
+  char path[PATH_MAX];
+} SaveFile;
+
+// Content types worth a file of their own. Lists of URIs, text renderings
+// of the drag and toolkit-private types are left out.
+int SaveWantsType(const char *type) {
+  static const char *const media[] = { "image/", "audio/", "video/", "font/", "model/", "application/" };
+  static const char *const private[] = {
+    "application/x-kde", "application/x-qt", "application/x-moz", "application/vnd.portal.",
+  };
+  int ok = 0;
+  for (size_t i = 0; i < sizeof(media) / sizeof(*media); i++) {
+    ok |= !strncmp(type, media[i], strlen(media[i]));
+  }
+  for (size_t i = 0; i < sizeof(private) / sizeof(*private); i++) {
+    if (!strncmp(type, private[i], strlen(private[i]))) return 0;
+  }
+  return ok;
+}
+
+// "drop.png" for image/png. Subtypes that don't make a sensible extension
+// get ".bin".
+static void SaveName(char *out, size_t size, const char *type) {
+  static const char *const known[][2] = {
+    { "image/jpeg", "jpg" }, { "image/svg+xml", "svg" }, { "audio/mpeg", "mp3" },
+    { "application/octet-stream", "bin" }, { "application/gzip", "gz" },
+  };
+  const char *ext = strchr(type, '/') + 1;
+  for (size_t i = 0; i < sizeof(known) / sizeof(*known); i++) {
+    if (!strcmp(type, known[i][0])) ext = known[i][1];
+  }
+  size_t len = strlen(ext);
+  for (size_t i = 0; i < len; i++) {
+    char c = ext[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))) len = 0;
+  }
+  if (!len || len > 8) ext = "bin";
+  snprintf(out, size, "drop.%s", ext);
+}
+
+// Creates DIR/NAME, or "NAME (1)", "NAME (2)", ... with the number before
+// the extension when the name is taken. Never overwrites anything.
+int SaveCreate(SaveFile *s, const char *dir, const char *name) {
+  const char *dot = strrchr(name, '.');
+  if (!dot || dot == name) dot = name + strlen(name);
+
+  s->in = -1;
+  s->size = 0;
+  for (int i = 0; i < 1000; i++) {
+    int n = i ? snprintf(s->path, sizeof(s->path), "%s/%.*s (%d)%s", dir, (int)(dot - name), name, i, dot)
+              : snprintf(s->path, sizeof(s->path), "%s/%s", dir, name);
+    if (n < 0 || (size_t)n >= sizeof(s->path)) break;
+    s->fd = open(s->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (s->fd >= 0) return 1;
+    if (errno != EEXIST) break;
+  }
+  LOG("Cannot create %s in %s\n", name, dir);
+  s->fd = -1;
+  return 0;
+}
+
+// Preallocates 'size' bytes. Only a hint: filesystems without fallocate()
+// simply grow the file as it is written.
+static void SaveReserve(SaveFile *s, off_t size) {
+  if (size > 0 && fallocate(s->fd, 0, 0, size) < 0) LOG("Cannot preallocate %s\n", s->path);
+}
+
+// Moves what the source wrote so far from 's->in' into the file. Returns 1
+// while more may come, 0 at EOF and -1 on an error.
+int SaveSplice(SaveFile *s) {
+  ssize_t n = splice(s->in, NULL, s->fd, NULL, SAVE_STEP, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n < 0) return errno == EAGAIN || errno == EINTR ? 1 : -1;
+  s->size += n;
+  return n > 0;
+}
+
+// PayloadSink for data that arrives in memory, like X11 properties.
+int SaveSink(void *ctx, const char *data, size_t len) {
+  SaveFile *s = ctx;
+  if (!WriteAll(s->fd, data, len)) return 0;
+  s->size += len;
+  return 1;
+}
+
+// Closes the file and reports its path NUL-terminated on 'out', or removes
+// it when it is incomplete. A preallocation past the data is trimmed.
+int SaveFinish(SaveFile *s, int ok, int out) {
+  if (s->in >= 0) close(s->in);
+  s->in = -1;
+  if (s->fd < 0) return 0;
+
+  ok = ok && ftruncate(s->fd, s->size) == 0;
+  close(s->fd);
+  s->fd = -1;
+  if (!ok) {
+    LOG("Incomplete, removing %s\n", s->path);
+    unlink(s->path);
+    return 0;
+  }
+  LOG("Saved %lld bytes to %s\n", (long long)s->size, s->path);
+  return WriteAll(out, s->path, strlen(s->path) + 1);
+}
+
+// Copies a regular file into 'dir' under its own name, in the kernel.
+static int SaveCopy(const char *src, const char *dir, SaveFile *s) {
+  s->fd = s->in = -1;
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  struct stat sb;
+  if (in < 0 || fstat(in, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+    LOG("Skipping %s, not a readable regular file\n", src);
+    if (in >= 0) close(in);
+    return 0;
+  }
+
+  const char *name = strrchr(src, '/');
+  if (!SaveCreate(s, dir, name ? name + 1 : src)) {
+    close(in);
+    return 0;
+  }
+  SaveReserve(s, sb.st_size);
+
+  // Falls back to sendfile() where copy_file_range() can't go, like
+  // across filesystems on older kernels.
+  int fallback = 0;
+  while (s->size < sb.st_size) {
+    size_t want = sb.st_size - s->size < SAVE_STEP ? sb.st_size - s->size : SAVE_STEP;
+    ssize_t n = fallback ? sendfile(s->fd, in, NULL, want)
+                         : copy_file_range(in, NULL, s->fd, NULL, want, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && !fallback && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+      fallback = 1;
+      continue;
+    }
+    if (n <= 0) break;
+    s->size += n;
+  }
+  close(in);
+  return s->size == sb.st_size;
+}
+
+typedef struct {
+  const char *list;     // NUL-delimited source paths
+  size_t size;
+  size_t offset;        // next path to copy, under 'lock'
+  const char *dir;
+  int out;              // destination paths go here, under 'lock'
+  int failed;
+  pthread_mutex_t lock;
+} SaveJob;
+
+static void* SaveThread(void *arg) {
+  SaveJob *job = arg;
+  SaveFile s;
+  while (1) {
+    pthread_mutex_lock(&job->lock);
+    const char *src = job->offset < job->size ? job->list + job->offset : NULL;
+    if (src) job->offset += strlen(src) + 1;
+    pthread_mutex_unlock(&job->lock);
+    if (!src) return NULL;
+
+    int ok = SaveCopy(src, job->dir, &s);
+    pthread_mutex_lock(&job->lock);
+    if (!SaveFinish(&s, ok, job->out)) job->failed = 1;
+    pthread_mutex_unlock(&job->lock);
+  }
+}
+
+// Copies every path in the NUL-delimited 'list' memfd into 'dir' and
+// writes the new paths to 'out' as each copy completes. Several copies run
+// at once, since one stream rarely keeps a fast disk or a network
+// filesystem busy. Returns 0 if any file could not be copied.
+int SaveFiles(int list, const char *dir, int out) {
+  struct stat sb;
+  if (fstat(list, &sb) < 0) return 0;
+  if (sb.st_size == 0) return 1;
+  char *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, list, 0);
+  if (data == MAP_FAILED) return 0;
+
+  SaveJob job = { .list = data, .size = sb.st_size, .dir = dir, .out = out };
+  pthread_mutex_init(&job.lock, NULL);
+
+  size_t count = 0;
+  for (size_t i = 0; i < job.size; i++) count += data[i] == '\0';
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = cpus > 0 ? (size_t)cpus : 1;
+  if (threads > SAVE_MAX_THREADS) threads = SAVE_MAX_THREADS;
+  if (threads > count) threads = count;
+
+  pthread_t tids[SAVE_MAX_THREADS];
+  size_t started = 0;
+  for (size_t i = 1; i < threads; i++) {
+    if (pthread_create(&tids[i], NULL, SaveThread, &job) != 0) break;
+    started = i;
+  }
+  SaveThread(&job);
+  for (size_t i = 1; i <= started; i++) pthread_join(tids[i], NULL);
+
+  pthread_mutex_destroy(&job.lock);
+  munmap(data, sb.st_size);
+  return !job.failed;
+}
+
+#endif // DRAG_SAVE_H
@@ -28,7 +28,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
 #include "macros.h"
+#include "arena.h"
+#include "resolve.h"
+#include "walk.h"
+#include "meta.h"
+#include "mime.h"
+#include "content.h"
+#include "spool.h"
+#include "archive.h"
+#include "watchdog.h"
+#include "uri.h"
+#include "receive.h"
+#include "save.h"
+#include "daemon.h"
 #define FONT8x16_IMPLEMENTATION
 #include "font8x16.h"
 
@@ -41,96 +63,1286 @@ static const int CHAR_H = 16;
 static const int PADDING_X = 12;
 static const int PADDING_Y = 8;
 
-// RFC 3986
-// Turns '/home/user/My File.txt' into 'file:///home/user/My%20File.txt\r\n'
-char* CreateUriList(const char *path) {
-  if (!path) return NULL;
+#define URI_CHUNK_SIZE 65536
+#define URI_CACHE_LIMIT (8 << 20)
+#define PAYLOAD_SLOTS 8
+
+typedef struct {
+  int recursive;
+  WalkOptions walk;
+  const char *mime;   // type of the data read from stdin
+  const char *name;   // file name of the data read from stdin
+  int idle_timeout;   // seconds, 0 to wait forever
+  int drop_timeout;
+  int transfer_timeout;
+  int receive;        // take a drop instead of starting a drag
+  const char *into;   // with --receive, save the dropped data in this directory
+  int copy;           // serve the clipboard instead of starting a drag
+  int output;         // where --receive prints paths, stdout unless embedded
+  int embedded;       // run by libdrag: the host's signals are left alone
+  int signal_fd;      // run by the --daemon: its signalfd, followed, or -1
+} Options;
+
+// Data dragged from stdin. It lives in a sealed memfd and is served from
+// there; the path in FileInfo is only written out when a target asks for a
+// URI, under $XDG_RUNTIME_DIR, or is a /proc path to the memfd itself.
+typedef struct {
+  int fd;             // -1 when dragging real files
+  size_t size;
+  int needs_file;     // the path does not exist until Materialize
+  int on_disk;
+} VirtualFile;
+
+// Every resolved path (NUL terminated, back to back) followed by the encoded
+// text/uri-list lives in one growable buffer. Dragging N files costs one
+// allocation pass instead of a malloc/strdup per file. The uri-list itself
+// is only encoded once a target asks for it. The FileInfo and everything
+// else allocated for the session live in 'arena'.
+typedef struct {
+  Arena *arena;
+  pthread_mutex_t lock;   // held while 'data' may move
+  char *data;
+  size_t size;
+  size_t capacity;
+  size_t count;
+  size_t paths_size;
+  size_t uri_offset;
+  size_t uri_len;     // exact length, valid once uri_sized is set
+  int uri_sized;
+  int uri_cached;     // the encoded list follows the paths in data
+  char name[256];
+  Options options;
+  MetaJob meta;
+  const char **mime;  // sniffed type per path, filled in on demand
+  VirtualFile virt;
+  ArchiveMember *members;  // archive members among the paths
+  size_t member_count;
+  const char *members_dir; // private directory members are extracted into
+  ArchiveMember *extracting; // the member a child is writing out, or NULL
+  pid_t extract_pid;
+  int extract_fd;          // pidfd of that child, readable once it exits
+  int extract_failed;
+  struct { char *data; size_t len; } payloads[PAYLOAD_SLOTS]; // cached conversions
+} FileInfo;
+
+// Called with consecutive pieces of a payload, none larger than
+// URI_CHUNK_SIZE. Returns 0 to stop the transfer.
+typedef int (*PayloadSink)(void *ctx, const char *data, size_t len);
+
+static int FileInfoReserve(FileInfo *info, size_t extra) {
+  if (info->size + extra <= info->capacity) return 1;
 
-  size_t len = strlen(path);
-  char *output = malloc(len * 3 + 16); 
-  if (!output) return NULL;
+  size_t capacity = info->capacity ? info->capacity : 4096;
+  while (capacity < info->size + extra) capacity *= 2;
 
-  char *p = output;
-  p += sprintf(p, "file://");
+  char *data = ArenaGrow(info->arena, info->data, info->capacity, capacity);
+  if (!data) return 0;
 
+  info->data = data;
+  info->capacity = capacity;
+  return 1;
+}
+
+static int FileInfoAddPath(FileInfo *info, const char *path) {
+  size_t len = strlen(path) + 1;
+  if (!FileInfoReserve(info, len)) return 0;
+
+  memcpy(info->data + info->size, path, len);
+  info->size += len;
+  info->paths_size = info->size;
+  info->count++;
+  return 1;
+}
+
+static size_t UriEntryLength(const char *path, size_t len) {
+  return sizeof("file://") - 1 + (path[0] != '/') + UriEncodedLength(path, len) + 2;
+}
+
+// RFC 3986
+// Turns '/home/user/My File.txt' into 'file:///home/user/My%20File.txt\r\n'.
+// 'out' must hold UriEntryLength() bytes.
+static size_t EncodeUriEntry(char *out, const char *path, size_t len) {
+  char *p = out;
+  memcpy(p, "file://", 7);
+  p += 7;
   if (path[0] != '/') *p++ = '/';
+  p += UriEncode(p, path, len);
+  *p++ = '\r';
+  *p++ = '\n';
+  return p - out;
+}
+
+// Exact length of the text/uri-list, from a counting pass over the paths.
+size_t UriListLength(FileInfo *info) {
+  if (info->uri_sized) return info->uri_len;
+
+  size_t total = 0;
+  for (const char *path = info->data;
+       path < info->data + info->paths_size;
+       path += strlen(path) + 1) {
+    total += UriEntryLength(path, strlen(path));
+  }
+
+  info->uri_len = total;
+  info->uri_sized = 1;
+  return total;
+}
+
+// Encodes the whole list after the paths, growing the buffer at most once.
+int CreateUriList(FileInfo *info) {
+  if (!info || !info->count) return 0;
+  if (info->uri_cached) return 1;
+
+  size_t total = UriListLength(info);
+  info->uri_offset = info->paths_size;
+  info->size = info->paths_size;
+  pthread_mutex_lock(&info->lock);
+  int reserved = FileInfoReserve(info, total + 1);
+  pthread_mutex_unlock(&info->lock);
+  if (!reserved) return 0;
+
+  char *p = info->data + info->size;
+  for (const char *path = info->data;
+       path < info->data + info->paths_size;
+       path += strlen(path) + 1) {
+    p += EncodeUriEntry(p, path, strlen(path));
+  }
+
+  *p = '\0';
+  info->size = p - info->data;
+  info->uri_cached = 1;
+  return 1;
+}
+
+// --mime if given, otherwise sniffed from the memfd and --name.
+static const char* VirtualMime(FileInfo *info) {
+  if (info->options.mime) return info->options.mime;
+  unsigned char buf[MIME_SNIFF_SIZE];
+  ssize_t n = pread(info->virt.fd, buf, sizeof(buf), 0);
+  if (n < 0) return MIME_UNKNOWN;
+  return n ? MimeSniff(buf, n, info->options.name) : "text/plain";
+}
+
+// The archive member dragged as path 'index', or NULL for a real file.
+static ArchiveMember* FileInfoMember(FileInfo *info, size_t index) {
+  for (size_t i = 0; i < info->member_count; i++) {
+    if (info->members[i].index == index) return &info->members[i];
+  }
+  return NULL;
+}
+
+// Type of the path at 'index', sniffed the first time it is asked for and
+// cached for the rest of the session.
+const char* FileInfoMime(FileInfo *info, size_t index, const char *path) {
+  if (!info->mime) {
+    info->mime = ArenaAlloc(info->arena, info->count * sizeof(char*));
+    if (!info->mime) return MIME_UNKNOWN;
+  }
+  if (!info->mime[index]) {
+    ArchiveMember *m = FileInfoMember(info, index);
+    if (m) info->mime[index] = ArchiveMime(m);
+    else if (info->virt.fd >= 0) info->mime[index] = VirtualMime(info);
+    else info->mime[index] = MimeSniffFile(path);
+    LOG("Sniffed %s: %s\n", path, info->mime[index]);
+  }
+  return info->mime[index];
+}
+
+// The type to offer next to text/uri-list, or NULL. Only a single regular
+// file has contents a target could take instead of its URI. Data from
+// stdin and archive members always have a type, the contents are all
+// there is to offer without extracting them.
+const char* FileInfoContentType(FileInfo *info) {
+  if (info->count != 1) return NULL;
+  const char *type = FileInfoMime(info, 0, info->data);
+  if (info->virt.fd >= 0 || info->member_count) return type;
+  if (!strcmp(type, MIME_DIRECTORY) || !strcmp(type, MIME_UNKNOWN)) return NULL;
+  return type;
+}
+
+// Compressed archive members have no byte range to serve from; they are
+// produced by SpawnContent() instead of OpenContent().
+int ContentIsStream(FileInfo *info) {
+  ArchiveMember *m = FileInfoMember(info, 0);
+  return m && m->kind != ARCHIVE_STORED;
+}
+
+// A new read-only fd for the contents of the dragged file, or -1. The
+// contents are 'size' bytes from 'offset', to the end when size < 0.
+int OpenContent(FileInfo *info, off_t *offset, off_t *size) {
+  ArchiveMember *m = FileInfoMember(info, 0);
+  *offset = m ? m->offset : 0;
+  *size = m ? m->size : -1;
+  const char *path = m ? m->archive : info->data;
 
-  for (const char *s = path; *s; s++) {
-    unsigned char c = (unsigned char)*s;
-    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
-        (c >= '0' && c <= '9') || c == '-' || c == '.' || 
-        c == '_' || c == '~' || c == '/') {
-      *p++ = c;
+  if (info->virt.fd >= 0) return fcntl(info->virt.fd, F_DUPFD_CLOEXEC, 0);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) LOG("Cannot open %s\n", path);
+  return fd;
+}
+
+// Writes the contents of a compressed member to 'out' from a child
+// process. A detached child needs no waiting for; otherwise the pid is
+// returned for waitpid(). Returns -1 on failure.
+pid_t SpawnContent(FileInfo *info, int out, int detach) {
+  ArchiveMember *m = FileInfoMember(info, 0);
+  if (!m) return -1;
+  pid_t pid = ArchiveSpawn(m, out, detach);
+  if (pid < 0) LOG("Cannot extract %s from %s\n", m->name, m->archive);
+  return pid;
+}
+
+static const char* RuntimeDir(void) {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  return dir && *dir ? dir : "/tmp";
+}
+
+// Creates the missing directories of 'path' below RuntimeDir().
+static int MakeParents(const char *path) {
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (char *p = dir + strlen(RuntimeDir()) + 1; (p = strchr(p, '/')); p++) {
+    *p = '\0';
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+      LOG("Cannot create %s\n", dir);
+      return 0;
+    }
+    *p = '/';
+  }
+  return 1;
+}
+
+// Removes a written out path and the directories made for it.
+static void RemoveWithParents(char *path) {
+  size_t stop = strlen(RuntimeDir());
+  unlink(path);
+  for (char *p; (p = strrchr(path, '/')) && (size_t)(p - path) > stop; ) {
+    *p = '\0';
+    if (rmdir(path) < 0) break;
+  }
+}
+
+// Starts a child writing 'm' out to 'path'. Returns its pid, or -1.
+static pid_t ExtractMember(ArchiveMember *m, const char *path) {
+  if (!MakeParents(path)) return -1;
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    LOG("Cannot create %s\n", path);
+    return -1;
+  }
+  pid_t pid = ArchiveSpawn(m, fd, 0);
+  close(fd);
+  m->on_disk = 1; // partial output is removed on exit as well
+  return pid;
+}
+
+// Collects the extraction child once it has exited. Returns 0 while it is
+// still running.
+static int ExtractFinished(FileInfo *info, int wait) {
+  int status;
+  pid_t r = waitpid(info->extract_pid, &status, wait ? 0 : WNOHANG);
+  if (r == 0) return 0;
+  if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    LOG("Cannot extract %s from %s\n", info->extracting->name, info->extracting->archive);
+    info->extract_failed = 1;
+  } else {
+    LOG("Extracted %s\n", info->extracting->name);
+  }
+  if (info->extract_fd >= 0) close(info->extract_fd);
+  info->extract_fd = -1;
+  info->extracting = NULL;
+  return 1;
+}
+
+// Writes stdin data and archive members out to their paths the first time
+// a target needs a URI. Members are extracted by a child process each, one
+// at a time, which an event loop does not have to wait for: returns 1 once
+// everything is on disk, -1 on failure and 0 while a child is running.
+// 'extract_fd' then becomes readable when it exits; call again after that.
+int MaterializeStep(FileInfo *info) {
+  if (info->extracting && !ExtractFinished(info, 0)) return 0;
+  if (info->extract_failed) return -1;
+
+  VirtualFile *v = &info->virt;
+  if (v->fd >= 0 && v->needs_file && !v->on_disk) {
+    if (!MakeParents(info->data)) return -1;
+    if (!SpoolMaterialize(v->fd, v->size, info->data)) return -1;
+    v->on_disk = 1;
+    LOG("Wrote stdin data to %s\n", info->data);
+  }
+
+  if (!info->member_count) return 1;
+  size_t index = 0;
+  for (const char *path = info->data;
+       path < info->data + info->paths_size;
+       path += strlen(path) + 1, index++) {
+    ArchiveMember *m = FileInfoMember(info, index);
+    if (!m || m->on_disk) continue;
+    info->extract_pid = ExtractMember(m, path);
+    if (info->extract_pid < 0) {
+      info->extract_failed = 1;
+      return -1;
+    }
+    info->extracting = m;
+    info->extract_fd = syscall(SYS_pidfd_open, info->extract_pid, 0);
+    // Without pidfds (Linux < 5.3) the child is waited for right here.
+    if (info->extract_fd < 0) ExtractFinished(info, 1);
+    return info->extract_fd < 0 ? MaterializeStep(info) : 0;
+  }
+  return 1;
+}
+
+// MaterializeStep() to the end, for callers without an event loop to
+// return to. Returns 0 on failure.
+static int Materialize(FileInfo *info) {
+  int done;
+  while ((done = MaterializeStep(info)) == 0) {
+    struct pollfd pfd = { .fd = info->extract_fd, .events = POLLIN };
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return 0;
+  }
+  return done > 0;
+}
+
+// Sends the contents of the dragged file in fixed chunks.
+int SendFileContents(FileInfo *info, PayloadSink sink, void *ctx) {
+  off_t offset, size;
+  pid_t pid = -1;
+  int fd;
+  if (ContentIsStream(info)) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) return 0;
+    pid = SpawnContent(info, p[1], 0);
+    close(p[1]);
+    fd = p[0];
+    offset = 0;
+    size = -1;
+  } else {
+    fd = OpenContent(info, &offset, &size);
+  }
+  if (fd < 0) return 0;
+
+  char chunk[URI_CHUNK_SIZE];
+  int ok = 1;
+  while (ok && size != 0) {
+    size_t want = size < 0 || size > (off_t)sizeof(chunk) ? sizeof(chunk) : (size_t)size;
+    ssize_t n = pid < 0 ? pread(fd, chunk, want, offset) : read(fd, chunk, want);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      ok = 0;
+    } else if (n == 0) {
+      break;
     } else {
-      p += sprintf(p, "%%%02X", c);
+      ok = sink(ctx, chunk, n);
+      offset += n;
+      if (size > 0) size -= n;
     }
   }
 
-  *p++ = '\r';
-  *p++ = '\n';
-  *p = '\0';
-  return output;
+  close(fd);
+  if (pid > 0) waitpid(pid, NULL, 0);
+  return ok;
+}
+
+// Every serializer writes one entry per path, at most PAYLOAD_ENTRY_MAX
+// bytes for a path of 'len' bytes.
+#define PAYLOAD_ENTRY_MAX(len) (sizeof("file://") + 3 * (len) + 2)
+
+// text/plain: one path per line.
+static size_t PlainTextLength(FileInfo *info) {
+  return info->paths_size;
 }
 
+static size_t PlainTextEntry(char *out, const char *path, size_t len) {
+  memcpy(out, path, len);
+  out[len] = '\n';
+  return len + 1;
+}
+
+// x-special/gnome-copied-files: "copy" followed by one URI per line.
+static size_t GnomeFilesLength(FileInfo *info) {
+  return 4 + UriListLength(info) - info->count;
+}
+
+static size_t GnomeFilesEntry(char *out, const char *path, size_t len) {
+  *out = '\n';
+  return 1 + EncodeUriEntry(out + 1, path, len) - 2; // no CRLF
+}
+
+// Every type a drag can be converted to, in order of preference. A
+// conversion is 'prefix' followed by one 'entry' per path, and 'length' is
+// its exact size. Conversions up to URI_CACHE_LIMIT are serialized once and
+// served from memory, the uri-list next to the paths; larger ones are
+// serialized again for every transfer, a chunk at a time, so memory stays
+// flat however many files are dragged. A NULL 'type' stands for the sniffed
+// content type of a single file. That type belongs to the contents: when it
+// is one of the fixed types, as text/plain is for a text file or for text
+// piped in with --mime text/plain, the fixed provider is not offered, so a
+// text target gets the text and the paths stay reachable as a uri-list.
+// Every type is offered once and always reaches the same provider.
 typedef struct {
-  char *uri;
-  char *name;
-} FileInfo;
+  const char *type;
+  const char *prefix;
+  size_t (*entry)(char *out, const char *path, size_t len);
+  size_t (*length)(FileInfo *info);
+  int self_cached;
+} Provider;
+
+static const Provider PROVIDERS[] = {
+  { "text/uri-list", "", EncodeUriEntry, UriListLength, 1 },  // next to the paths
+  { NULL, NULL, NULL, NULL, 0 },                              // the file itself
+  { "x-special/gnome-copied-files", "copy", GnomeFilesEntry, GnomeFilesLength, 0 },
+  { "application/x-kde4-urilist", "", EncodeUriEntry, UriListLength, 1 },
+  { "text/plain", "", PlainTextEntry, PlainTextLength, 0 },
+};
+
+#define PROVIDER_COUNT (sizeof(PROVIDERS) / sizeof(PROVIDERS[0]))
+_Static_assert(PROVIDER_COUNT <= PAYLOAD_SLOTS, "one payload cache slot per provider");
+
+// Type offered by provider 'i' for this drag, or NULL when it has none.
+const char* ProviderType(FileInfo *info, size_t i) {
+  const char *content = FileInfoContentType(info);
+  if (!PROVIDERS[i].type) return content;
+  if (content && !strcmp(PROVIDERS[i].type, content)) return NULL;
+  return PROVIDERS[i].type;
+}
+
+// The content provider serves the file itself. Backends stream it straight
+// from the file instead of going through a PayloadSink.
+static inline int ProviderIsContent(size_t i) {
+  return PROVIDERS[i].type == NULL;
+}
+
+// Exact size of the conversion for provider 'i', which must not be the
+// content provider; its size is only known once the file is opened.
+size_t PayloadLength(FileInfo *info, size_t i) {
+  return PROVIDERS[i].length(info);
+}
+
+// Index of the provider for 'type', or -1.
+int FindProvider(FileInfo *info, const char *type) {
+  for (size_t i = 0; i < PROVIDER_COUNT; i++) {
+    const char *t = ProviderType(info, i);
+    if (t && strcmp(t, type) == 0) return (int)i;
+  }
+  return -1;
+}
+
+// Serializes the conversion for provider 'i' into memory if it is at most
+// URI_CACHE_LIMIT bytes. Returns 1 if it is cached.
+static int PayloadCache(FileInfo *info, size_t i) {
+  const Provider *p = &PROVIDERS[i];
+  if (p->self_cached) {
+    if (info->uri_cached) return 1;
+    return UriListLength(info) <= URI_CACHE_LIMIT && CreateUriList(info);
+  }
+  if (info->payloads[i].data) return 1;
+
+  size_t len = p->length(info);
+  if (len > URI_CACHE_LIMIT) return 0;
+  char *data = ArenaAlloc(info->arena, len);
+  if (!data) return 0;
+  size_t used = strlen(p->prefix);
+  memcpy(data, p->prefix, used);
+  for (const char *path = info->data;
+       path < info->data + info->paths_size;
+       path += strlen(path) + 1) {
+    used += p->entry(data + used, path, strlen(path));
+  }
+  info->payloads[i].data = data;
+  info->payloads[i].len = used;
+  return 1;
+}
+
+// Where one transfer of a conversion has got to. Each receiver has its own,
+// so concurrent transfers move on independently.
+typedef struct {
+  size_t provider;
+  size_t offset;      // bytes taken so far
+  int cached;
+  char *chunk;        // URI_CHUNK_SIZE bytes from the caller when not cached
+  size_t used;        // serialized into 'chunk'
+  size_t taken;       // of those
+  size_t path;        // offset in FileInfo.data of the next path to serialize
+  int prefixed;
+} PayloadCursor;
+
+// Starts a transfer of the conversion for provider 'i', which must not be
+// the content provider. Unless the conversion is cached the caller points
+// 'chunk' at URI_CHUNK_SIZE bytes of its own before the first PayloadPeek().
+int PayloadOpen(FileInfo *info, size_t i, PayloadCursor *c) {
+  if (!Materialize(info)) return 0;
+  *c = (PayloadCursor){ .provider = i, .cached = PayloadCache(info, i) };
+  return 1;
+}
+
+// Points 'data' at the next bytes of the conversion and returns how many
+// there are, 0 once it is complete. Uncached conversions are serialized a
+// chunk at a time, whole entries only.
+size_t PayloadPeek(FileInfo *info, PayloadCursor *c, const char **data) {
+  const Provider *p = &PROVIDERS[c->provider];
+  if (c->cached) {
+    const char *base = info->payloads[c->provider].data;
+    size_t len = info->payloads[c->provider].len;
+    if (p->self_cached) {
+      base = info->data + info->uri_offset;
+      len = info->uri_len;
+    }
+    *data = base + c->offset;
+    return len - c->offset;
+  }
+
+  if (c->taken == c->used) {
+    c->used = c->taken = 0;
+    if (!c->prefixed) {
+      c->used = strlen(p->prefix);
+      memcpy(c->chunk, p->prefix, c->used);
+      c->prefixed = 1;
+    }
+    while (c->path < info->paths_size) {
+      const char *path = info->data + c->path;
+      size_t len = strlen(path);
+      if (c->used + PAYLOAD_ENTRY_MAX(len) > URI_CHUNK_SIZE) break;
+      c->used += p->entry(c->chunk + c->used, path, len);
+      c->path += len + 1;
+    }
+  }
+  *data = c->chunk + c->taken;
+  return c->used - c->taken;
+}
+
+// Marks 'n' bytes from the last PayloadPeek() as sent.
+void PayloadConsume(PayloadCursor *c, size_t n) {
+  c->offset += n;
+  if (!c->cached) c->taken += n;
+}
+
+// Writes the conversion into 'out' until it is done or would block, with
+// the same results as ContentStep().
+int PayloadStep(FileInfo *info, PayloadCursor *c, int out) {
+  const char *data;
+  size_t n;
+  while ((n = PayloadPeek(info, c, &data)) > 0) {
+    ssize_t w = write(out, data, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return 0;
+      return -1;
+    }
+    PayloadConsume(c, w);
+  }
+  return 1;
+}
+
+// Sends the conversion for provider 'i' in pieces of at most URI_CHUNK_SIZE.
+int SendPayload(FileInfo *info, size_t i, PayloadSink sink, void *ctx) {
+  if (ProviderIsContent(i)) return SendFileContents(info, sink, ctx);
+
+  char chunk[URI_CHUNK_SIZE];
+  PayloadCursor c;
+  if (!PayloadOpen(info, i, &c)) return 0;
+  c.chunk = chunk;
+  const char *data;
+  size_t n;
+  while ((n = PayloadPeek(info, &c, &data)) > 0) {
+    if (n > URI_CHUNK_SIZE) n = URI_CHUNK_SIZE;
+    if (!sink(ctx, data, n)) return 0;
+    PayloadConsume(&c, n);
+  }
+  return 1;
+}
+
+// Serializes every conversion that fits the cache up front, for --copy:
+// each paste is then a copy out of memory, with nothing encoded again.
+void PreparePayloads(FileInfo *info) {
+  if (!Materialize(info)) return;
+  for (size_t i = 0; i < PROVIDER_COUNT; i++) {
+    if (!ProviderIsContent(i) && ProviderType(info, i)) PayloadCache(info, i);
+  }
+}
+
+// Starts the background size/count lookup for the label. Returns an fd
+// that becomes readable when FinishMetadata() can be called, or -1.
+int StartMetadata(FileInfo *info) {
+  if (info->virt.fd >= 0) return -1; // the size is known already
+  return MetaStart(&info->meta, &info->data, info->paths_size, &info->lock);
+}
+
+static void FormatCount(char *out, size_t size, unsigned long long n) {
+  char digits[32];
+  int len = snprintf(digits, sizeof(digits), "%llu", n);
+  size_t j = 0;
+  for (int i = 0; i < len && j + 1 < size; i++) {
+    if (i > 0 && (len - i) % 3 == 0 && j + 2 < size) out[j++] = ',';
+    out[j++] = digits[i];
+  }
+  out[j] = '\0';
+}
+
+static void FormatSize(char *out, size_t size, unsigned long long bytes) {
+  static const char *units[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+  double value = bytes;
+  int unit = 0;
+  while (value >= 1000 && unit < 5) {
+    value /= 1000;
+    unit++;
+  }
+  if (unit == 0 || value >= 10) snprintf(out, size, "%.0f %s", value, units[unit]);
+  else snprintf(out, size, "%.1f %s", value, units[unit]);
+}
+
+// Collects the finished metadata job and rewrites the label as
+// "name · 1.2 MB" or "1,204 files · 38 GB". The dot is the CP437 glyph
+// of the label font. The job's memory goes to 'arena', which must belong
+// to the calling thread; another thread may be serving the drag.
+void FinishMetadata(FileInfo *info, Arena *arena) {
+  MetaFinish(&info->meta, arena);
+
+  // Members are not on disk; their sizes come from the archive index.
+  unsigned long long bytes = info->meta.bytes;
+  for (size_t i = 0; i < info->member_count; i++) {
+    if (info->members[i].index != SIZE_MAX && info->members[i].size > 0) {
+      bytes += info->members[i].size;
+    }
+  }
+
+  char amount[32];
+  FormatSize(amount, sizeof(amount), bytes);
+
+  if (info->count == 1) {
+    pthread_mutex_lock(&info->lock); // the uri-list may be moving 'data'
+    char *name_ptr = strrchr(info->data, '/');
+    name_ptr = name_ptr ? name_ptr + 1 : info->data;
+    snprintf(info->name, sizeof(info->name), "%s \xFA %s", name_ptr, amount);
+    pthread_mutex_unlock(&info->lock);
+  } else {
+    char count[32];
+    FormatCount(count, sizeof(count), info->count);
+    snprintf(info->name, sizeof(info->name), "%s files \xFA %s", count, amount);
+  }
+}
 
 void FileInfoFree(FileInfo *info) {
   if (!info) return;
-  if (info->uri) free(info->uri);
-  if (info->name) free(info->name);
-  free(info);
+  MetaFinish(&info->meta, info->arena);
+  if (info->extracting) {
+    kill(info->extract_pid, SIGTERM);
+    ExtractFinished(info, 1);
+  }
+  if (info->virt.on_disk) RemoveWithParents(info->data);
+  size_t index = 0;
+  for (char *path = info->data;
+       info->member_count && path < info->data + info->paths_size;
+       index++) {
+    size_t len = strlen(path);
+    ArchiveMember *m = FileInfoMember(info, index);
+    if (m && m->on_disk) RemoveWithParents(path);
+    path += len + 1;
+  }
+  // Already gone if something was extracted into it.
+  if (info->members_dir) rmdir(info->members_dir);
+  if (info->virt.fd >= 0) close(info->virt.fd);
+  ArenaReport(info->arena, "session");
+  ArenaDestroy(info->arena);
+}
+
+// Open addressing set of paths already in a FileInfo, keyed by FNV-1a.
+// Slots hold offsets into FileInfo.data so nothing is copied.
+typedef struct {
+  Arena *arena;
+  size_t *offsets;
+  uint64_t *hashes;
+  size_t count;
+  size_t capacity;
+} PathSet;
+
+static uint64_t HashPath(const char *s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *s; s++) h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+  return h;
+}
+
+static int PathSetGrow(PathSet *set) {
+  size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+  size_t *offsets = ArenaAlloc(set->arena, capacity * sizeof(size_t));
+  uint64_t *hashes = ArenaAlloc(set->arena, capacity * sizeof(uint64_t));
+  if (!offsets || !hashes) return 0;
+
+  for (size_t i = 0; i < set->capacity; i++) {
+    if (!set->hashes[i]) continue;
+    size_t j = set->hashes[i] & (capacity - 1);
+    while (hashes[j]) j = (j + 1) & (capacity - 1);
+    hashes[j] = set->hashes[i];
+    offsets[j] = set->offsets[i];
+  }
+
+  set->offsets = offsets;
+  set->hashes = hashes;
+  set->capacity = capacity;
+  return 1;
+}
+
+// Adds 'path' to the list unless it is already there.
+// Returns 1 when added, 0 for a duplicate and -1 on allocation failure.
+static int FileInfoAddUniquePath(FileInfo *info, PathSet *set, const char *path) {
+  if ((set->count + 1) * 2 > set->capacity && !PathSetGrow(set)) return -1;
+
+  uint64_t hash = HashPath(path) | 1; // 0 marks an empty slot
+  size_t i = hash & (set->capacity - 1);
+  while (set->hashes[i]) {
+    if (set->hashes[i] == hash && strcmp(info->data + set->offsets[i], path) == 0) {
+      return 0;
+    }
+    i = (i + 1) & (set->capacity - 1);
+  }
+
+  size_t offset = info->size;
+  if (!FileInfoAddPath(info, path)) return -1;
+
+  set->hashes[i] = hash;
+  set->offsets[i] = offset;
+  set->count++;
+  return 1;
+}
+
+// Raw paths collected from argv, list files and stdin before they are
+// resolved in one parallel pass. Entries point into argv, into mapped list
+// files or into the session arena; nothing is copied per path.
+typedef struct ListMapping {
+  struct ListMapping *next;
+  void *addr;
+  size_t size;
+} ListMapping;
+
+typedef struct {
+  Arena *arena;
+  PathInput *items;
+  size_t count;
+  size_t capacity;
+  ListMapping *mappings;
+} InputList;
+
+// Unmaps the list files once their entries have been resolved.
+static void InputListRelease(InputList *list) {
+  for (ListMapping *m = list->mappings; m; m = m->next) munmap(m->addr, m->size);
+  list->mappings = NULL;
+}
+
+// 'entry[len]' must be readable; it is either '\0' or a separator.
+static int InputListAdd(InputList *list, const char *entry, size_t len) {
+  if (len == 0) return 1;
+  if (len >= PATH_MAX) {
+    LOG("Path too long in file list\n");
+    return 0;
+  }
+
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 256;
+    PathInput *items = ArenaGrow(
+      list->arena, list->items,
+      list->capacity * sizeof(PathInput), capacity * sizeof(PathInput)
+    );
+    if (!items) return 0;
+    list->items = items;
+    list->capacity = capacity;
+  }
+
+  list->items[list->count++] = (PathInput){ .path = entry, .len = len };
+  return 1;
+}
+
+// Entries are separated by NUL. A list without any NUL byte is treated as
+// one path per line, so plain text lists work too. The mapping stays alive
+// until the paths are resolved.
+static int ReadListFile(InputList *list, const char *file) {
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG("Cannot open file list %s\n", file);
+    return 0;
+  }
+
+  struct stat sb;
+  if (fstat(fd, &sb) < 0) {
+    close(fd);
+    return 0;
+  }
+  if (sb.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+
+  size_t size = sb.st_size;
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+
+  ListMapping *m = ArenaAlloc(list->arena, sizeof(ListMapping));
+  if (!m) {
+    munmap(map, size);
+    return 0;
+  }
+  *m = (ListMapping){ .next = list->mappings, .addr = map, .size = size };
+  list->mappings = m;
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  char sep = memchr(map, '\0', size) ? '\0' : '\n';
+
+  const char *p = map, *end = map + size;
+  while (p < end) {
+    const char *next = memchr(p, sep, end - p);
+    size_t len = (next ? next : end) - p;
+
+    if (next) {
+      if (!InputListAdd(list, p, len)) return 0;
+    } else if (len < PATH_MAX) {
+      // The last entry may not be terminated and the byte after it lies
+      // outside the mapping, so it gets a copy of its own.
+      char *raw = ArenaStrndup(list->arena, p, len);
+      if (!raw || !InputListAdd(list, raw, len)) return 0;
+    } else {
+      LOG("Path too long in file list\n");
+      return 0;
+    }
+
+    p += len + 1;
+  }
+
+  return 1;
+}
+
+// Reads NUL-delimited paths from stdin in fixed chunks into one buffer.
+static int ReadListStdin(InputList *list) {
+  size_t size = 0, capacity = 65536;
+  char *buf = ArenaAlloc(list->arena, capacity);
+  if (!buf) return 0;
+
+  while (1) {
+    if (capacity - size < 65536) {
+      buf = ArenaGrow(list->arena, buf, capacity, capacity * 2);
+      if (!buf) return 0;
+      capacity *= 2;
+    }
+
+    ssize_t n = read(STDIN_FILENO, buf + size, capacity - size - 1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    if (n == 0) break;
+    size += n;
+  }
+  buf[size] = '\0';
+
+  for (char *p = buf, *end = buf + size; p < end; ) {
+    size_t len = strlen(p);
+    if (!InputListAdd(list, p, len)) return 0;
+    p += len + 1;
+  }
+
+  return 1;
+}
+
+// "archive.tar:path/inside" names a member when no such file exists and a
+// prefix up to one of the colons is a regular file. Returns 1 if 'arg' was
+// added as a member, 0 if it is a plain path and -1 on error.
+static int AddArchiveMember(FileInfo *info, const char *arg) {
+  struct stat sb;
+  if (!strchr(arg, ':') || lstat(arg, &sb) == 0) return 0;
+
+  for (const char *colon = strchr(arg, ':'); colon; colon = strchr(colon + 1, ':')) {
+    if (colon == arg || !colon[1] || colon - arg >= PATH_MAX) continue;
+    char archive[PATH_MAX];
+    memcpy(archive, arg, colon - arg);
+    archive[colon - arg] = '\0';
+    if (stat(archive, &sb) < 0 || !S_ISREG(sb.st_mode)) continue;
+
+    size_t n = info->member_count;
+    ArchiveMember *members = ArenaGrow(
+      info->arena, info->members, n * sizeof(ArchiveMember), (n + 1) * sizeof(ArchiveMember)
+    );
+    if (!members) return -1;
+    members[n] = (ArchiveMember){
+      .archive = ArenaStrndup(info->arena, arg, colon - arg),
+      .name = colon + 1,
+      .index = SIZE_MAX,
+    };
+    if (!members[n].archive) return -1;
+    info->members = members;
+    info->member_count++;
+    return 1;
+  }
+  return 0;
+}
+
+// A whole number of 0 or more for options like --max-depth, or -1 when
+// 'value' is anything else.
+static int ParseCount(const char *value) {
+  char *end;
+  errno = 0;
+  long n = strtol(value, &end, 10);
+  if (end == value || *end || errno || n < 0 || n > INT_MAX) return -1;
+  return (int)n;
+}
+
+static void PrintUsage(const char *program) {
+  printf(
+    "Usage: %s [options] [--] <file_path|archive:member>...\n"
+    "       %s --receive\n"
+    "       %s --daemon\n"
+    "       %s --session\n"
+    "  --stdin0            read NUL-delimited paths from stdin\n"
+    "  --from-file <list>  read paths from a NUL- or newline-delimited file\n"
+    "  --recursive         drag the files inside directories instead\n"
+    "  --max-depth <n>     with --recursive, descend at most n levels\n"
+    "  --include <glob>    with --recursive, only files matching a glob\n"
+    "  --exclude <glob>    with --recursive, skip matching files and directories\n"
+    "  --name <name>       without paths, drag the data on stdin as a file\n"
+    "  --mime <type>       without paths, content type of the data on stdin\n"
+    "  --idle-timeout <s>  give up without pointer input for s seconds (default %d)\n"
+    "  --drop-timeout <s>  give up when the target has not finished s seconds\n"
+    "                      after the drop (default %d)\n"
+    "  --transfer-timeout <s>  drop a receiver that reads nothing for s seconds\n"
+    "                      (default %d); 0 disables any of the timeouts\n"
+    "  --receive           open a window to drop files on and print their paths\n"
+    "                      NUL-delimited on stdout\n"
+    "  --into <dir>        with --receive, save dropped files and content in dir\n"
+    "                      and print the new paths instead\n"
+    "  --copy              put the files on the clipboard instead of dragging them\n"
+    "  --daemon            keep the display connection open and serve later drags\n"
+    "                      over a socket in $XDG_RUNTIME_DIR\n"
+    "  --session           run many drags on one connection, driven by commands\n"
+    "                      on stdin: add <path>, clear, start, wait, quit\n",
+    program, program, program, program, WATCHDOG_IDLE_DEFAULT, WATCHDOG_DROP_DEFAULT, WATCHDOG_TRANSFER_DEFAULT
+  );
+}
+
+static int ReadInputs(FileInfo *info, InputList *inputs, int argc, char **argv) {
+  Options *o = &info->options;
+  o->walk.max_depth = -1;
+  o->idle_timeout = WATCHDOG_IDLE_DEFAULT;
+  o->drop_timeout = WATCHDOG_DROP_DEFAULT;
+  o->transfer_timeout = WATCHDOG_TRANSFER_DEFAULT;
+  o->output = STDOUT_FILENO;
+  o->signal_fd = -1;
+  o->walk.include = ArenaAlloc(info->arena, argc * sizeof(char*));
+  o->walk.exclude = ArenaAlloc(info->arena, argc * sizeof(char*));
+  if (!o->walk.include || !o->walk.exclude) return 0;
+
+  int options = 1;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+
+    if (options && strcmp(arg, "--") == 0) {
+      options = 0;
+      continue;
+    }
+    if (!options || arg[0] != '-' || arg[1] != '-') {
+      int member = AddArchiveMember(info, arg);
+      if (member < 0) return 0;
+      if (!member && !InputListAdd(inputs, arg, strlen(arg))) return 0;
+      continue;
+    }
+
+    if (strcmp(arg, "--stdin0") == 0) {
+      if (!ReadListStdin(inputs)) return 0;
+      continue;
+    }
+    if (strcmp(arg, "--recursive") == 0) {
+      o->recursive = 1;
+      continue;
+    }
+    if (strcmp(arg, "--receive") == 0) {
+      o->receive = 1;
+      continue;
+    }
+    if (strcmp(arg, "--copy") == 0) {
+      o->copy = 1;
+      continue;
+    }
+
+    // Everything below takes a value.
+    if (i + 1 >= argc) {
+      PrintUsage(argv[0]);
+      return 0;
+    }
+    const char *value = argv[++i];
+    int count = ParseCount(value);
+    int *counted = NULL;
+
+    if (strcmp(arg, "--from-file") == 0) {
+      if (!ReadListFile(inputs, value)) return 0;
+    } else if (strcmp(arg, "--max-depth") == 0) {
+      counted = &o->walk.max_depth;
+    } else if (strcmp(arg, "--include") == 0) {
+      o->walk.include[o->walk.include_count++] = value;
+    } else if (strcmp(arg, "--exclude") == 0) {
+      o->walk.exclude[o->walk.exclude_count++] = value;
+    } else if (strcmp(arg, "--mime") == 0) {
+      o->mime = value;
+    } else if (strcmp(arg, "--name") == 0) {
+      o->name = value;
+    } else if (strcmp(arg, "--idle-timeout") == 0) {
+      counted = &o->idle_timeout;
+    } else if (strcmp(arg, "--drop-timeout") == 0) {
+      counted = &o->drop_timeout;
+    } else if (strcmp(arg, "--transfer-timeout") == 0) {
+      counted = &o->transfer_timeout;
+    } else if (strcmp(arg, "--into") == 0) {
+      o->into = value;
+    } else {
+      PrintUsage(argv[0]);
+      return 0;
+    }
+
+    if (counted) {
+      if (count < 0) {
+        PrintUsage(argv[0]);
+        return 0;
+      }
+      *counted = count;
+    }
+  }
+
+  // --copy runs until another client takes the clipboard.
+  if (o->copy) o->idle_timeout = o->drop_timeout = 0;
+  return 1;
+}
+
+typedef struct {
+  FileInfo *info;
+  PathSet *set;
+} CollectContext;
+
+static int AddWalkedPaths(void *ctx, const char *paths, size_t size) {
+  CollectContext *c = ctx;
+  for (const char *p = paths; p < paths + size; p += strlen(p) + 1) {
+    if (FileInfoAddUniquePath(c->info, c->set, p) < 0) return 0;
+  }
+  return 1;
+}
+
+// Spools stdin into a memfd and records the path a URI would point to.
+static int CollectStdinData(FileInfo *info) {
+  VirtualFile *v = &info->virt;
+  const char *name = info->options.name ? info->options.name : "stdin";
+  if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+    LOG("Invalid --name %s\n", name);
+    return 0;
+  }
+
+  v->fd = SpoolToMemfd(STDIN_FILENO, name, &v->size);
+  if (v->fd < 0) return 0;
+
+  char path[PATH_MAX];
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  int n;
+  if (runtime && *runtime) {
+    n = snprintf(path, sizeof(path), "%s/drag-%d/%s", runtime, (int)getpid(), name);
+    v->needs_file = 1;
+  } else {
+    // Only readable by processes of the same user, but needs no disk.
+    n = snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)getpid(), v->fd);
+  }
+  if (n < 0 || (size_t)n >= sizeof(path)) return 0;
+
+  LOG("Read %zu bytes from stdin\n", v->size);
+  return FileInfoAddPath(info, path);
+}
+
+static int CompareMembers(const void *a, const void *b) {
+  return strcmp(((const ArchiveMember*)a)->archive, ((const ArchiveMember*)b)->archive);
+}
+
+// Indexes each archive once for all of its members and adds the paths the
+// members get if a target wants URIs: RuntimeDir()/drag-XXXXXX/ARCHIVE/MEMBER.
+// The directory comes from mkdtemp(), so even in a shared /tmp nobody else
+// can have created it, or the tree below it, to read or redirect the data.
+static int CollectMembers(FileInfo *info, PathSet *set) {
+  ArchiveMember *members = info->members;
+  size_t count = info->member_count;
+  if (!count) return 1;
+
+  char dir[PATH_MAX];
+  int length = snprintf(dir, sizeof(dir), "%s/drag-XXXXXX", RuntimeDir());
+  if (length < 0 || (size_t)length >= sizeof(dir) || !mkdtemp(dir)) {
+    LOG("Cannot create a directory for archive members\n");
+    return 0;
+  }
+  info->members_dir = ArenaStrndup(info->arena, dir, length);
+  if (!info->members_dir) {
+    rmdir(dir);
+    return 0;
+  }
+
+  qsort(members, count, sizeof(ArchiveMember), CompareMembers);
+  for (size_t i = 0, j; i < count; i = j) {
+    for (j = i + 1; j < count && !strcmp(members[i].archive, members[j].archive); j++);
+    if (!ArchiveIndex(members + i, j - i)) return 0;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    ArchiveMember *m = &members[i];
+    const char *name = ArchiveTrim(m->name);
+    if (!strcmp(name, "..") || !strncmp(name, "../", 3) || strstr(name, "/../")) {
+      LOG("Refusing member outside the archive root: %s\n", m->name);
+      return 0;
+    }
+
+    const char *base = strrchr(m->archive, '/');
+    base = base ? base + 1 : m->archive;
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/%s/%s", info->members_dir, base, name);
+    if (n < 0 || (size_t)n >= sizeof(path)) return 0;
+
+    int added = FileInfoAddUniquePath(info, set, path);
+    if (added < 0) return 0;
+    if (added) m->index = info->count - 1;
+  }
+  return 1;
+}
+
+static int CollectPaths(FileInfo *info, int argc, char **argv) {
+  InputList inputs = { .arena = info->arena };
+  Resolver resolver;
+
+  int ok = ReadInputs(info, &inputs, argc, argv);
+  if (ok && info->options.into) {
+    struct stat sb;
+    if (stat(info->options.into, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+      LOG("--into %s is not a directory\n", info->options.into);
+      return 0;
+    }
+    info->options.receive = 1;
+  }
+  if (ok && info->options.receive) {
+    if (info->options.copy) {
+      LOG("--copy and --receive don't go together\n");
+      return 0;
+    }
+    if (inputs.count == 0 && !info->member_count) return 1;
+    LOG("--receive takes no paths\n");
+    return 0;
+  }
+  if (ok && (info->options.mime || info->options.name)) {
+    if (inputs.count == 0 && !info->member_count) return CollectStdinData(info);
+    LOG("--mime and --name only apply to data on stdin\n");
+    return 0;
+  }
+  if (ok && inputs.count == 0 && info->member_count == 0) {
+    PrintUsage(argv[0]);
+    ok = 0;
+  }
+  ok = ok && ResolvePaths(&resolver, info->arena, inputs.items, inputs.count);
+  InputListRelease(&inputs);
+  if (!ok) return 0;
+
+  PathSet set = { .arena = info->arena };
+  const char **roots = NULL;
+  size_t root_count = 0;
+  if (info->options.recursive) {
+    roots = ArenaAlloc(info->arena, inputs.count * sizeof(char*));
+    if (!roots) return 0;
+  }
+
+  for (size_t i = 0; i < inputs.count; i++) {
+    const char *path = ResolvedPath(&resolver, i);
+    struct stat sb;
+
+    if (roots && stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+      roots[root_count] = ArenaStrndup(info->arena, path, strlen(path));
+      if (!roots[root_count++]) return 0;
+    } else if (FileInfoAddUniquePath(info, &set, path) < 0) {
+      LOG("Memory allocation failed");
+      return 0;
+    }
+  }
+
+  CollectContext ctx = { .info = info, .set = &set };
+  if (!WalkDirectories(
+    info->arena, &info->options.walk,
+    roots, root_count, AddWalkedPaths, &ctx
+  )) return 0;
+
+  if (!CollectMembers(info, &set)) return 0;
+
+  if (info->count == 0) {
+    LOG("Nothing to drag\n");
+    return 0;
+  }
+
+  return 1;
 }
 
 FileInfo* CommandLineArguments(int argc, char **argv) {
   if (argc < 2) {
-    printf("Usage: %s <file_path>\n", argv[0]);
+    PrintUsage(argv[0]);
     return NULL;
   }
 
-  char *path = realpath(argv[1], NULL);
-  if (!path) {
-    LOG("Error resolving path %s", argv[1]);
+  Arena *arena = ArenaCreate();
+  if (!arena) {
+    LOG("Memory allocation failed");
     return NULL;
   }
-  defer { free(path); };
 
-  char *uri = CreateUriList(path);
-  if (!uri) {
-    LOG("Error creating uri");
-    return NULL; 
-  }
-  defer { if (uri) free(uri); };
-
-  FileInfo *result = calloc(1, sizeof(FileInfo));
+  FileInfo *result = ArenaAlloc(arena, sizeof(FileInfo));
   if (!result) {
-    LOG("Memory allocation failed");
-    return NULL; 
+    ArenaDestroy(arena);
+    return NULL;
   }
-  defer { if (result) FileInfoFree(result); };
+  result->arena = arena;
+  result->meta.fd = -1;
+  result->virt.fd = -1;
+  result->extract_fd = -1;
+  pthread_mutex_init(&result->lock, NULL);
 
-  result->uri = uri;
-  uri = NULL; 
+  if (!CollectPaths(result, argc, argv)) {
+    FileInfoFree(result);
+    return NULL;
+  }
 
-  char *name_ptr = strrchr(path, '/');
-  if (name_ptr) name_ptr++;
-  else name_ptr = path;
+  if (result->options.receive) {
+    snprintf(result->name, sizeof(result->name), "Drop files here");
+    return result;
+  }
 
-  result->name = strdup(name_ptr);
+  if (result->count == 1) {
+    char *name_ptr = strrchr(result->data, '/');
+    if (name_ptr) name_ptr++;
+    else name_ptr = result->data;
+    snprintf(result->name, sizeof(result->name), "%s", name_ptr);
+  } else {
+    snprintf(result->name, sizeof(result->name), "%zu files", result->count);
+  }
 
-  if (!result->name) {
-    LOG("String duplication failed");
-    return NULL;
+  if (result->virt.fd >= 0) {
+    char amount[32];
+    FormatSize(amount, sizeof(amount), result->virt.size);
+    snprintf(result->name, sizeof(result->name), "%s \xFA %s",
+             result->options.name ? result->options.name : "stdin", amount);
   }
 
-  LOG("Dragging: %s, Name: %s", result->uri, result->name);
- 
-  FileInfo *retval = result;
-  result = NULL;
+  LOG("Dragging: %zu paths, Name: %s\n", result->count, result->name);
+
+  return result;
+}
+
+// Where --receive writes the dropped paths: stdout, or with --into a
+// memfd the files are copied from once the drop is over. Returns -1 on
+// failure.
+int ReceiveOpen(const Options *o) {
+  if (!o->into) return o->output;
+  int fd = memfd_create("drag-received", MFD_CLOEXEC);
+  if (fd < 0) LOG("Cannot create memfd\n");
+  return fd;
+}
 
-  return retval;
+// The drop is over and the source released. With --into, copies the
+// dropped files and prints where they went.
+int ReceiveClose(const Options *o, int fd, int ok) {
+  if (!o->into || fd < 0) return ok;
+  ok = ok && SaveFiles(fd, o->into, o->output);
+  close(fd);
+  return ok;
 }
 
 static void GetTextSize(const char *text, int *w, int *h) {
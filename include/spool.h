@@ -0,0 +1,98 @@
+#ifndef DRAG_SPOOL_H
+#define DRAG_SPOOL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "macros.h"
+
+// Spools a stream into a sealed memfd so generated data can be dragged
+// without a temp file. Pipes are spliced into the memfd and regular files
+// are sendfile()d, so the data is never copied through user space. The
+// seals make the contents immutable while targets read them.
+
+#define SPOOL_STEP (1 << 20)
+#define SPOOL_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+// Copies 'in' up to EOF into 'out' at its current offset, with a read/write
+// loop for inputs splice() and sendfile() both refuse, like ttys.
+static int SpoolCopy(int in, int out, size_t *size) {
+  int mode = 0; // 0 splice, 1 sendfile, 2 read/write
+  char buf[65536];
+
+  while (1) {
+    ssize_t n;
+    if (mode == 0) {
+      n = splice(in, NULL, out, NULL, SPOOL_STEP, SPLICE_F_MOVE);
+    } else if (mode == 1) {
+      n = sendfile(out, in, NULL, SPOOL_STEP);
+    } else {
+      n = read(in, buf, sizeof(buf));
+      for (ssize_t done = 0, w; n > 0 && done < n; done += w) {
+        w = write(out, buf + done, n - done);
+        if (w < 0 && errno == EINTR) w = 0;
+        else if (w < 0) return 0;
+      }
+    }
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if ((errno == EINVAL || errno == ENOSYS) && mode < 2) {
+        mode++;
+        continue;
+      }
+      return 0;
+    }
+    if (n == 0) return 1;
+    *size += n;
+  }
+}
+
+// Returns a sealed memfd holding everything read from 'in', or -1.
+int SpoolToMemfd(int in, const char *name, size_t *size) {
+  int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    LOG("Cannot create memfd\n");
+    return -1;
+  }
+
+  *size = 0;
+  if (!SpoolCopy(in, fd, size)) {
+    LOG("Cannot read data from stdin\n");
+    close(fd);
+    return -1;
+  }
+
+  if (fcntl(fd, F_ADD_SEALS, SPOOL_SEALS) < 0) LOG("Cannot seal memfd\n");
+  return fd;
+}
+
+// Writes the contents of 'fd' to a new file at 'path'.
+int SpoolMaterialize(int fd, size_t size, const char *path) {
+  int out = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (out < 0) {
+    LOG("Cannot create %s\n", path);
+    return 0;
+  }
+
+  off_t offset = 0;
+  while ((size_t)offset < size) {
+    ssize_t n = sendfile(out, fd, &offset, size - offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      close(out);
+      unlink(path);
+      return 0;
+    }
+  }
+
+  close(out);
+  return 1;
+}
+
+#endif // DRAG_SPOOL_H
@@ -0,0 +1,272 @@
+#ifndef DRAG_URI_H
+#define DRAG_URI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define URI_SIMD 1
+#include <immintrin.h>
+#endif
+
+// RFC 3986 percent-encoding of file paths.
+// Unreserved bytes (ALPHA / DIGIT / "-" / "." / "_" / "~") and '/' are
+// copied, everything else becomes "%XX". The SIMD kernels classify 16 or 32
+// bytes at once and copy whole blocks when nothing in them needs escaping,
+// which is the common case even for CJK or emoji heavy trees: only the
+// non-ASCII bytes themselves are escaped.
+//
+// Decoding is the reverse: the kernels look for '%' 16 or 32 bytes at a
+// time, copy everything before it as one block and only decode the escape
+// itself. A '%' not followed by two hex digits is copied as is.
+
+static const char URI_HEX[] = "0123456789ABCDEF";
+
+static inline int UriIsSafe(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+         c == '_' || c == '~' || c == '/';
+}
+
+// Scalar reference. Every kernel must produce exactly this output.
+static size_t UriEncodeScalar(char *out, const char *in, size_t len) {
+  char *p = out;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)in[i];
+    if (UriIsSafe(c)) {
+      *p++ = c;
+    } else {
+      *p++ = '%';
+      *p++ = URI_HEX[c >> 4];
+      *p++ = URI_HEX[c & 15];
+    }
+  }
+  return p - out;
+}
+
+static size_t UriEncodedLengthScalar(const char *in, size_t len) {
+  size_t n = len;
+  for (size_t i = 0; i < len; i++) {
+    if (!UriIsSafe((unsigned char)in[i])) n += 2;
+  }
+  return n;
+}
+
+static inline int UriHexValue(unsigned char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Decodes the escape or the single byte at 'in' into 'p' and returns how
+// many input bytes it took.
+static inline size_t UriUnescape(char *p, const char *in, size_t len) {
+  if (in[0] == '%' && len >= 3) {
+    int hi = UriHexValue(in[1]), lo = UriHexValue(in[2]);
+    if (hi >= 0 && lo >= 0) {
+      *p = (char)(hi << 4 | lo);
+      return 3;
+    }
+  }
+  *p = in[0];
+  return 1;
+}
+
+// Writes at most 'len' bytes, decoding never grows the input.
+static size_t UriDecodeScalar(char *out, const char *in, size_t len) {
+  char *p = out;
+  size_t i = 0;
+  while (i < len) {
+    const char *pct = memchr(in + i, '%', len - i);
+    size_t n = pct ? (size_t)(pct - in) - i : len - i;
+    memcpy(p, in + i, n);
+    p += n;
+    i += n;
+    if (i < len) i += UriUnescape(p++, in + i, len - i);
+  }
+  return p - out;
+}
+
+#ifdef URI_SIMD
+
+// "-./0-9" happen to be one contiguous range, so five compares cover the
+// whole unreserved set. Bytes >= 0x80 are negative as signed chars and fail
+// every range check, as they should.
+#define URI_RANGE(x, lo, hi, P, BITS) \
+  P##_and_si##BITS( \
+    P##_cmpgt_epi8(x, P##_set1_epi8((lo) - 1)), \
+    P##_cmpgt_epi8(P##_set1_epi8((hi) + 1), x))
+
+#define URI_SAFE_MASK(x, P, BITS) \
+  P##_or_si##BITS( \
+    P##_or_si##BITS(URI_RANGE(x, 0x2D, 0x39, P, BITS), URI_RANGE(x, 'A', 'Z', P, BITS)), \
+    P##_or_si##BITS( \
+      P##_or_si##BITS(URI_RANGE(x, 'a', 'z', P, BITS), \
+                      P##_cmpeq_epi8(x, P##_set1_epi8('_'))), \
+      P##_cmpeq_epi8(x, P##_set1_epi8('~'))))
+
+static inline char* UriEscapeBlock(char *p, const char *in, size_t n, uint32_t safe) {
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = (unsigned char)in[i];
+    if (safe & (1u << i)) {
+      *p++ = c;
+    } else {
+      *p++ = '%';
+      *p++ = URI_HEX[c >> 4];
+      *p++ = URI_HEX[c & 15];
+    }
+  }
+  return p;
+}
+
+static size_t UriEncodedLengthSSE2(const char *in, size_t len) {
+  size_t n = len, i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+    uint32_t safe = _mm_movemask_epi8(URI_SAFE_MASK(x, _mm, 128));
+    n += 2 * (16 - __builtin_popcount(safe));
+  }
+  return n + UriEncodedLengthScalar(in + i, len - i) - (len - i);
+}
+
+static size_t UriEncodeSSE2(char *out, const char *in, size_t len) {
+  char *p = out;
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+    uint32_t safe = _mm_movemask_epi8(URI_SAFE_MASK(x, _mm, 128));
+    if (safe == 0xFFFF) {
+      _mm_storeu_si128((__m128i*)p, x);
+      p += 16;
+    } else {
+      p = UriEscapeBlock(p, in + i, 16, safe);
+    }
+  }
+  p += UriEncodeScalar(p, in + i, len - i);
+  return p - out;
+}
+
+__attribute__((target("avx2")))
+static size_t UriEncodedLengthAVX2(const char *in, size_t len) {
+  size_t n = len, i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(in + i));
+    uint32_t safe = _mm256_movemask_epi8(URI_SAFE_MASK(x, _mm256, 256));
+    n += 2 * (32 - __builtin_popcount(safe));
+  }
+  return n + UriEncodedLengthSSE2(in + i, len - i) - (len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t UriEncodeAVX2(char *out, const char *in, size_t len) {
+  char *p = out;
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(in + i));
+    uint32_t safe = _mm256_movemask_epi8(URI_SAFE_MASK(x, _mm256, 256));
+    if (safe == 0xFFFFFFFFu) {
+      _mm256_storeu_si256((__m256i*)p, x);
+      p += 32;
+    } else {
+      p = UriEscapeBlock(p, in + i, 32, safe);
+    }
+  }
+  p += UriEncodeSSE2(p, in + i, len - i);
+  return p - out;
+}
+
+// The output never runs ahead of the input, so a full block store at 'p'
+// stays inside the first 'len' bytes of 'out'. Bytes past the '%' it
+// copies are overwritten by what follows.
+static size_t UriDecodeSSE2(char *out, const char *in, size_t len) {
+  const __m128i percent = _mm_set1_epi8('%');
+  char *p = out;
+  size_t i = 0;
+  while (i + 16 <= len) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+    uint32_t escapes = _mm_movemask_epi8(_mm_cmpeq_epi8(x, percent));
+    _mm_storeu_si128((__m128i*)p, x);
+    if (!escapes) {
+      p += 16;
+      i += 16;
+      continue;
+    }
+    size_t n = __builtin_ctz(escapes);
+    p += n;
+    i += n;
+    i += UriUnescape(p++, in + i, len - i);
+  }
+  p += UriDecodeScalar(p, in + i, len - i);
+  return p - out;
+}
+
+__attribute__((target("avx2")))
+static size_t UriDecodeAVX2(char *out, const char *in, size_t len) {
+  const __m256i percent = _mm256_set1_epi8('%');
+  char *p = out;
+  size_t i = 0;
+  while (i + 32 <= len) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(in + i));
+    uint32_t escapes = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, percent));
+    _mm256_storeu_si256((__m256i*)p, x);
+    if (!escapes) {
+      p += 32;
+      i += 32;
+      continue;
+    }
+    size_t n = __builtin_ctz(escapes);
+    p += n;
+    i += n;
+    i += UriUnescape(p++, in + i, len - i);
+  }
+  p += UriDecodeSSE2(p, in + i, len - i);
+  return p - out;
+}
+
+#endif // URI_SIMD
+
+typedef struct {
+  size_t (*length)(const char *in, size_t len);
+  size_t (*encode)(char *out, const char *in, size_t len);
+  size_t (*decode)(char *out, const char *in, size_t len);
+} UriKernel;
+
+static UriKernel UriSelected;
+static pthread_once_t UriSelectedOnce = PTHREAD_ONCE_INIT;
+
+static void UriSelectKernel(void) {
+  UriSelected = (UriKernel){ UriEncodedLengthScalar, UriEncodeScalar, UriDecodeScalar };
+#ifdef URI_SIMD
+  UriSelected = (UriKernel){ UriEncodedLengthSSE2, UriEncodeSSE2, UriDecodeSSE2 };
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    UriSelected = (UriKernel){ UriEncodedLengthAVX2, UriEncodeAVX2, UriDecodeAVX2 };
+  }
+#endif
+}
+
+// The X11 selection thread, libdrag and --session workers encode and
+// decode concurrently, so the choice is made exactly once.
+static const UriKernel* UriGetKernel(void) {
+  pthread_once(&UriSelectedOnce, UriSelectKernel);
+  return &UriSelected;
+}
+
+// Exact number of bytes UriEncode() writes for 'in'.
+static inline size_t UriEncodedLength(const char *in, size_t len) {
+  return UriGetKernel()->length(in, len);
+}
+
+static inline size_t UriEncode(char *out, const char *in, size_t len) {
+  return UriGetKernel()->encode(out, in, len);
+}
+
+// Returns the decoded length, at most 'len'. 'out' must not overlap 'in'.
+static inline size_t UriDecode(char *out, const char *in, size_t len) {
+  return UriGetKernel()->decode(out, in, len);
+}
+
+#endif // DRAG_URI_H
@@ -0,0 +1,263 @@
+#ifndef DRAG_WALK_H
+#define DRAG_WALK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "macros.h"
+#include "arena.h"
+
+// Parallel directory walker for recursive drags. Directories are read with
+// getdents64 into a large buffer by a pool of workers sharing one queue, so
+// a 200k file tree costs a few thousand syscalls per thread instead of a
+// readdir() + realpath() per file. Directory paths are already canonical,
+// so entries are joined onto them without resolving again. Symlinks are
+// emitted as they are and never followed, which also rules out cycles.
+// Found files are batched per worker and handed to 'emit' under the walker
+// lock, so the caller can append them straight to its uri-list buffer.
+
+#define WALK_MAX_THREADS 16
+#define WALK_BATCH_SIZE 65536
+#define WALK_DENTS_SIZE 65536
+
+typedef struct {
+  int max_depth;             // -1 for no limit
+  const char **include;      // file name globs, any must match
+  size_t include_count;
+  const char **exclude;      // globs pruning files and directories
+  size_t exclude_count;
+} WalkOptions;
+
+// Receives NUL-terminated paths back to back. Returns 0 to abort the walk.
+typedef int (*WalkEmit)(void *ctx, const char *paths, size_t size);
+
+typedef struct {
+  const char *path;
+  size_t len;
+  int depth;
+} WalkDir;
+
+typedef struct {
+  const WalkOptions *options;
+  WalkEmit emit;
+  void *ctx;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  Arena *arena;          // queue storage, only touched under 'lock'
+  WalkDir *queue;
+  size_t queued;
+  size_t capacity;
+  size_t busy;           // directories queued or being read
+  int failed;
+} Walker;
+
+typedef struct {
+  Walker *w;
+  Arena *arena;
+  char batch[WALK_BATCH_SIZE];
+  size_t used;
+} WalkWorker;
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Patterns containing a '/' are matched against the whole path, others
+// against the entry name, like find's -path and -name.
+static int WalkMatches(const char **globs, size_t count, const char *path, const char *name) {
+  for (size_t i = 0; i < count; i++) {
+    const char *subject = strchr(globs[i], '/') ? path : name;
+    if (fnmatch(globs[i], subject, 0) == 0) return 1;
+  }
+  return 0;
+}
+
+static int WalkPush(Walker *w, const char *path, size_t len, int depth) {
+  pthread_mutex_lock(&w->lock);
+  if (w->queued == w->capacity) {
+    size_t capacity = w->capacity ? w->capacity * 2 : 256;
+    WalkDir *queue = ArenaGrow(
+      w->arena, w->queue, w->capacity * sizeof(WalkDir), capacity * sizeof(WalkDir)
+    );
+    if (!queue) {
+      w->failed = 1;
+      pthread_cond_broadcast(&w->wake);
+      pthread_mutex_unlock(&w->lock);
+      return 0;
+    }
+    w->queue = queue;
+    w->capacity = capacity;
+  }
+  w->queue[w->queued++] = (WalkDir){ .path = path, .len = len, .depth = depth };
+  w->busy++;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+  return 1;
+}
+
+static int WalkFlush(WalkWorker *ww) {
+  if (!ww->used) return 1;
+  Walker *w = ww->w;
+  pthread_mutex_lock(&w->lock);
+  int ok = !w->failed && w->emit(w->ctx, ww->batch, ww->used);
+  if (!ok) {
+    w->failed = 1;
+    pthread_cond_broadcast(&w->wake);
+  }
+  pthread_mutex_unlock(&w->lock);
+  ww->used = 0;
+  return ok;
+}
+
+static int WalkEmitFile(WalkWorker *ww, const char *path, size_t len) {
+  if (ww->used + len + 1 > sizeof(ww->batch) && !WalkFlush(ww)) return 0;
+  memcpy(ww->batch + ww->used, path, len + 1);
+  ww->used += len + 1;
+  return 1;
+}
+
+static int WalkReadDir(WalkWorker *ww, const WalkDir *dir) {
+  Walker *w = ww->w;
+  const WalkOptions *o = w->options;
+
+  int fd = openat(AT_FDCWD, dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    LOG("Cannot open directory %s\n", dir->path);
+    return 1; // unreadable directories are skipped, like find does
+  }
+
+  char dents[WALK_DENTS_SIZE];
+  char path[PATH_MAX];
+  memcpy(path, dir->path, dir->len);
+  size_t prefix = dir->len;
+  if (prefix > 1) path[prefix++] = '/';
+  else prefix = 1; // "/"
+
+  int ok = 1;
+  long n;
+  while (ok && (n = syscall(SYS_getdents64, fd, dents, sizeof(dents))) > 0) {
+    for (long off = 0; ok && off < n; ) {
+      struct linux_dirent64 *e = (struct linux_dirent64*)(dents + off);
+      off += e->d_reclen;
+
+      const char *name = e->d_name;
+      if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+
+      size_t name_len = strlen(name);
+      if (prefix + name_len >= PATH_MAX) continue;
+      memcpy(path + prefix, name, name_len + 1);
+      size_t len = prefix + name_len;
+
+      unsigned char type = e->d_type;
+      if (type == DT_UNKNOWN) {
+        struct stat sb;
+        if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) continue;
+        type = S_ISDIR(sb.st_mode) ? DT_DIR : DT_REG;
+      }
+
+      if (WalkMatches(o->exclude, o->exclude_count, path, name)) continue;
+
+      if (type == DT_DIR) {
+        if (o->max_depth >= 0 && dir->depth >= o->max_depth) continue;
+        char *sub = ArenaStrndup(ww->arena, path, len);
+        ok = sub && WalkPush(w, sub, len, dir->depth + 1);
+      } else if (!o->include_count || WalkMatches(o->include, o->include_count, path, name)) {
+        ok = WalkEmitFile(ww, path, len);
+      }
+    }
+  }
+
+  close(fd);
+  return ok;
+}
+
+static void* WalkThread(void *arg) {
+  WalkWorker *ww = arg;
+  Walker *w = ww->w;
+
+  while (1) {
+    pthread_mutex_lock(&w->lock);
+    while (!w->queued && w->busy && !w->failed) pthread_cond_wait(&w->wake, &w->lock);
+    if (!w->queued || w->failed) {
+      pthread_mutex_unlock(&w->lock);
+      break;
+    }
+    WalkDir dir = w->queue[--w->queued];
+    pthread_mutex_unlock(&w->lock);
+
+    int ok = WalkReadDir(ww, &dir);
+
+    pthread_mutex_lock(&w->lock);
+    if (!ok) w->failed = 1;
+    if (--w->busy == 0 || !ok) pthread_cond_broadcast(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+  }
+
+  WalkFlush(ww);
+  return NULL;
+}
+
+// Walks every directory in 'roots' (canonical paths that stay valid during
+// the walk) and emits the files below them. Memory for the walk is adopted
+// into 'arena'.
+int WalkDirectories(
+  Arena *arena, const WalkOptions *options,
+  const char **roots, size_t count,
+  WalkEmit emit, void *ctx
+) {
+  if (count == 0) return 1;
+
+  Walker w = { .options = options, .emit = emit, .ctx = ctx, .arena = arena };
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.wake, NULL);
+
+  for (size_t i = 0; i < count; i++) {
+    if (!WalkPush(&w, roots[i], strlen(roots[i]), 0)) return 0;
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = cpus > 0 ? (size_t)cpus * 2 : 4;
+  if (threads > WALK_MAX_THREADS) threads = WALK_MAX_THREADS;
+
+  WalkWorker *workers = ArenaAlloc(arena, threads * sizeof(WalkWorker));
+  if (!workers) return 0;
+
+  pthread_t tids[WALK_MAX_THREADS];
+  size_t started = 0;
+  for (size_t i = 0; i < threads; i++) {
+    workers[i].w = &w;
+    workers[i].arena = ArenaCreate();
+    if (!workers[i].arena) break;
+    if (i > 0) {
+      if (pthread_create(&tids[i], NULL, WalkThread, &workers[i]) != 0) break;
+      started = i;
+    }
+  }
+
+  if (workers[0].arena) WalkThread(&workers[0]);
+  else w.failed = 1;
+
+  for (size_t i = 1; i <= started; i++) pthread_join(tids[i], NULL);
+  for (size_t i = 0; i < threads; i++) {
+    if (workers[i].arena) ArenaAdopt(arena, workers[i].arena);
+  }
+
+  pthread_cond_destroy(&w.wake);
+  pthread_mutex_destroy(&w.lock);
+  return !w.failed;
+}
+
+#endif // DRAG_WALK_H
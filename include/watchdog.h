@@ -0,0 +1,218 @@
+#ifndef DRAG_WATCHDOG_H
+#define DRAG_WATCHDOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "macros.h"
+
+// Deadlines and termination signals as two fds for the backends' poll
+// loops. One timerfd is armed for the earliest pending deadline: the idle
+// timeout before a drop, the drop timeout waiting for the target to
+// finish, and the per-transfer timeout, which backends track on their own
+// transfers. SIGINT, SIGTERM and SIGHUP arrive through a signalfd, so they
+// end the loop like any other event and the normal cleanup runs. Only one
+// watchdog per process owns them; a drag run by the --daemon follows the
+// daemon's, and libdrag leaves them to the host.
+
+#define WATCHDOG_IDLE_DEFAULT 600     // seconds without any pointer input
+#define WATCHDOG_DROP_DEFAULT 30      // seconds from the drop to the target finishing
+#define WATCHDOG_TRANSFER_DEFAULT 30  // seconds a receiver may go without reading
+
+typedef enum {
+  EXIT_REASON_NONE,
+  EXIT_REASON_DROPPED,
+  EXIT_REASON_CANCELLED,
+  EXIT_REASON_IDLE,
+  EXIT_REASON_DROP_TIMEOUT,
+  EXIT_REASON_SIGNAL,
+  EXIT_REASON_ERROR,
+} ExitReason;
+
+typedef struct {
+  int timer_fd;
+  int signal_fd;
+  int owns_signals;       // signal_fd is ours, not the one we follow
+  sigset_t signals;
+  sigset_t saved_mask;    // the thread's mask before ours, put back on close
+  uint64_t idle_ms;       // 0 disables a timeout
+  uint64_t drop_ms;
+  uint64_t transfer_ms;
+  uint64_t idle_deadline;
+  uint64_t drop_deadline;
+  uint64_t armed;         // deadline the timer is set to, 0 when disarmed
+  int signal;             // the signal that ended the loop
+} Watchdog;
+
+// Milliseconds on CLOCK_MONOTONIC, which is what the timerfd runs on.
+static inline uint64_t WatchdogNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void WatchdogSignalSet(Watchdog *w) {
+  sigemptyset(&w->signals);
+  sigaddset(&w->signals, SIGINT);
+  sigaddset(&w->signals, SIGTERM);
+  sigaddset(&w->signals, SIGHUP);
+}
+
+// Timeouts are in seconds; 0 disables one. With 'signals' it blocks the
+// termination signals on the calling thread until WatchdogClose(), so call
+// it before starting the threads and children that should inherit that.
+// Without, as in a library, signal_fd stays -1.
+int WatchdogInit(Watchdog *w, int idle, int drop, int transfer, int signals) {
+  *w = (Watchdog){
+    .timer_fd = -1,
+    .signal_fd = -1,
+    .idle_ms = idle > 0 ? (uint64_t)idle * 1000 : 0,
+    .drop_ms = drop > 0 ? (uint64_t)drop * 1000 : 0,
+    .transfer_ms = transfer > 0 ? (uint64_t)transfer * 1000 : 0,
+  };
+
+  sigemptyset(&w->signals);
+  if (signals) {
+    WatchdogSignalSet(w);
+    pthread_sigmask(SIG_BLOCK, &w->signals, &w->saved_mask);
+    w->owns_signals = 1;
+    w->signal_fd = signalfd(-1, &w->signals, SFD_CLOEXEC | SFD_NONBLOCK);
+  }
+
+  w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if ((signals && w->signal_fd < 0) || w->timer_fd < 0) {
+    LOG("Cannot create watchdog fds\n");
+    return 0;
+  }
+  if (w->idle_ms) w->idle_deadline = WatchdogNow() + w->idle_ms;
+  return 1;
+}
+
+// Ends the loop on the signals of the watchdog owning 'signal_fd', on the
+// same thread, without taking them: they stay pending for it, so the owner
+// ends too. For drags run inside the --daemon.
+void WatchdogFollow(Watchdog *w, int signal_fd) {
+  WatchdogSignalSet(w);
+  w->signal_fd = signal_fd;
+}
+
+void WatchdogClose(Watchdog *w) {
+  if (w->timer_fd >= 0) close(w->timer_fd);
+  if (w->owns_signals) {
+    if (w->signal_fd >= 0) close(w->signal_fd);
+    pthread_sigmask(SIG_SETMASK, &w->saved_mask, NULL);
+    w->owns_signals = 0;
+  }
+  w->timer_fd = w->signal_fd = -1;
+}
+
+// Pointer input: the user is still around, push the idle timeout back.
+static inline void WatchdogActivity(Watchdog *w) {
+  if (w->idle_deadline) w->idle_deadline = WatchdogNow() + w->idle_ms;
+}
+
+// The drop happened. From now on only the target can end the drag.
+void WatchdogDropped(Watchdog *w) {
+  w->idle_deadline = 0;
+  if (w->drop_ms) w->drop_deadline = WatchdogNow() + w->drop_ms;
+}
+
+// Deadline for a transfer that just made progress, or 0 for none.
+static inline uint64_t WatchdogTransferDeadline(const Watchdog *w) {
+  return w->transfer_ms ? WatchdogNow() + w->transfer_ms : 0;
+}
+
+static inline uint64_t WatchdogEarliest(uint64_t a, uint64_t b) {
+  if (!a) return b;
+  if (!b) return a;
+  return a < b ? a : b;
+}
+
+// Arms the timer for the earliest deadline, including 'transfer', the
+// earliest one among the backend's transfers. Only touches the timerfd
+// when that deadline changed.
+void WatchdogArm(Watchdog *w, uint64_t transfer) {
+  uint64_t deadline = WatchdogEarliest(WatchdogEarliest(w->idle_deadline, w->drop_deadline), transfer);
+  if (deadline == w->armed) return;
+  w->armed = deadline;
+
+  struct itimerspec its = {0};
+  if (deadline) {
+    its.it_value.tv_sec = deadline / 1000;
+    its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+  }
+  timerfd_settime(w->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Call when the timerfd is readable. Returns why the drag has to end, or
+// EXIT_REASON_NONE. With 'busy' transfers still moving data, the drop
+// timeout is pushed back: a slow copy is not a stuck target.
+ExitReason WatchdogExpired(Watchdog *w, int busy) {
+  uint64_t expirations;
+  if (read(w->timer_fd, &expirations, sizeof(expirations)) < 0) return EXIT_REASON_NONE;
+  w->armed = 0;
+
+  uint64_t now = WatchdogNow();
+  if (w->idle_deadline && now >= w->idle_deadline) return EXIT_REASON_IDLE;
+  if (w->drop_deadline && now >= w->drop_deadline) {
+    if (!busy) return EXIT_REASON_DROP_TIMEOUT;
+    w->drop_deadline = now + w->drop_ms;
+  }
+  return EXIT_REASON_NONE;
+}
+
+// Call when the signalfd is readable. Returns EXIT_REASON_SIGNAL once a
+// termination signal arrived.
+ExitReason WatchdogSignaled(Watchdog *w) {
+  if (!w->owns_signals) {
+    sigset_t pending;
+    sigpending(&pending);
+    for (int sig = 1; sig < NSIG; sig++) {
+      if (sigismember(&w->signals, sig) && sigismember(&pending, sig)) {
+        w->signal = sig;
+        return EXIT_REASON_SIGNAL;
+      }
+    }
+    return EXIT_REASON_NONE;
+  }
+  struct signalfd_siginfo info;
+  if (read(w->signal_fd, &info, sizeof(info)) != sizeof(info)) return EXIT_REASON_NONE;
+  w->signal = info.ssi_signo;
+  return EXIT_REASON_SIGNAL;
+}
+
+// Says why the process is exiting and returns its exit status: 0 when the
+// drop went through, 124 on a timeout like timeout(1), 128 + the signal
+// number like a shell.
+int WatchdogReport(Watchdog *w, ExitReason reason) {
+  switch (reason) {
+    case EXIT_REASON_NONE:
+    case EXIT_REASON_DROPPED:
+      LOG("Exiting: drop finished\n");
+      return 0;
+    case EXIT_REASON_CANCELLED:
+      LOG("Exiting: drag cancelled\n");
+      return 1;
+    case EXIT_REASON_IDLE:
+      fprintf(stderr, "drag: no input for %llus, giving up\n", (unsigned long long)w->idle_ms / 1000);
+      return 124;
+    case EXIT_REASON_DROP_TIMEOUT:
+      fprintf(stderr, "drag: target did not finish within %llus of the drop\n",
+              (unsigned long long)w->drop_ms / 1000);
+      return 124;
+    case EXIT_REASON_SIGNAL:
+      fprintf(stderr, "drag: %s, cleaning up\n", strsignal(w->signal));
+      return 128 + w->signal;
+    case EXIT_REASON_ERROR:
+      return 1;
+  }
+  return 1;
+}
+
+#endif // DRAG_WATCHDOG_H
@@ -38,6 +38,12 @@ const char* get_compiler_cmd(Target_Arch arch) {
   return "gcc";
 }
 
+// binutils for the target, e.g. "ld" or "objcopy".
+const char* get_tool_cmd(Target_Arch arch, const char *tool) {
+  if (arch == ARCH_ARM64) return nob_temp_sprintf("aarch64-linux-gnu-%s", tool);
+  return tool;
+}
+
 const char* get_deb_arch(Target_Arch arch) {
   return (arch == ARCH_X86_64) ? "amd64" : "arm64";
 }
@@ -62,6 +68,7 @@ bool build_program(Target_Backend backend, Target_Arch arch, bool debug) {
       SRC_FOLDER"drag-X11.c",
       "-I"INCLUDE_FOLDER,
       "-lX11",
+      "-lpthread",
       debug ? "-DDEBUG" : "-DNODEBUG"
     );
   } else {
@@ -75,6 +82,7 @@ bool build_program(Target_Backend backend, Target_Arch arch, bool debug) {
       "-I"INCLUDE_FOLDER,
       "-lwayland-client",
       "-lwayland-cursor",
+      "-lpthread",
       debug ? "-DDEBUG" : "-DNODEBUG"
     );
   }
@@ -84,28 +92,219 @@ bool build_program(Target_Backend backend, Target_Arch arch, bool debug) {
   return success;
 }
 
-bool pack_apt(Target_Backend backend, Target_Arch arch) {
-  const char *bin_name = get_binary_name(backend, arch);
-  const char *pkg_name = "drag";
+// libdrag-<backend>-<arch>.a and .so, see include/drag.h. Everything but
+// the drag_* API is hidden, in the archive too, so the backend's helpers
+// and the protocol tables can't clash with the host's own symbols.
+bool build_library(Target_Backend backend, Target_Arch arch, bool debug) {
+  Nob_Cmd cmd = {0};
+  const char *compiler = get_compiler_cmd(arch);
+  const char *name = nob_temp_sprintf("libdrag-%s-%s", get_backend_name(backend), get_arch_suffix(arch));
+  const char *object = nob_temp_sprintf("%s%s.o", BUILD_FOLDER, name);
+
+  if (!nob_mkdir_if_not_exists(BUILD_FOLDER)) return false;
+
+  nob_log(NOB_INFO, "Building %s...", name);
+
+  nob_cmd_append(
+    &cmd, compiler, "-Wall", "-Wextra", "-O2",
+    "-fPIC", "-fvisibility=hidden", "-DDRAG_LIBRARY",
+    "-nostdlib", "-r",
+    "-o", object,
+    "-I"INCLUDE_FOLDER,
+    debug ? "-DDEBUG" : "-DNODEBUG"
+  );
+  if (backend == TARGET_X11) {
+    nob_cmd_append(&cmd, SRC_FOLDER"drag-X11.c");
+  } else {
+    nob_cmd_append(
+      &cmd,
+      SRC_FOLDER"drag-Wayland.c",
+      SRC_FOLDER"xdg-shell-client-protocol.c",
+      SRC_FOLDER"wlr-layer-shell-unstable-v1-protocol.c",
+      SRC_FOLDER"viewporter-protocol.c"
+    );
+  }
+  if (!nob_cmd_run(&cmd)) goto fail;
+
+  nob_cmd_append(&cmd, get_tool_cmd(arch, "objcopy"), "--localize-hidden", object);
+  if (!nob_cmd_run(&cmd)) goto fail;
+
+  nob_cmd_append(&cmd, get_tool_cmd(arch, "ar"), "rcs", nob_temp_sprintf("%s%s.a", BUILD_FOLDER, name), object);
+  if (!nob_cmd_run(&cmd)) goto fail;
+
+  nob_cmd_append(&cmd, compiler, "-shared", "-o", nob_temp_sprintf("%s%s.so", BUILD_FOLDER, name), object);
+  if (backend == TARGET_X11) {
+    nob_cmd_append(&cmd, "-lX11", "-lpthread");
+  } else {
+    nob_cmd_append(&cmd, "-lwayland-client", "-lwayland-cursor", "-lpthread");
+  }
+  if (!nob_cmd_run(&cmd)) goto fail;
+
+  nob_cmd_free(cmd);
+  return true;
+
+fail:
+  nob_cmd_free(cmd);
+  return false;
+}
+
+// A backend as a module for the drag launcher: drag-<backend>-<arch>.so,
+// exporting only drag_module_main().
+bool build_module(Target_Backend backend, Target_Arch arch, bool debug) {
+  Nob_Cmd cmd = {0};
+  const char *output_name = nob_temp_sprintf("%s.so", get_binary_name(backend, arch));
+
+  nob_log(NOB_INFO, "Building the %s module for %s...", get_backend_name(backend), get_arch_suffix(arch));
+
+  nob_cmd_append(
+    &cmd, get_compiler_cmd(arch), "-Wall", "-Wextra",
+    "-shared", "-fPIC", "-fvisibility=hidden", "-DDRAG_MODULE",
+    "-o", nob_temp_sprintf("%s%s", BUILD_FOLDER, output_name),
+    "-I"INCLUDE_FOLDER,
+    debug ? "-DDEBUG" : "-DNODEBUG"
+  );
+  if (backend == TARGET_X11) {
+    nob_cmd_append(&cmd, SRC_FOLDER"drag-X11.c", "-lX11", "-lpthread");
+  } else {
+    nob_cmd_append(
+      &cmd,
+      SRC_FOLDER"drag-Wayland.c",
+      SRC_FOLDER"xdg-shell-client-protocol.c",
+      SRC_FOLDER"wlr-layer-shell-unstable-v1-protocol.c",
+      SRC_FOLDER"viewporter-protocol.c",
+      "-lwayland-client", "-lwayland-cursor", "-lpthread"
+    );
+  }
+
+  bool success = nob_cmd_run(&cmd);
+  nob_cmd_free(cmd);
+  return success;
+}
+
+// One drag-<arch> for both display servers, which loads the module for
+// the session it runs in; see src/drag.c. It links no display library.
+bool build_launcher(Target_Arch arch, bool debug) {
+  Nob_Cmd cmd = {0};
+
+  if (!nob_mkdir_if_not_exists(BUILD_FOLDER)) return false;
+
+  nob_log(NOB_INFO, "Building the launcher for %s...", get_arch_suffix(arch));
+
+  nob_cmd_append(
+    &cmd, get_compiler_cmd(arch), "-Wall", "-Wextra",
+    "-o", nob_temp_sprintf("%s%s-%s", BUILD_FOLDER, PROG_NAME, get_arch_suffix(arch)),
+    SRC_FOLDER"drag.c",
+    "-I"INCLUDE_FOLDER,
+    nob_temp_sprintf("-DDRAG_ARCH=\"%s\"", get_arch_suffix(arch)),
+    "-ldl",
+    debug ? "-DDEBUG" : "-DNODEBUG"
+  );
+  bool success = nob_cmd_run(&cmd);
+  nob_cmd_free(cmd);
+
+  return success &&
+         build_module(TARGET_X11, arch, debug) &&
+         build_module(TARGET_WAYLAND, arch, debug);
+}
+
+// build/test-uri: every URI kernel this CPU can run against the scalar
+// reference, see tests/uri.c.
+bool run_tests(void) {
+  Nob_Cmd cmd = {0};
+  const char *output = BUILD_FOLDER"test-uri";
+
+  if (!nob_mkdir_if_not_exists(BUILD_FOLDER)) return false;
+
+  nob_cmd_append(
+    &cmd, "gcc", "-Wall", "-Wextra", "-O2",
+    "-o", output,
+    "tests/uri.c",
+    "-I"INCLUDE_FOLDER,
+    "-lpthread"
+  );
+  if (!nob_cmd_run(&cmd)) {
+    nob_cmd_free(cmd);
+    return false;
+  }
+
+  nob_cmd_append(&cmd, output);
+  bool success = nob_cmd_run(&cmd);
+  nob_cmd_free(cmd);
+  return success;
+}
+
+// build/bench-resolve: serial realpath() against the resolver pool, see
+// bench/resolve.c. Runs it with 'dir' as the place for its file tree.
+bool run_bench(const char *dir) {
+  Nob_Cmd cmd = {0};
+  const char *output = BUILD_FOLDER"bench-resolve";
+
+  if (!nob_mkdir_if_not_exists(BUILD_FOLDER)) return false;
+
+  nob_cmd_append(
+    &cmd, "gcc", "-Wall", "-Wextra", "-O2",
+    "-o", output,
+    "bench/resolve.c",
+    "-I"INCLUDE_FOLDER,
+    "-lpthread"
+  );
+  if (!nob_cmd_run(&cmd)) {
+    nob_cmd_free(cmd);
+    return false;
+  }
+
+  nob_cmd_append(&cmd, output);
+  if (dir) nob_cmd_append(&cmd, dir);
+  bool success = nob_cmd_run(&cmd);
+  nob_cmd_free(cmd);
+  return success;
+}
+
+// Packages hold the launcher as /usr/bin/drag and both backend modules in
+// /usr/lib/drag, where it looks for them (DRAG_MODULE_DIR in src/drag.c).
+// A module is only loaded on the display server it is for, so the display
+// libraries are recommended rather than required.
+#define PACK_MODULE_DIR "/usr/lib/" PROG_NAME
+
+const char* get_launcher_name(Target_Arch arch) {
+  return nob_temp_sprintf("%s-%s", PROG_NAME, get_arch_suffix(arch));
+}
+
+const char* get_module_name(Target_Backend backend, Target_Arch arch) {
+  return nob_temp_sprintf("%s.so", get_binary_name(backend, arch));
+}
+
+bool pack_apt(Target_Arch arch) {
+  const char *pkg_name = PROG_NAME;
   const char *deb_arch = get_deb_arch(arch);
-  const char *depends = (backend == TARGET_X11) ? "libx11-6" : "libwayland-client0, libwayland-cursor0";
 
-  const char *dist_dir = nob_temp_sprintf("%sdeb_%s_%s", BUILD_FOLDER, get_backend_name(backend), deb_arch);
+  const char *dist_dir = nob_temp_sprintf("%sdeb_%s", BUILD_FOLDER, deb_arch);
   const char *usr_bin = nob_temp_sprintf("%s/usr/bin", dist_dir);
+  const char *module_dir = nob_temp_sprintf("%s%s", dist_dir, PACK_MODULE_DIR);
   const char *debian_dir = nob_temp_sprintf("%s/DEBIAN", dist_dir);
   const char *control_file = nob_temp_sprintf("%s/control", debian_dir);
 
-  nob_log(NOB_INFO, "Packaging APT: %s (%s)...", get_backend_name(backend), deb_arch);
+  nob_log(NOB_INFO, "Packaging APT: %s...", deb_arch);
 
   if (!nob_mkdir_if_not_exists(dist_dir)) return false;
   if (!nob_mkdir_if_not_exists(nob_temp_sprintf("%s/usr", dist_dir))) return false;
   if (!nob_mkdir_if_not_exists(usr_bin)) return false;
+  if (!nob_mkdir_if_not_exists(nob_temp_sprintf("%s/usr/lib", dist_dir))) return false;
+  if (!nob_mkdir_if_not_exists(module_dir)) return false;
   if (!nob_mkdir_if_not_exists(debian_dir)) return false;
 
   if (!nob_copy_file(
-    nob_temp_sprintf("%s%s", BUILD_FOLDER, bin_name),
+    nob_temp_sprintf("%s%s", BUILD_FOLDER, get_launcher_name(arch)),
     nob_temp_sprintf("%s/%s", usr_bin, pkg_name)
   )) return false;
+  Target_Backend backends[] = {TARGET_X11, TARGET_WAYLAND};
+  for (int b = 0; b < 2; ++b) {
+    const char *module = get_module_name(backends[b], arch);
+    if (!nob_copy_file(
+      nob_temp_sprintf("%s%s", BUILD_FOLDER, module),
+      nob_temp_sprintf("%s/%s", module_dir, module)
+    )) return false;
+  }
 
   Nob_String_Builder sb = {0};
   nob_sb_appendf(&sb, "Package: %s\n", pkg_name);
@@ -113,9 +312,10 @@ bool pack_apt(Target_Backend backend, Target_Arch arch) {
   nob_sb_appendf(&sb, "Section: utils\n");
   nob_sb_appendf(&sb, "Priority: optional\n");
   nob_sb_appendf(&sb, "Architecture: %s\n", deb_arch);
-  nob_sb_appendf(&sb, "Depends: %s\n", depends);
+  nob_sb_appendf(&sb, "Depends: libc6\n");
+  nob_sb_appendf(&sb, "Recommends: libx11-6, libwayland-client0, libwayland-cursor0\n");
   nob_sb_appendf(&sb, "Maintainer: %s\n", PROG_MAINTAINER);
-  nob_sb_appendf(&sb, "Description: %s (%s backend)\n", PROG_DESC, get_backend_name(backend));
+  nob_sb_appendf(&sb, "Description: %s (X11 and Wayland)\n", PROG_DESC);
   if (!nob_write_entire_file(control_file, sb.items, sb.count)) return false;
   nob_sb_free(sb);
 
@@ -125,23 +325,24 @@ bool pack_apt(Target_Backend backend, Target_Arch arch) {
     "dpkg-deb",
     "--build",
     dist_dir,
-    nob_temp_sprintf("%s%s_%s-%s_%s.deb", BUILD_FOLDER, pkg_name, PROG_VERSION, get_backend_name(backend), deb_arch)
+    nob_temp_sprintf("%s%s_%s_%s.deb", BUILD_FOLDER, pkg_name, PROG_VERSION, deb_arch)
   );
   bool ok = nob_cmd_run(&cmd);
   nob_cmd_free(cmd);
   return ok;
 }
 
-bool pack_dnf(Target_Backend backend, Target_Arch arch) {
-  const char *bin_name = get_binary_name(backend, arch);
-  const char *pkg_name = "drag";
+bool pack_dnf(Target_Arch arch) {
+  const char *pkg_name = PROG_NAME;
   const char *rpm_arch = get_rpm_pac_arch(arch);
-  const char *depends = (backend == TARGET_X11) ? "libX11" : "wayland-client, wayland-cursor";
+  const char *launcher = get_launcher_name(arch);
+  const char *x11_module = get_module_name(TARGET_X11, arch);
+  const char *wayland_module = get_module_name(TARGET_WAYLAND, arch);
 
-  const char *rpm_root = nob_temp_sprintf("%srpmbuild_%s_%s", BUILD_FOLDER, get_backend_name(backend), rpm_arch);
+  const char *rpm_root = nob_temp_sprintf("%srpmbuild_%s", BUILD_FOLDER, rpm_arch);
   const char *spec_file = nob_temp_sprintf("%s/%s.spec", rpm_root, pkg_name);
 
-  nob_log(NOB_INFO, "Packaging RPM: %s (%s)...", get_backend_name(backend), rpm_arch);
+  nob_log(NOB_INFO, "Packaging RPM: %s...", rpm_arch);
 
   if (!nob_mkdir_if_not_exists(rpm_root)) return false;
   if (!nob_mkdir_if_not_exists(nob_temp_sprintf("%s/SOURCES", rpm_root))) return false;
@@ -150,10 +351,13 @@ bool pack_dnf(Target_Backend backend, Target_Arch arch) {
   if (!nob_mkdir_if_not_exists(nob_temp_sprintf("%s/RPMS", rpm_root))) return false;
   if (!nob_mkdir_if_not_exists(nob_temp_sprintf("%s/SRPMS", rpm_root))) return false;
 
-  if (!nob_copy_file(
-    nob_temp_sprintf("%s%s", BUILD_FOLDER, bin_name),
-    nob_temp_sprintf("%s/SOURCES/%s", rpm_root, bin_name)
-  )) return false;
+  const char *files[] = { launcher, x11_module, wayland_module };
+  for (int i = 0; i < 3; ++i) {
+    if (!nob_copy_file(
+      nob_temp_sprintf("%s%s", BUILD_FOLDER, files[i]),
+      nob_temp_sprintf("%s/SOURCES/%s", rpm_root, files[i])
+    )) return false;
+  }
 
   Nob_String_Builder sb = {0};
   nob_sb_appendf(&sb, "Name: %s\n", pkg_name);
@@ -161,16 +365,19 @@ bool pack_dnf(Target_Backend backend, Target_Arch arch) {
   nob_sb_appendf(&sb, "Release: 1\n");
   nob_sb_appendf(&sb, "Summary: %s\n", PROG_DESC);
   nob_sb_appendf(&sb, "License: %s\n", PROG_LICENSE);
-  nob_sb_appendf(&sb, "Requires: %s\n", depends);
+  nob_sb_appendf(&sb, "Recommends: libX11, libwayland-client, libwayland-cursor\n");
   nob_sb_appendf(&sb, "BuildArch: %s\n", rpm_arch);
-  nob_sb_appendf(&sb, "\n%%description\n%s (%s backend)\n", PROG_DESC, get_backend_name(backend));
+  nob_sb_appendf(&sb, "\n%%description\n%s (X11 and Wayland)\n", PROG_DESC);
 
   nob_sb_appendf(&sb, "\n%%install\n");
-  nob_sb_appendf(&sb, "mkdir -p %%{buildroot}/usr/bin\n");
-  nob_sb_appendf(&sb, "install -m 755 %%{_topdir}/SOURCES/%s %%{buildroot}/usr/bin/%s\n", bin_name, pkg_name);
+  nob_sb_appendf(&sb, "mkdir -p %%{buildroot}/usr/bin %%{buildroot}%s\n", PACK_MODULE_DIR);
+  nob_sb_appendf(&sb, "install -m 755 %%{_topdir}/SOURCES/%s %%{buildroot}/usr/bin/%s\n", launcher, pkg_name);
+  nob_sb_appendf(&sb, "install -m 755 %%{_topdir}/SOURCES/%s %%{buildroot}%s/%s\n", x11_module, PACK_MODULE_DIR, x11_module);
+  nob_sb_appendf(&sb, "install -m 755 %%{_topdir}/SOURCES/%s %%{buildroot}%s/%s\n", wayland_module, PACK_MODULE_DIR, wayland_module);
 
   nob_sb_appendf(&sb, "\n%%files\n");
   nob_sb_appendf(&sb, "/usr/bin/%s\n", pkg_name);
+  nob_sb_appendf(&sb, "%s\n", PACK_MODULE_DIR);
 
   if (!nob_write_entire_file(spec_file, sb.items, sb.count)) return false;
   nob_sb_free(sb);
@@ -186,37 +393,39 @@ bool pack_dnf(Target_Backend backend, Target_Arch arch) {
 
   bool ok = nob_cmd_run(&cmd);
   nob_cmd_free(cmd);
-  const char *old_rpm = nob_temp_sprintf("%s/RPMS/%s/%s-0.1.0-1.%s.rpm",
-                                         rpm_root, rpm_arch, pkg_name, rpm_arch);
-  const char *new_rpm = nob_temp_sprintf("%s%s_0.1.0-%s_%s.rpm",
-                                         BUILD_FOLDER, pkg_name,
-                                         get_backend_name(backend), rpm_arch);
+  const char *old_rpm = nob_temp_sprintf("%s/RPMS/%s/%s-%s-1.%s.rpm",
+                                         rpm_root, rpm_arch, pkg_name, PROG_VERSION, rpm_arch);
+  const char *new_rpm = nob_temp_sprintf("%s%s_%s_%s.rpm",
+                                         BUILD_FOLDER, pkg_name, PROG_VERSION, rpm_arch);
   nob_rename(old_rpm, new_rpm);
   return ok;
 }
 
-bool pack_pacman(Target_Backend backend, Target_Arch arch) {
-  const char *bin_name = get_binary_name(backend, arch);
-  const char *pkg_name = "drag";
+bool pack_pacman(Target_Arch arch) {
+  const char *pkg_name = PROG_NAME;
   const char *pac_arch = get_rpm_pac_arch(arch);
-  const char *depends = (backend == TARGET_X11) ? "'libx11'" : "'wayland'";
-  const char *arch_root = nob_temp_sprintf("%sarch_%s_%s", BUILD_FOLDER, get_backend_name(backend), pac_arch);
+  const char *x11_module = get_module_name(TARGET_X11, arch);
+  const char *wayland_module = get_module_name(TARGET_WAYLAND, arch);
+  const char *arch_root = nob_temp_sprintf("%sarch_%s", BUILD_FOLDER, pac_arch);
   const char *pkgbuild = nob_temp_sprintf("%s/PKGBUILD", arch_root);
-  nob_log(NOB_INFO, "Packaging Pacman: %s (%s)...", get_backend_name(backend), pac_arch);
+  nob_log(NOB_INFO, "Packaging Pacman: %s...", pac_arch);
   if (!nob_mkdir_if_not_exists(arch_root)) return false;
   Nob_String_Builder sb = {0};
   nob_sb_appendf(&sb, "pkgname=%s\n", pkg_name);
   nob_sb_appendf(&sb, "pkgver=%s\n", PROG_VERSION);
   nob_sb_appendf(&sb, "pkgrel=1\n");
-  nob_sb_appendf(&sb, "pkgdesc=\"%s (%s)\"\n", PROG_DESC, get_backend_name(backend));
+  nob_sb_appendf(&sb, "pkgdesc=\"%s (X11 and Wayland)\"\n", PROG_DESC);
   nob_sb_appendf(&sb, "arch=('%s')\n", pac_arch);
   nob_sb_appendf(&sb, "url=\"https://example.com\"\n");
   nob_sb_appendf(&sb, "license=('%s')\n", PROG_LICENSE);
-  nob_sb_appendf(&sb, "depends=(%s)\n", depends);
+  nob_sb_appendf(&sb, "depends=('glibc')\n");
+  nob_sb_appendf(&sb, "optdepends=('libx11: X11 sessions' 'wayland: Wayland sessions')\n");
   nob_sb_appendf(&sb, "source=()\n");
   nob_sb_appendf(&sb, "package() {\n");
-  nob_sb_appendf(&sb, " mkdir -p \"$pkgdir/usr/bin\"\n");
-  nob_sb_appendf(&sb, " install -m 755 \"$srcdir/../../%s\" \"$pkgdir/usr/bin/%s\"\n", bin_name, pkg_name);
+  nob_sb_appendf(&sb, " mkdir -p \"$pkgdir/usr/bin\" \"$pkgdir%s\"\n", PACK_MODULE_DIR);
+  nob_sb_appendf(&sb, " install -m 755 \"$srcdir/../../%s\" \"$pkgdir/usr/bin/%s\"\n", get_launcher_name(arch), pkg_name);
+  nob_sb_appendf(&sb, " install -m 755 \"$srcdir/../../%s\" \"$pkgdir%s/%s\"\n", x11_module, PACK_MODULE_DIR, x11_module);
+  nob_sb_appendf(&sb, " install -m 755 \"$srcdir/../../%s\" \"$pkgdir%s/%s\"\n", wayland_module, PACK_MODULE_DIR, wayland_module);
   nob_sb_appendf(&sb, "}\n");
   if (!nob_write_entire_file(pkgbuild, sb.items, sb.count)) return false;
   nob_sb_free(sb);
@@ -232,9 +441,8 @@ bool pack_pacman(Target_Backend backend, Target_Arch arch) {
   
   const char *old_pkg = nob_temp_sprintf("%s/%s-%s-1-%s.pkg.tar.gz",
                                          arch_root, pkg_name, PROG_VERSION, pac_arch);
-  const char *new_pkg = nob_temp_sprintf("%s%s_%s-%s_%s.pkg.tar.gz",
-                                         BUILD_FOLDER, pkg_name, PROG_VERSION,
-                                         get_backend_name(backend), pac_arch);
+  const char *new_pkg = nob_temp_sprintf("%s%s_%s_%s.pkg.tar.gz",
+                                         BUILD_FOLDER, pkg_name, PROG_VERSION, pac_arch);
   if (ok) {
     if (!nob_rename(old_pkg, new_pkg)) {
       nob_log(NOB_WARNING, "Failed to rename package from %s to %s", old_pkg, new_pkg);
@@ -248,8 +456,11 @@ bool pack_pacman(Target_Backend backend, Target_Arch arch) {
 void print_usage(const char *program) {
   nob_log(NOB_INFO, "Usage:");
   nob_log(NOB_INFO, "  %s all", program);
-  nob_log(NOB_INFO, "  %s <backend> [arch] [DEBUG]", program);
-  nob_log(NOB_INFO, "  %s dist <manager> <backend> [arch]", program);
+  nob_log(NOB_INFO, "  %s <backend> [arch] [DEBUG] [LIB]", program);
+  nob_log(NOB_INFO, "  %s drag [arch] [DEBUG]", program);
+  nob_log(NOB_INFO, "  %s dist <manager> [arch]", program);
+  nob_log(NOB_INFO, "  %s test", program);
+  nob_log(NOB_INFO, "  %s bench [dir]", program);
 }
 
 Target_Arch parse_arch(const char *str) {
@@ -269,68 +480,64 @@ int main(int argc, char **argv) {
   const char *arg1 = nob_shift(argv, argc);
 
   if (strcmp(arg1, "all") == 0) {
-    Target_Backend backends[] = {TARGET_X11, TARGET_WAYLAND};
     Target_Arch archs[] = {ARCH_X86_64 /*, ARCH_ARM64*/};
 
-    for (int b = 0; b < 2; ++b) {
-      for (int a = 0; a < 2; ++a) {
-        Target_Backend bk = backends[b];
-        Target_Arch ar = archs[a];
-
-        if (!build_program(bk, ar, false)) {
-          return 1;
-        }
-        if (!pack_apt(bk, ar)) return 1;
-        if (!pack_dnf(bk, ar)) return 1;
-        if (!pack_pacman(bk, ar)) return 1;
-      }
+    for (size_t a = 0; a < NOB_ARRAY_LEN(archs); ++a) {
+      Target_Arch ar = archs[a];
+      if (!build_launcher(ar, false)) return 1;
+      if (!pack_apt(ar)) return 1;
+      if (!pack_dnf(ar)) return 1;
+      if (!pack_pacman(ar)) return 1;
     }
     return 0;
   }
 
   if (strcmp(arg1, "dist") == 0) {
-    if (argc < 2) {
+    if (argc < 1) {
       print_usage(program);
       return 1;
     }
     const char *manager = nob_shift(argv, argc);
-    const char *backend_str = nob_shift(argv, argc);
     const char *arch_str = (argc > 0) ? nob_shift(argv, argc) : "x86_64";
-
-    Target_Backend backend;
-    if (strcmp(backend_str, "X11") == 0) backend = TARGET_X11;
-    else if (strcmp(backend_str, "Wayland") == 0) backend = TARGET_WAYLAND;
-    else return 1;
-
     Target_Arch arch = parse_arch(arch_str);
 
-    if (!build_program(backend, arch, false)) return 1;
+    if (!build_launcher(arch, false)) return 1;
 
-    if (strcmp(manager, "apt") == 0) return !pack_apt(backend, arch);
-    if (strcmp(manager, "dnf") == 0) return !pack_dnf(backend, arch);
-    if (strcmp(manager, "pacman") == 0) return !pack_pacman(backend, arch);
+    if (strcmp(manager, "apt") == 0) return !pack_apt(arch);
+    if (strcmp(manager, "dnf") == 0) return !pack_dnf(arch);
+    if (strcmp(manager, "pacman") == 0) return !pack_pacman(arch);
 
     return 1;
   }
 
-  Target_Backend backend;
+  if (strcmp(arg1, "test") == 0) return !run_tests();
+  if (strcmp(arg1, "bench") == 0) {
+    return !run_bench(argc > 0 ? nob_shift(argv, argc) : NULL);
+  }
+
+  bool launcher = strcmp(arg1, PROG_NAME) == 0;
+  Target_Backend backend = TARGET_X11;
   if (strcmp(arg1, "X11") == 0) backend = TARGET_X11;
   else if (strcmp(arg1, "Wayland") == 0) backend = TARGET_WAYLAND;
-  else {
+  else if (!launcher) {
     print_usage(program);
     return 1;
   }
 
   Target_Arch arch = ARCH_X86_64;
   bool debug = false;
+  bool library = false;
 
   while (argc > 0) {
     const char *arg = nob_shift(argv, argc);
     if (strcmp(arg, "arm64") == 0) arch = ARCH_ARM64;
     else if (strcmp(arg, "x86_64") == 0) arch = ARCH_X86_64;
     else if (strcmp(arg, "DEBUG") == 0) debug = true;
+    else if (strcmp(arg, "LIB") == 0) library = true;
   }
 
+  if (launcher) return !build_launcher(arch, debug);
+  if (library) return !build_library(backend, arch, debug);
   if (!build_program(backend, arch, debug)) return 1;
 
   return 0;
@@ -29,12 +29,19 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
 #include <wayland-client.h>
 #include <wayland-cursor.h>
 #include "wlr-layer-shell-unstable-v1-client-protocol.h" 
 #include "viewporter-client-protocol.h" 
 #include "macros.h"
 #include "shared.h"
+#include "core.h"
+#ifdef DRAG_LIBRARY
+#include "library.h"
+#endif
 
 #define BTN_LEFT 272
 
@@ -44,7 +51,23 @@ static int create_shm_file(off_t size) {
   return fd;
 }
 
-
+// A transfer waiting for its receiver to drain the pipe. Everything a
+// receiver asks for is written into its pipe from the main loop, a chunk at
+// a time as it drains it. A slow or stalled receiver only holds up its own
+// transfer, never the pointer or the others. File contents are spliced
+// straight from the file; conversions come from their cache or are
+// serialized as the receiver takes them.
+typedef struct Transfer {
+  struct Transfer *next;
+  int fd;
+  int is_payload;       // a conversion from 'payload', else the file from 'cursor'
+  ContentCursor cursor;
+  PayloadCursor payload;
+  char *chunk;          // for conversions too big to cache, kept when reused
+  int extracting;       // its URIs wait for archive members to be written out
+  uint64_t deadline;    // dropped if the receiver reads nothing by then
+  int done;             // sent, or the receiver went away
+} Transfer;
 
 typedef struct {
   struct wl_display *display;
@@ -74,11 +97,29 @@ typedef struct {
   struct wl_shm_pool *icon_pool;
   int icon_fd;
   FileInfo* file;
-  int running;
+  Core *core;           // the session's, NULL between --daemon drags
   int real_drag_active;
   struct wl_callback *frame_cb;
   int cursor_x, cursor_y;
   int pending_update; 
+  Transfer *transfers;
+  Transfer *free_transfers;  // finished ones, reused for the next request
+  struct wl_data_device *device;      // --receive
+  struct wl_data_offer *offer;        // the drag over the window
+  struct wl_data_offer *uri_offer;    // the last offer that listed text/uri-list
+  Receiver *receiver;
+  int dropped;                        // the drop is being read
+  int drop_fd;                        // the dropped list being read, or -1
+  struct wl_data_offer *typed_offer;  // the offer 'save_types' belong to
+  const char *save_types[SAVE_TYPES_MAX]; // --into: content it offers
+  size_t save_type_count;
+  SaveFile *saves;                    // --into: one per type being saved
+  size_t save_count;
+  size_t saves_open;
+  size_t saved;
+  struct wl_keyboard *keyboard;       // --copy: its focus has the serial set_selection needs
+  int selection_set;
+  int selection_lost;                 // another client took the clipboard
 } State;
 static void SetCrossCursor(State *st, uint32_t serial) {
   struct wl_cursor_image *image = st->cross_cursor->images[0];
@@ -94,16 +135,71 @@ static void SetCrossCursor(State *st, uint32_t serial) {
   wl_surface_damage(st->cursor_surface, 0, 0, image->width, image->height);
   wl_surface_commit(st->cursor_surface);
 }
-static void DestroyState(State *st) {
+static void EndTransfer(State *st, Transfer *t) {
+  ContentClose(&t->cursor);
+  close(t->fd);
+  t->next = st->free_transfers;
+  st->free_transfers = t;
+}
+// A State with nothing open yet.
+static State StateInit(void) {
+  return (State){
+    .shield_fd = -1,
+    .icon_fd = -1,
+    .drop_fd = -1,
+  };
+}
+// Tears down what one drag created. The connection, the globals, the
+// cursor and the shield buffer are kept for the next drag of a --daemon.
+static void EndSession(State *st) {
+  while (st->transfers) {
+    Transfer *t = st->transfers;
+    st->transfers = t->next;
+    EndTransfer(st, t);
+  }
+  if (st->drop_fd >= 0) close(st->drop_fd);
+  for (size_t i = 0; i < st->save_count; i++) SaveFinish(&st->saves[i], 0, -1);
+  if (st->offer) wl_data_offer_destroy(st->offer);
+  if (st->device) wl_data_device_release(st->device);
+  if (st->frame_cb) wl_callback_destroy(st->frame_cb);
   if (st->shield_viewport) wp_viewport_destroy(st->shield_viewport);
-  if (st->viewporter) wp_viewporter_destroy(st->viewporter);
   if (st->layer_surface) { zwlr_layer_surface_v1_destroy(st->layer_surface); }
   if (st->icon_sub) { wl_subsurface_destroy(st->icon_sub); }
   if (st->icon_surface) wl_surface_destroy(st->icon_surface);
   if (st->drag_icon_surface) wl_surface_destroy(st->drag_icon_surface);
-  if (st->cursor_surface) wl_surface_destroy(st->cursor_surface);
   if (st->main_surface) wl_surface_destroy(st->main_surface);
   if (st->source) { wl_data_source_destroy(st->source); }
+  if (st->icon_buffer) wl_buffer_destroy(st->icon_buffer);
+  if (st->icon_pool) wl_shm_pool_destroy(st->icon_pool);
+  if (st->icon_fd >= 0) close(st->icon_fd);
+  if (st->display) wl_display_flush(st->display);
+
+  // Transfers and saves lived in the FileInfo arena, which goes next.
+  State warm = *st;
+  *st = StateInit();
+  st->display = warm.display;
+  st->compositor = warm.compositor;
+  st->subcompositor = warm.subcompositor;
+  st->shm = warm.shm;
+  st->seat = warm.seat;
+  st->pointer = warm.pointer;
+  st->keyboard = warm.keyboard;
+  st->ddm = warm.ddm;
+  st->layer_shell = warm.layer_shell;
+  st->viewporter = warm.viewporter;
+  st->cursor_theme = warm.cursor_theme;
+  st->cursor_surface = warm.cursor_surface;
+  st->cross_cursor = warm.cross_cursor;
+  st->shield_buffer = warm.shield_buffer;
+  st->shield_pool = warm.shield_pool;
+  st->shield_fd = warm.shield_fd;
+  st->shield_w = warm.shield_w;
+  st->shield_h = warm.shield_h;
+}
+static void DestroyState(State *st) {
+  EndSession(st);
+  if (st->viewporter) wp_viewporter_destroy(st->viewporter);
+  if (st->cursor_surface) wl_surface_destroy(st->cursor_surface);
   if (st->cursor_theme) { wl_cursor_theme_destroy(st->cursor_theme); }
   if (st->layer_shell) zwlr_layer_shell_v1_destroy(st->layer_shell);
   if (st->compositor) wl_compositor_destroy(st->compositor);
@@ -111,14 +207,11 @@ static void DestroyState(State *st) {
   if (st->subcompositor) wl_subcompositor_destroy(st->subcompositor);
   if (st->ddm) wl_data_device_manager_destroy(st->ddm);
   if (st->pointer) wl_pointer_release(st->pointer);
+  if (st->keyboard) wl_keyboard_release(st->keyboard);
   if (st->seat) wl_seat_destroy(st->seat);
   if (st->shield_buffer) wl_buffer_destroy(st->shield_buffer);
   if (st->shield_pool) wl_shm_pool_destroy(st->shield_pool);
   if (st->shield_fd >= 0) close(st->shield_fd);
-  if (st->icon_buffer) wl_buffer_destroy(st->icon_buffer);
-  if (st->icon_pool) wl_shm_pool_destroy(st->icon_pool);
-  if (st->icon_fd >= 0) close(st->icon_fd);
-  if (st->file->name) FileInfoFree(st->file);
   if (st->display) wl_display_disconnect(st->display);
 }
 struct wl_buffer* GetOrDrawIcon(State *st, const char *text) {
@@ -136,6 +229,7 @@ struct wl_buffer* GetOrDrawIcon(State *st, const char *text) {
   unsigned int *data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, st->icon_fd, 0);
   if (data == MAP_FAILED) {
     close(st->icon_fd);
+    st->icon_fd = -1;
     return NULL;
   }
 
@@ -150,6 +244,36 @@ struct wl_buffer* GetOrDrawIcon(State *st, const char *text) {
 
   return st->icon_buffer;
 }
+// Replaces the label on both icon surfaces, e.g. once the totals are known.
+void RedrawIcon(State *st, const char *text) {
+  struct wl_buffer *old_buffer = st->icon_buffer;
+  struct wl_shm_pool *old_pool = st->icon_pool;
+  int old_fd = st->icon_fd;
+
+  st->icon_buffer = NULL;
+  struct wl_buffer *buf = GetOrDrawIcon(st, text);
+  if (!buf) {
+    st->icon_buffer = old_buffer;
+    st->icon_pool = old_pool;
+    st->icon_fd = old_fd;
+    return;
+  }
+
+  int w, h;
+  GetTextSize(text, &w, &h);
+  struct wl_surface *surfaces[] = { st->icon_surface, st->drag_icon_surface };
+  for (size_t i = 0; i < 2; i++) {
+    if (!surfaces[i]) continue;
+    wl_surface_attach(surfaces[i], buf, 0, 0);
+    wl_surface_damage(surfaces[i], 0, 0, w, h);
+    wl_surface_commit(surfaces[i]);
+  }
+  if (st->main_surface) wl_surface_commit(st->main_surface);
+
+  if (old_buffer) wl_buffer_destroy(old_buffer);
+  if (old_pool) wl_shm_pool_destroy(old_pool);
+  if (old_fd >= 0) close(old_fd);
+}
 void DrawInvisibleShield(State *st, int w, int h) {
   if (w <= 0 || h <= 0) return;
   if (st->viewporter) {
@@ -183,23 +307,24 @@ void DrawInvisibleShield(State *st, int w, int h) {
     return;
   }
 
-  if (st->shield_buffer && st->shield_w == w && st->shield_h == h) return;
+  // Kept across --daemon drags; only a new output size needs a new one.
+  if (!st->shield_buffer || st->shield_w != w || st->shield_h != h) {
+    if (st->shield_buffer) wl_buffer_destroy(st->shield_buffer);
+    if (st->shield_pool) wl_shm_pool_destroy(st->shield_pool);
+    if (st->shield_fd >= 0) close(st->shield_fd);
 
-  if (st->shield_buffer) wl_buffer_destroy(st->shield_buffer);
-  if (st->shield_pool) wl_shm_pool_destroy(st->shield_pool);
-  if (st->shield_fd >= 0) close(st->shield_fd);
+    st->shield_w = w;
+    st->shield_h = h;
 
-  st->shield_w = w;
-  st->shield_h = h;
+    int stride = w * 4;
+    int size = stride * h;
+    st->shield_fd = create_shm_file(size);  
 
-  int stride = w * 4;
-  int size = stride * h;
-  st->shield_fd = create_shm_file(size);  
-
-  st->shield_pool = wl_shm_create_pool(st->shm, st->shield_fd, size);
-  st->shield_buffer = wl_shm_pool_create_buffer(
-    st->shield_pool, 0, w, h, stride, WL_SHM_FORMAT_ARGB8888
-  );
+    st->shield_pool = wl_shm_create_pool(st->shm, st->shield_fd, size);
+    st->shield_buffer = wl_shm_pool_create_buffer(
+      st->shield_pool, 0, w, h, stride, WL_SHM_FORMAT_ARGB8888
+    );
+  }
 
   wl_surface_attach(st->main_surface, st->shield_buffer, 0, 0);
   wl_surface_damage(st->main_surface, 0, 0, w, h);
@@ -239,28 +364,145 @@ static void schedule_icon_update(State *st) {
   wl_callback_add_listener(st->frame_cb, &frame_listener, st);
 }
 
-
-
-
 static void ds_drop_performed(void *data, struct wl_data_source *s) {
-    (void)data, (void)s;
+  (void)s;
+  WatchdogDropped(&((State*)data)->core->watchdog);
 }
 static void ds_target(void *data, struct wl_data_source *s, const char *mime_type) {
   (void)data, (void)s, (void)mime_type;
 }
+// Moves 't' on until it is done or would block, with the same results as
+// ContentStep().
+static int TransferStep(State *st, Transfer *t) {
+  if (t->is_payload) return PayloadStep(st->file, &t->payload, t->fd);
+  return ContentStep(&t->cursor, t->fd);
+}
+
+static off_t TransferSent(Transfer *t) {
+  return t->is_payload ? (off_t)t->payload.offset : t->cursor.offset;
+}
+
+// Takes ownership of 'fd'. Returns NULL, with 'fd' closed, when out of memory.
+static Transfer* NewTransfer(State *st, int fd) {
+  Transfer *t = st->free_transfers;
+  if (t) st->free_transfers = t->next;
+  else if ((t = ArenaAlloc(st->file->arena, sizeof(Transfer)))) t->chunk = NULL;
+  if (!t) {
+    close(fd);
+    return NULL;
+  }
+  t->fd = fd;
+  t->is_payload = 0;
+  t->extracting = 0;
+  t->cursor.in = -1;
+  t->done = 0;
+  t->deadline = WatchdogTransferDeadline(&st->core->watchdog);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return t;
+}
+
+// Sends what it can right away and queues the rest for the main loop.
+static void QueueTransfer(State *st, Transfer *t) {
+  if (TransferStep(st, t) != 0) {
+    EndTransfer(st, t);
+    return;
+  }
+  t->next = st->transfers;
+  st->transfers = t;
+}
+
+// Takes ownership of 'in'.
+static void StartContentTransfer(State *st, int fd, int in, off_t offset, off_t size) {
+  Transfer *t = NewTransfer(st, fd);
+  if (!t) {
+    if (in >= 0) close(in);
+    return;
+  }
+  if (!ContentOpen(&t->cursor, in, offset, size)) {
+    EndTransfer(st, t);
+    return;
+  }
+  QueueTransfer(st, t);
+}
+
+static int OpenPayloadTransfer(State *st, Transfer *t) {
+  if (!PayloadOpen(st->file, t->payload.provider, &t->payload)) return 0;
+  if (!t->payload.cached) {
+    if (!t->chunk) t->chunk = ArenaAlloc(st->file->arena, URI_CHUNK_SIZE);
+    if (!t->chunk) return 0;
+    t->payload.chunk = t->chunk;
+  }
+  return 1;
+}
+
+// Starts, or on failure ends, the transfers that waited for archive
+// members once MaterializeStep() returned 'ready'.
+static void StartExtracted(State *st, int ready) {
+  for (Transfer *t = st->transfers; t; t = t->next) {
+    if (!t->extracting) continue;
+    t->extracting = 0;
+    t->deadline = WatchdogTransferDeadline(&st->core->watchdog);
+    if (ready < 0 || !OpenPayloadTransfer(st, t) || TransferStep(st, t) != 0) t->done = 1;
+  }
+}
+
+// A conversion naming archive members waits, without a deadline, until
+// they are written out; ExtractReady() starts it then.
+static void StartPayloadTransfer(State *st, int fd, size_t provider) {
+  Transfer *t = NewTransfer(st, fd);
+  if (!t) return;
+  t->is_payload = 1;
+  t->payload.provider = provider;
+  int ready = MaterializeStep(st->file);
+  if (ready == 0) {
+    t->extracting = 1;
+    t->deadline = 0;
+    t->next = st->transfers;
+    st->transfers = t;
+    return;
+  }
+  StartExtracted(st, ready);
+  if (ready < 0 || !OpenPayloadTransfer(st, t)) {
+    EndTransfer(st, t);
+    return;
+  }
+  QueueTransfer(st, t);
+}
 static void ds_send(void *d, struct wl_data_source *s, const char *m, int32_t fd) {
   (void)s;
   State *st = d;
-  if (strcmp(m, "text/uri-list") == 0) { write(fd, st->file->uri, strlen(st->file->uri));}
-  close(fd);
+  int provider = FindProvider(st->file, m);
+  if (provider < 0) {
+    close(fd);
+    return;
+  }
+  if (!ProviderIsContent(provider)) {
+    StartPayloadTransfer(st, fd, provider);
+    return;
+  }
+  if (ContentIsStream(st->file)) {
+    // Decompressed by a child process straight into the receiver's pipe.
+    SpawnContent(st->file, fd, 1);
+    close(fd);
+    return;
+  }
+  off_t offset, size;
+  int in = OpenContent(st->file, &offset, &size);
+  StartContentTransfer(st, fd, in, offset, size);
 }
 static void ds_cancelled(void *d, struct wl_data_source *s) {
   (void)s;
-  ((State*)d)->running = 0; 
+  State *st = d;
+  // That is how --copy ends, once the pastes in flight are done.
+  if (st->file->options.copy) {
+    st->selection_lost = 1;
+    return;
+  }
+  CoreStop(st->core, EXIT_REASON_CANCELLED);
 }
 static void ds_finished(void *d, struct wl_data_source *s) {
   (void)s;
-  ((State*)d)->running = 0;
+  CoreStop(((State*)d)->core, EXIT_REASON_DROPPED);
 }
 static void ds_action(void *d, struct wl_data_source *s, uint32_t a) {
   (void)d, (void)s, (void)a; 
@@ -274,10 +516,6 @@ static const struct wl_data_source_listener ds_listener = {
   .action = ds_action
 };
 
-
-
-
-
 static void pointer_enter(
   void *d,
   struct wl_pointer *p,
@@ -288,6 +526,7 @@ static void pointer_enter(
 ) {
   (void)p, (void)s, (void)surf;
   State *st = d;
+  if (st->core) WatchdogActivity(&st->core->watchdog);
   if (!st->real_drag_active && st->icon_sub) {
     wl_subsurface_set_position(
       st->icon_sub,
@@ -312,6 +551,7 @@ static void pointer_motion(
 ) {
   State *st = data;
   (void)p, (void)time;
+  if (st->core) WatchdogActivity(&st->core->watchdog);
   if (!st->real_drag_active && st->icon_sub) {
     wl_subsurface_set_position(
       st->icon_sub,
@@ -331,6 +571,8 @@ static void pointer_button(
 ) {
   State *st = data;
   (void)p, (void)time;
+  if (st->core) WatchdogActivity(&st->core->watchdog);
+  if (!st->file || st->file->options.receive || st->file->options.copy) return;
   if (
     state_w == WL_POINTER_BUTTON_STATE_PRESSED && 
     button == BTN_LEFT && 
@@ -339,17 +581,20 @@ static void pointer_button(
     st->real_drag_active = 2;
     SetCrossCursor(st, serial);
 
-    struct wl_data_device *device = wl_data_device_manager_get_data_device(st->ddm, st->seat);
+    st->device = wl_data_device_manager_get_data_device(st->ddm, st->seat);
     st->source = wl_data_device_manager_create_data_source(st->ddm);
     wl_data_source_add_listener(st->source, &ds_listener, st);
-    wl_data_source_offer(st->source, "text/uri-list");
+    for (size_t i = 0; i < PROVIDER_COUNT; i++) {
+      const char *type = ProviderType(st->file, i);
+      if (type) wl_data_source_offer(st->source, type);
+    }
     wl_data_source_set_actions(
       st->source,
       WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY | WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE
     );
 
     wl_data_device_start_drag(
-      device,
+      st->device,
       st->source,
       st->main_surface,
       st->drag_icon_surface,
@@ -384,28 +629,257 @@ static const struct wl_pointer_listener pointer_listener = {
   .axis = pointer_axis
 };
 
-
-
-
 static void seat_name(void *data, struct wl_seat *seat, const char *name) {
   (void)data; (void)seat; (void)name;
 }
+static void keyboard_keymap(void *data, struct wl_keyboard *k, uint32_t format, int32_t fd, uint32_t size) {
+  (void)data, (void)k, (void)format, (void)size;
+  close(fd);
+}
+// --copy. Selections can only be set with the serial of an input event
+// the client got, so the label asks for the keyboard focus. The selection
+// outlives the surface; only the data source has to stay.
+static void keyboard_enter(
+  void *data,
+  struct wl_keyboard *k,
+  uint32_t serial,
+  struct wl_surface *surf,
+  struct wl_array *keys
+) {
+  (void)k, (void)surf, (void)keys;
+  State *st = data;
+  if (!st->file || !st->file->options.copy || st->selection_set || !st->source) return;
+  wl_data_device_set_selection(st->device, st->source, serial);
+  st->selection_set = 1;
+  LOG("Serving the clipboard.\n");
+
+  zwlr_layer_surface_v1_destroy(st->layer_surface);
+  st->layer_surface = NULL;
+  wl_surface_destroy(st->main_surface);
+  st->main_surface = NULL;
+}
+static void keyboard_leave(void *data, struct wl_keyboard *k, uint32_t serial, struct wl_surface *surf) {
+  (void)data, (void)k, (void)serial, (void)surf;
+}
+static void keyboard_key(void *data, struct wl_keyboard *k, uint32_t serial, uint32_t time, uint32_t key, uint32_t state) {
+  (void)data, (void)k, (void)serial, (void)time, (void)key, (void)state;
+}
+static void keyboard_modifiers(
+  void *data,
+  struct wl_keyboard *k,
+  uint32_t serial,
+  uint32_t depressed,
+  uint32_t latched,
+  uint32_t locked,
+  uint32_t group
+) {(void)data, (void)k, (void)serial, (void)depressed, (void)latched, (void)locked, (void)group;}
+static void keyboard_repeat_info(void *data, struct wl_keyboard *k, int32_t rate, int32_t delay) {
+  (void)data, (void)k, (void)rate, (void)delay;
+}
+static const struct wl_keyboard_listener keyboard_listener = {
+  .keymap = keyboard_keymap,
+  .enter = keyboard_enter,
+  .leave = keyboard_leave,
+  .key = keyboard_key,
+  .modifiers = keyboard_modifiers,
+  .repeat_info = keyboard_repeat_info
+};
+
 static void seat_caps(void *data, struct wl_seat *seat, uint32_t caps) {
   State *st = data;
   if ((caps & WL_SEAT_CAPABILITY_POINTER) && !st->pointer) {
     st->pointer = wl_seat_get_pointer(seat);
     wl_pointer_add_listener(st->pointer, &pointer_listener, st);
   }
+  // A daemon can't tell yet whether a --copy is coming.
+  int copy = !st->file || st->file->options.copy;
+  if ((caps & WL_SEAT_CAPABILITY_KEYBOARD) && !st->keyboard && copy) {
+    st->keyboard = wl_seat_get_keyboard(seat);
+    wl_keyboard_add_listener(st->keyboard, &keyboard_listener, st);
+  }
 }
 static const struct wl_seat_listener seat_listener = {
   .capabilities = seat_caps,
   .name = seat_name 
 };
 
+// --receive. An offer lists its types right after it is announced, before
+// it enters the window or becomes the selection.
+static void offer_offer(void *data, struct wl_data_offer *offer, const char *mime_type) {
+  State *st = data;
+  if (!strcmp(mime_type, "text/uri-list")) st->uri_offer = offer;
+  if (offer != st->typed_offer || !st->file->options.into || !SaveWantsType(mime_type)) return;
+
+  // Sources list the same data in several formats, best first; only the
+  // first of each kind (image/, audio/, ...) is saved.
+  size_t kind = strchr(mime_type, '/') - mime_type + 1;
+  for (size_t i = 0; i < st->save_type_count; i++) {
+    if (!strncmp(st->save_types[i], mime_type, kind)) return;
+  }
+  if (st->save_type_count == SAVE_TYPES_MAX) return;
+  const char *type = ArenaStrndup(st->file->arena, mime_type, strlen(mime_type));
+  if (type) st->save_types[st->save_type_count++] = type;
+}
+static void offer_source_actions(void *data, struct wl_data_offer *offer, uint32_t actions) {
+  (void)data, (void)offer, (void)actions;
+}
+static void offer_action(void *data, struct wl_data_offer *offer, uint32_t action) {
+  (void)data, (void)offer, (void)action;
+}
+static const struct wl_data_offer_listener offer_listener = {
+  .offer = offer_offer,
+  .source_actions = offer_source_actions,
+  .action = offer_action
+};
+static void DestroyOffer(State *st, struct wl_data_offer *offer) {
+  if (st->uri_offer == offer) st->uri_offer = NULL;
+  if (st->typed_offer == offer) st->typed_offer = NULL;
+  if (st->offer == offer) st->offer = NULL;
+  wl_data_offer_destroy(offer);
+}
+static void FinishDrop(State *st, int ok) {
+  if (ok) wl_data_offer_finish(st->offer);
+  DestroyOffer(st, st->offer);
+  CoreStop(st->core, ok ? EXIT_REASON_DROPPED : EXIT_REASON_ERROR);
+}
+// --into: fetches every content type picked from the offer into a file of
+// its own, all at once. Each source pipe is spliced into its file as it
+// fills, see ReadSave().
+static void StartSaves(State *st) {
+  if (!st->saves) st->saves = ArenaAlloc(st->file->arena, SAVE_TYPES_MAX * sizeof(SaveFile));
+  for (size_t i = 0; st->saves && i < st->save_type_count; i++) {
+    SaveFile *s = &st->saves[st->save_count];
+    char name[32];
+    SaveName(name, sizeof(name), st->save_types[i]);
+    if (!SaveCreate(s, st->file->options.into, name)) continue;
+
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) {
+      SaveFinish(s, 0, -1);
+      continue;
+    }
+    fcntl(p[0], F_SETPIPE_SZ, SAVE_PIPE_SIZE);
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    wl_data_offer_receive(st->offer, st->save_types[i], p[1]);
+    close(p[1]);
+    s->in = p[0];
+    st->save_count++;
+  }
+  st->saves_open = st->save_count;
+  if (!st->saves_open) FinishDrop(st, 0);
+}
+static void dd_data_offer(void *data, struct wl_data_device *dd, struct wl_data_offer *offer) {
+  (void)dd;
+  State *st = data;
+  if (!st->dropped) {
+    st->typed_offer = offer;
+    st->save_type_count = 0;
+  }
+  wl_data_offer_add_listener(offer, &offer_listener, data);
+}
+static void dd_enter(
+  void *data,
+  struct wl_data_device *dd,
+  uint32_t serial,
+  struct wl_surface *surf,
+  wl_fixed_t x,
+  wl_fixed_t y,
+  struct wl_data_offer *offer
+) {
+  (void)dd, (void)surf, (void)x, (void)y;
+  State *st = data;
+  WatchdogActivity(&st->core->watchdog);
+  if (!offer || st->dropped) return;
+
+  st->offer = offer;
+  const char *type = offer == st->uri_offer ? "text/uri-list" : NULL;
+  if (!type && offer == st->typed_offer && st->save_type_count) type = st->save_types[0];
+  uint32_t copy = type ? WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY : 0;
+  wl_data_offer_accept(offer, serial, type);
+  wl_data_offer_set_actions(offer, copy, copy);
+}
+static void dd_leave(void *data, struct wl_data_device *dd) {
+  (void)dd;
+  State *st = data;
+  // A dropped offer lives on until its data has been read.
+  if (st->offer && !st->dropped) DestroyOffer(st, st->offer);
+}
+static void dd_motion(void *data, struct wl_data_device *dd, uint32_t time, wl_fixed_t x, wl_fixed_t y) {
+  (void)dd, (void)time, (void)x, (void)y;
+  WatchdogActivity(&((State*)data)->core->watchdog);
+}
+static void dd_drop(void *data, struct wl_data_device *dd) {
+  (void)dd;
+  State *st = data;
+  if (!st->offer || st->dropped) return;
+  int content = st->offer == st->typed_offer && st->save_type_count;
+  if (st->offer != st->uri_offer && !content) return;
+
+  st->dropped = 1;
+  WatchdogDropped(&st->core->watchdog);
+  if (st->offer != st->uri_offer) {
+    StartSaves(st);
+    return;
+  }
 
+  // The write end goes to the source as is, so only ours is non-blocking.
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) < 0) {
+    FinishDrop(st, 0);
+    return;
+  }
+  wl_data_offer_receive(st->offer, "text/uri-list", p[1]);
+  close(p[1]);
+  fcntl(p[0], F_SETFL, O_NONBLOCK);
+  st->drop_fd = p[0];
+}
+static void dd_selection(void *data, struct wl_data_device *dd, struct wl_data_offer *offer) {
+  (void)dd;
+  if (offer) DestroyOffer(data, offer);
+}
+static const struct wl_data_device_listener dd_listener = {
+  .data_offer = dd_data_offer,
+  .enter = dd_enter,
+  .leave = dd_leave,
+  .motion = dd_motion,
+  .drop = dd_drop,
+  .selection = dd_selection
+};
 
+// Decodes what the source wrote since the last call, a pipe buffer at a
+// time so the loop stays responsive. At EOF the drop is finished and the
+// loop ends. Each chunk restarts the drop timeout.
+static void ReadDrop(State *st) {
+  char buf[RECEIVE_OUT_SIZE];
+  ssize_t n = read(st->drop_fd, buf, sizeof(buf));
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+  if (n > 0 && ReceiverFeed(st->receiver, buf, n)) {
+    WatchdogDropped(&st->core->watchdog);
+    return;
+  }
 
-
+  int ok = n == 0 && ReceiverFinish(st->receiver);
+  close(st->drop_fd);
+  st->drop_fd = -1;
+  // No local file in the list, like a link from a browser: save what it
+  // points to from the content the source offers instead.
+  if (ok && !st->receiver->count && st->offer == st->typed_offer && st->save_type_count) {
+    StartSaves(st);
+    return;
+  }
+  FinishDrop(st, ok);
+}
+// Splices what a source wrote so far into its file. An empty result
+// counts as a failure.
+static void ReadSave(State *st, SaveFile *s) {
+  int more = SaveSplice(s);
+  if (more > 0) {
+    WatchdogDropped(&st->core->watchdog);
+    return;
+  }
+  if (SaveFinish(s, more == 0 && s->size > 0, st->file->options.output)) st->saved++;
+  if (--st->saves_open == 0) FinishDrop(st, st->saved > 0);
+}
 
 static void layer_surf_configure(
   void *data,
@@ -418,6 +892,14 @@ static void layer_surf_configure(
   zwlr_layer_surface_v1_ack_configure(surface, serial);
   if (w == 0 || h == 0) return;
 
+  // --receive and --copy show just the label.
+  if (!st->icon_sub) {
+    wl_surface_attach(st->main_surface, st->icon_buffer, 0, 0);
+    wl_surface_damage(st->main_surface, 0, 0, w, h);
+    wl_surface_commit(st->main_surface);
+    return;
+  }
+
   if (!st->real_drag_active && st->main_surface) {
     DrawInvisibleShield(st, w, h);
     struct wl_region *region = wl_compositor_create_region(st->compositor);
@@ -429,18 +911,13 @@ static void layer_surf_configure(
 static void layer_surf_closed(void *data, struct zwlr_layer_surface_v1 *surface) {
   State *st = data;
   (void)surface;
-  st->running = 0;
+  CoreStop(st->core, EXIT_REASON_CANCELLED);
 }
 static const struct zwlr_layer_surface_v1_listener layer_surf_listener = {
   .configure = layer_surf_configure,
   .closed = layer_surf_closed
 };
 
-
-
-
-
-
 static void handle_global(
   void *data,
   struct wl_registry *r,
@@ -473,70 +950,288 @@ static const struct wl_registry_listener reg_listener = {
   .global_remove = NULL
 };
 
+// A full-output overlay that follows the pointer with the label until the
+// button goes down and the real drag starts.
+static void ShowOverlay(State *st, struct wl_buffer *icon_buf) {
+  st->drag_icon_surface = wl_compositor_create_surface(st->compositor);
+  wl_surface_attach(st->drag_icon_surface, icon_buf, 0, 0);
+  wl_surface_commit(st->drag_icon_surface);
 
+  st->main_surface = wl_compositor_create_surface(st->compositor);
+  st->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+      st->layer_shell, st->main_surface, NULL, 
+      ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY, "drag-overlay"
+  );
 
+  zwlr_layer_surface_v1_set_size(st->layer_surface, 0, 0);
+  zwlr_layer_surface_v1_set_anchor(st->layer_surface, 15);
+  zwlr_layer_surface_v1_set_exclusive_zone(st->layer_surface, -1);
+  zwlr_layer_surface_v1_set_keyboard_interactivity(st->layer_surface, 0);
+  zwlr_layer_surface_v1_add_listener(st->layer_surface, &layer_surf_listener, st);
 
-int main(int argc, char **argv) {
-  State state = {
-    .running = 1,
-    .shield_fd = -1,
-    .icon_fd = -1
-  };
+  st->icon_surface = wl_compositor_create_surface(st->compositor);
+  st->icon_sub = wl_subcompositor_get_subsurface(
+    st->subcompositor, st->icon_surface, st->main_surface
+  );
+  wl_subsurface_set_position(st->icon_sub, -200, -200);
+
+  wl_subsurface_set_desync(st->icon_sub);
+
+  wl_surface_attach(st->icon_surface, icon_buf, 0, 0); 
+  wl_surface_commit(st->icon_surface);
+
+  wl_surface_commit(st->main_surface);
+}
+// --copy: just the label, centred on the output, until it gets the
+// keyboard focus and the selection is set; see keyboard_enter().
+static void ShowCopySource(State *st) {
+  int w, h;
+  GetTextSize(st->file->name, &w, &h);
+
+  st->main_surface = wl_compositor_create_surface(st->compositor);
+  st->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+      st->layer_shell, st->main_surface, NULL,
+      ZWLR_LAYER_SHELL_V1_LAYER_TOP, "drag-copy"
+  );
+  zwlr_layer_surface_v1_set_size(st->layer_surface, w, h);
+  zwlr_layer_surface_v1_set_anchor(st->layer_surface, 0);
+  zwlr_layer_surface_v1_set_keyboard_interactivity(st->layer_surface, 1);
+  zwlr_layer_surface_v1_add_listener(st->layer_surface, &layer_surf_listener, st);
+
+  st->device = wl_data_device_manager_get_data_device(st->ddm, st->seat);
+  st->source = wl_data_device_manager_create_data_source(st->ddm);
+  wl_data_source_add_listener(st->source, &ds_listener, st);
+  for (size_t i = 0; i < PROVIDER_COUNT; i++) {
+    const char *type = ProviderType(st->file, i);
+    if (type) wl_data_source_offer(st->source, type);
+  }
+
+  wl_surface_commit(st->main_surface);
+}
+// --receive: just the label, centred on the output, listening for drops.
+// The label is attached once the surface is configured.
+static void ShowDropTarget(State *st) {
+  int w, h;
+  GetTextSize(st->file->name, &w, &h);
 
-  defer { DestroyState(&state); };
+  st->main_surface = wl_compositor_create_surface(st->compositor);
+  st->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+      st->layer_shell, st->main_surface, NULL,
+      ZWLR_LAYER_SHELL_V1_LAYER_TOP, "drag-receive"
+  );
+  zwlr_layer_surface_v1_set_size(st->layer_surface, w, h);
+  zwlr_layer_surface_v1_set_anchor(st->layer_surface, 0);
+  zwlr_layer_surface_v1_set_keyboard_interactivity(st->layer_surface, 0);
+  zwlr_layer_surface_v1_add_listener(st->layer_surface, &layer_surf_listener, st);
 
-  state.file = CommandLineArguments(argc, argv);
-  if(!state.file) return 1;
+  st->device = wl_data_device_manager_get_data_device(st->ddm, st->seat);
+  wl_data_device_add_listener(st->device, &dd_listener, st);
+
+  wl_surface_commit(st->main_surface);
+}
 
-  state.display = wl_display_connect(NULL);
-  if (!state.display) return 1;
+// The connection and everything a drag needs from it, set up once.
+static int ConnectDisplay(State *st) {
+  st->display = wl_display_connect(NULL);
+  if (!st->display) return 0;
 
-  struct wl_registry *reg = wl_display_get_registry(state.display);
-  wl_registry_add_listener(reg, &reg_listener, &state);
-  wl_display_roundtrip(state.display);
+  struct wl_registry *reg = wl_display_get_registry(st->display);
+  wl_registry_add_listener(reg, &reg_listener, st);
+  wl_display_roundtrip(st->display);
 
-  if (!state.compositor || !state.layer_shell || !state.ddm || !state.seat) {
+  if (!st->compositor || !st->layer_shell || !st->ddm || !st->seat) {
     LOG("Missing required Wayland globals.\n");
-    return 1;
+    return 0;
   }
   
-  state.cursor_theme = wl_cursor_theme_load(NULL, 24, state.shm);
-  state.cross_cursor = wl_cursor_theme_get_cursor(state.cursor_theme, "crosshair");
-  state.cursor_surface = wl_compositor_create_surface(state.compositor);
+  st->cursor_theme = wl_cursor_theme_load(NULL, 24, st->shm);
+  st->cross_cursor = wl_cursor_theme_get_cursor(st->cursor_theme, "crosshair");
+  st->cursor_surface = wl_compositor_create_surface(st->compositor);
+  return 1;
+}
 
-  struct wl_buffer *icon_buf = GetOrDrawIcon(&state, state.file->name);
-  if (!icon_buf) return 1;
+static void* WaylandConnect(void) {
+  State *st = malloc(sizeof(State));
+  if (!st) return NULL;
+  *st = StateInit();
+  if (!ConnectDisplay(st)) {
+    DestroyState(st);
+    free(st);
+    return NULL;
+  }
+  return st;
+}
 
-  state.drag_icon_surface = wl_compositor_create_surface(state.compositor);
-  wl_surface_attach(state.drag_icon_surface, icon_buf, 0, 0);
-  wl_surface_commit(state.drag_icon_surface);
+static void WaylandDisconnect(void *context) {
+  DestroyState(context);
+  free(context);
+}
 
-  state.main_surface = wl_compositor_create_surface(state.compositor);
-  state.layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-      state.layer_shell, state.main_surface, NULL, 
-      ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY, "drag-overlay"
-  );
+static int WaylandGetFd(void *context) {
+  return wl_display_get_fd(((State*)context)->display);
+}
 
-  zwlr_layer_surface_v1_set_size(state.layer_surface, 0, 0);
-  zwlr_layer_surface_v1_set_anchor(state.layer_surface, 15);
-  zwlr_layer_surface_v1_set_exclusive_zone(state.layer_surface, -1);
-  zwlr_layer_surface_v1_set_keyboard_interactivity(state.layer_surface, 0);
-  zwlr_layer_surface_v1_add_listener(state.layer_surface, &layer_surf_listener, &state);
+// Between --daemon drags only the seat and the globals talk to us.
+static int WaylandIdle(void *context) {
+  State *st = context;
+  if (wl_display_prepare_read(st->display) == 0 && wl_display_read_events(st->display) < 0) return 0;
+  return wl_display_dispatch_pending(st->display) >= 0 && wl_display_flush(st->display) >= 0;
+}
 
-  state.icon_surface = wl_compositor_create_surface(state.compositor);
-  state.icon_sub = wl_subcompositor_get_subsurface(
-    state.subcompositor, state.icon_surface, state.main_surface
-  );
-  wl_subsurface_set_position(state.icon_sub, -200, -200);
+// One drag, drop target or clipboard run for core->file; WaylandEndDrag()
+// cleans up after it.
+static int WaylandStartDrag(Core *core) {
+  State *st = core->context;
+  FileInfo *file = core->file;
+  st->file = file;
+  st->core = core;
+
+  // The layer surface covers the whole output; never leave it behind.
+  struct wl_buffer *icon_buf = GetOrDrawIcon(st, file->name);
+  if (!icon_buf) return 0;
+
+  const Options *o = &file->options;
+  if (o->receive) {
+    st->receiver = ArenaAlloc(file->arena, sizeof(Receiver));
+    if (!st->receiver) return 0;
+    int out = ReceiveOpen(o);
+    if (out < 0) return 0;
+    ReceiverInit(st->receiver, out);
+    ShowDropTarget(st);
+  } else if (o->copy) {
+    // Every paste is then answered from the cache.
+    PreparePayloads(file);
+    ShowCopySource(st);
+  } else {
+    ShowOverlay(st, icon_buf);
+  }
+  return 1;
+}
+
+static void WaylandCreateIcon(Core *core, const char *text) {
+  RedrawIcon(core->context, text);
+}
+
+// A transfer moves on as its receiver drains the pipe; finished ones are
+// collected in the next WaylandPrepare().
+static void TransferReady(Core *core, void *ctx, short revents) {
+  (void)revents;
+  Transfer *t = ctx;
+  off_t sent = TransferSent(t);
+  int step = TransferStep(core->context, t);
+  if (step < 0) LOG("Transfer failed after %lld bytes, closing it\n", (long long)TransferSent(t));
+  if (step != 0) t->done = 1;
+  if (TransferSent(t) != sent) t->deadline = WatchdogTransferDeadline(&core->watchdog);
+}
 
-  wl_subsurface_set_desync(state.icon_sub);
+// An archive member was written out. Once none is left, the transfers
+// waiting for them start, or end if extracting failed.
+static void ExtractReady(Core *core, void *ctx, short revents) {
+  (void)ctx, (void)revents;
+  State *st = core->context;
+  int ready = MaterializeStep(st->file);
+  if (ready != 0) StartExtracted(st, ready);
+}
 
-  wl_surface_attach(state.icon_surface, icon_buf, 0, 0); 
-  wl_surface_commit(state.icon_surface);
+static void DropReady(Core *core, void *ctx, short revents) {
+  (void)ctx, (void)revents;
+  ReadDrop(core->context);
+}
+
+static void SaveReady(Core *core, void *ctx, short revents) {
+  (void)revents;
+  SaveFile *save = ctx;
+  if (save->in >= 0) ReadSave(core->context, save);
+}
 
-  wl_surface_commit(state.main_surface);
+static int WaylandPrepare(Core *core) {
+  State *st = core->context;
+  uint64_t now = WatchdogNow();
+  Transfer **link = &st->transfers;
+  int extracting = 0;
+  while (*link) {
+    Transfer *t = *link;
+    if (!t->done && t->deadline && t->deadline <= now) {
+      LOG("Receiver stalled at %lld bytes, dropping it\n", (long long)TransferSent(t));
+      t->done = 1;
+    }
+    if (t->done) {
+      *link = t->next;
+      EndTransfer(st, t);
+      continue;
+    }
+    if (t->extracting) {
+      extracting = 1;
+      link = &t->next;
+      continue;
+    }
+    if (!CoreWatch(core, t->fd, POLLOUT, TransferReady, t)) return 0;
+    core->deadline = WatchdogEarliest(core->deadline, t->deadline);
+    link = &t->next;
+  }
+  if (extracting && !CoreWatch(core, st->file->extract_fd, POLLIN, ExtractReady, NULL)) return 0;
+  if (st->selection_lost && !st->transfers) CoreStop(core, EXIT_REASON_DROPPED);
 
-  while (state.running && wl_display_dispatch(state.display) != -1);
+  if (st->drop_fd >= 0 && !CoreWatch(core, st->drop_fd, POLLIN, DropReady, NULL)) return 0;
+  for (size_t i = 0; i < st->save_count; i++) {
+    SaveFile *save = &st->saves[i];
+    if (save->in >= 0 && !CoreWatch(core, save->in, POLLIN, SaveReady, save)) return 0;
+  }
 
-  return 0;
+  while (wl_display_prepare_read(st->display) != 0) {
+    if (wl_display_dispatch_pending(st->display) < 0) return 0;
+  }
+  wl_display_flush(st->display);
+  return 1;
+}
+
+static int WaylandDispatch(Core *core, short revents) {
+  State *st = core->context;
+  if (revents & POLLIN) {
+    if (wl_display_read_events(st->display) < 0) return 0;
+  } else {
+    wl_display_cancel_read(st->display);
+  }
+  if (revents & (POLLERR | POLLHUP)) return 0;
+  return wl_display_dispatch_pending(st->display) >= 0;
+}
+
+static int WaylandBusy(Core *core) {
+  return ((State*)core->context)->transfers != NULL;
+}
+
+static void WaylandEndDrag(Core *core) {
+  State *st = core->context;
+  int dropped = core->reason == EXIT_REASON_DROPPED;
+  if (st->receiver && !ReceiveClose(&core->file->options, st->receiver->fd, dropped) && dropped) {
+    core->reason = EXIT_REASON_ERROR;
+  }
+  EndSession(st);
+}
+
+static const DragBackend Backend = {
+  .name = "Wayland",
+  .display_env = "WAYLAND_DISPLAY",
+  .display_default = "wayland-0",
+  .connect = WaylandConnect,
+  .disconnect = WaylandDisconnect,
+  .get_fd = WaylandGetFd,
+  .idle = WaylandIdle,
+  .start_drag = WaylandStartDrag,
+  .create_icon = WaylandCreateIcon,
+  .prepare = WaylandPrepare,
+  .dispatch = WaylandDispatch,
+  .busy = WaylandBusy,
+  .end_drag = WaylandEndDrag,
+};
+
+#if defined(DRAG_MODULE)
+// Loaded by the drag launcher, which has already tried the --daemon.
+__attribute__((visibility("default"))) int drag_module_main(int argc, char **argv) {
+  return CoreServe(&Backend, argc, argv);
+}
+#elif !defined(DRAG_LIBRARY)
+int main(int argc, char **argv) {
+  return CoreMain(&Backend, argc, argv);
 }
+#endif
@@ -22,6 +22,7 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/cursorfont.h>
@@ -30,8 +31,21 @@
 #include <string.h>
 #include <limits.h>
 #include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "macros.h"
 #include "shared.h"
+#include "core.h"
+#include "queue.h"
+#ifdef DRAG_LIBRARY
+#include "library.h"
+#endif
+
+// Upper bound for one INCR chunk, whatever the server accepts, so that
+// no single PropertyNotify holds up pointer motion for long.
+#define INCR_CHUNK_LIMIT (1 << 20)
 
 typedef struct {
   Atom Aware,
@@ -44,15 +58,121 @@ typedef struct {
   Finished,
   ActionCopy,
   UriList,
-  Targets;
+  Targets,
+  TypeList,
+  Multiple,
+  AtomPair,
+  Incr,
+  Timestamp,
+  Clipboard,
+  WmProtocols,
+  WmDelete;
 } Atoms;
 
+// An INCR transfer, sent a chunk per PropertyDelete. Any number of them
+// run at once, one per (requestor, property).
+typedef struct IncrTransfer {
+  struct IncrTransfer *next;
+  Window requestor;
+  Atom property;
+  Atom type;
+  const char *data;     // the mapped file
+  size_t size;
+  size_t offset;
+  int pipe;             // or a decompressor's output, -1 when mapped
+  pid_t writer;         // the decompressor, reaped to tell its end from a crash
+  int provider;         // or a conversion from 'payload', -1 for the file
+  PayloadCursor payload;
+  char *buffer;         // the next chunk read from 'pipe' or serialized
+  size_t buffered;
+  int waiting;          // the requestor asked for a chunk 'pipe' can't fill yet
+  uint64_t deadline;    // dropped if the requestor takes no chunk by then
+} IncrTransfer;
+
+enum { SELECTION_DROP, SELECTION_QUIT };
+
+// Sent from the input thread to the selection thread.
+typedef struct {
+  int kind;
+  Window target;
+  Time time;
+} SelectionMessage;
+
+// Owns XdndSelection on a second connection and answers SelectionRequest
+// on its own thread, so a big property write or a stream of INCR chunks
+// never sits in front of the XMoveWindow that keeps the label on the
+// pointer. Once it runs it is the only thread converting the FileInfo.
 typedef struct {
   Display *d;
+  Atoms atoms;
+  FileInfo *file;
+  Arena *arena;                 // transfers, owned by this thread
+  Atom types[PROVIDER_COUNT];
+  size_t providers[PROVIDER_COUNT];
+  size_t type_count;
+  IncrTransfer *transfers;
+  IncrTransfer *free_transfers;
+  size_t chunk_size;            // largest property sent in one request
+  const Watchdog *watchdog;     // only read for the transfer timeout
+  Queue queue;                  // SelectionMessage from the input thread
+  atomic_int busy;              // transfers in flight, for the drop timeout
+  Window target;                // where the drop went, once it did
+  Time drop_time;
+  Time owned_time;              // when the selections were taken
+  size_t owned;                 // selections not yet taken over by others
+  int lost_fd;                  // eventfd, readable once 'owned' is 0
+  pthread_t thread;
+} SelectionOwner;
+
+// --receive: one content type of a drop being saved with --into.
+typedef struct {
+  SaveFile file;
+  Atom type;
+  Atom property;        // what it is converted into, one per type
+  int incr;             // arriving in INCR chunks
+} DropSave;
+
+// --receive: the drag over the window and, once dropped, its transfer.
+typedef struct {
+  Window window;
+  Window source;        // 0 when nothing is over the window
+  int uri_list;         // it offers text/uri-list
+  int dropped;
+  int incr;             // the list arrives in INCR chunks
+  Receiver *receiver;
+  Atom save_types[SAVE_TYPES_MAX];  // --into: content worth saving
+  size_t save_type_count;
+  DropSave *saves;
+  size_t save_count;
+  size_t saves_open;
+  size_t saved;
+} DropTarget;
+
+// Everything up to 'version' is set up once per process and shared by every
+// drag a --daemon runs; the rest belongs to one drag.
+typedef struct {
+  Display *d;
+  Display *selection_d;         // the selection owner's connection
   Window root;
-  Window src_window;
+  XWindowAttributes root_attr;
+  Cursor cursor;
   Atoms atoms;
   int version;
+  FileInfo *file;
+  Core *core;
+  Watchdog *watchdog;           // the core's
+  Window src_window;
+  Atom types[PROVIDER_COUNT];   // offered targets
+  size_t providers[PROVIDER_COUNT];
+  size_t type_count;
+  GC gc;                        // the label's
+  SelectionOwner sel;
+  Window target;                // the XdndAware window under the pointer
+  unsigned long last_target_check;
+  int lost;                     // --copy: others own both selections now
+  DropTarget drop;              // --receive
+  Time drop_time;
+  int out;                      // --receive: where the paths go
 } DndContext;
 
 char* atom_name(Display *d, Atom a) {
@@ -72,6 +192,14 @@ void init_atoms(Display *d, Atoms *a) {
   a->ActionCopy  = XInternAtom(d, "XdndActionCopy", False);
   a->UriList     = XInternAtom(d, "text/uri-list", False);
   a->Targets     = XInternAtom(d, "TARGETS", False);
+  a->TypeList    = XInternAtom(d, "XdndTypeList", False);
+  a->Multiple    = XInternAtom(d, "MULTIPLE", False);
+  a->AtomPair    = XInternAtom(d, "ATOM_PAIR", False);
+  a->Incr        = XInternAtom(d, "INCR", False);
+  a->Timestamp   = XInternAtom(d, "TIMESTAMP", False);
+  a->Clipboard   = XInternAtom(d, "CLIPBOARD", False);
+  a->WmProtocols = XInternAtom(d, "WM_PROTOCOLS", False);
+  a->WmDelete    = XInternAtom(d, "WM_DELETE_WINDOW", False);
 }
 
 void send_msg(
@@ -131,7 +259,525 @@ Window find_xdnd_target(DndContext *ctx, int x, int y) {
 }
 
 
+typedef struct {
+  Display *d;
+  Window window;
+  Atom property;
+  Atom type;
+  int mode;
+} PropertySink;
+
+// PayloadSink that replaces the property with the first chunk and appends
+// the following ones.
+int AppendToProperty(void *ctx, const char *data, size_t len) {
+  PropertySink *sink = ctx;
+  XChangeProperty(
+    sink->d, sink->window, sink->property, sink->type, 8,
+    sink->mode, (const unsigned char*)data, len
+  );
+  sink->mode = PropModeAppend;
+  return 1;
+}
+
+
+// Interns the offered types, which is also when a single file gets
+// sniffed. Runs before the selection thread starts, as the last use of
+// the FileInfo on this thread besides the label. The full list is
+// published as XdndTypeList for targets that want more than the three in
+// XdndEnter.
+size_t offered_types(DndContext *ctx) {
+  for (size_t i = 0; i < PROVIDER_COUNT; i++) {
+    const char *type = ProviderType(ctx->file, i);
+    if (!type) continue;
+    ctx->types[ctx->type_count] = XInternAtom(ctx->d, type, False);
+    ctx->providers[ctx->type_count++] = i;
+  }
+
+  XChangeProperty(
+    ctx->d, ctx->src_window, ctx->atoms.TypeList, XA_ATOM, 32,
+    PropModeReplace, (unsigned char*)ctx->types, ctx->type_count
+  );
+  return ctx->type_count;
+}
+
+void send_enter(DndContext *ctx, Window target) {
+  size_t n = ctx->type_count;
+  send_msg(ctx, target, ctx->atoms.Enter, ctx->src_window,
+           (ctx->version << 24) | (n > 3),
+           ctx->types[0], n > 1 ? ctx->types[1] : None, n > 2 ? ctx->types[2] : None);
+}
+
+// Largest property that fits in one request, minus the ChangeProperty
+// header. Servers with BIG-REQUESTS take far more than the core limit.
+size_t incr_chunk_size(Display *d) {
+  long max = XExtendedMaxRequestSize(d);
+  if (max == 0) max = XMaxRequestSize(d);
+  size_t size = (size_t)max * 4 - 32;
+  return size < INCR_CHUNK_LIMIT ? size : INCR_CHUNK_LIMIT;
+}
+
+void end_incr(SelectionOwner *sel, IncrTransfer **link) {
+  IncrTransfer *t = *link;
+  ContentUnmap(t->data, t->size);
+  if (t->pipe >= 0) close(t->pipe);
+  if (t->writer > 0) {
+    kill(t->writer, SIGTERM);
+    waitpid(t->writer, NULL, 0);
+  }
+  *link = t->next;
+  t->next = sel->free_transfers;
+  sel->free_transfers = t;
+}
+
+// Answers with INCR and sends the bytes as the requestor deletes each
+// chunk. Takes ownership of the mapping or 'pipe' and its 'writer'. With a
+// 'provider' the bytes are its conversion instead, 'size' long.
+int start_incr(
+  SelectionOwner *sel, Window requestor, Atom target, Atom property,
+  const char *data, size_t size, int pipe, pid_t writer, int provider
+) {
+  IncrTransfer *t = sel->free_transfers;
+  if (t) sel->free_transfers = t->next;
+  else t = ArenaAlloc(sel->arena, sizeof(IncrTransfer));
+  PayloadCursor payload = { 0 };
+  int ok = t && (provider < 0 || PayloadOpen(sel->file, provider, &payload));
+  int buffered = pipe >= 0 || (provider >= 0 && !payload.cached);
+  if (ok && buffered && !t->buffer) {
+    t->buffer = ArenaAlloc(sel->arena, sel->chunk_size > URI_CHUNK_SIZE ? sel->chunk_size : URI_CHUNK_SIZE);
+  }
+  if (!ok || (buffered && !t->buffer)) {
+    ContentUnmap(data, size);
+    if (pipe >= 0) close(pipe);
+    if (writer > 0) waitpid(writer, NULL, 0); // stops on EPIPE
+    if (t) {
+      t->next = sel->free_transfers;
+      sel->free_transfers = t;
+    }
+    return 0;
+  }
+  *t = (IncrTransfer){
+    .next = sel->transfers, .requestor = requestor, .property = property,
+    .type = target, .data = data, .size = size, .pipe = pipe, .writer = writer,
+    .provider = provider, .payload = payload, .buffer = t->buffer,
+    .deadline = WatchdogTransferDeadline(sel->watchdog)
+  };
+  t->payload.chunk = t->buffer;
+  sel->transfers = t;
+
+  LOG("Starting INCR transfer of %zu bytes to 0x%lx\n", size, requestor);
+  // DestroyNotify drops the transfer if the requestor goes away mid-way.
+  XSelectInput(sel->d, requestor, PropertyChangeMask | StructureNotifyMask);
+  long lower_bound = size > LONG_MAX ? LONG_MAX : (long)size;
+  XChangeProperty(sel->d, requestor, property, sel->atoms.Incr, 32,
+                  PropModeReplace, (unsigned char*)&lower_bound, 1);
+  return 1;
+}
+
+// File contents are mapped rather than read, so the bytes go from the page
+// cache to the X server without a heap copy. Decompressed members come
+// through a pipe and their size is unknown up front, so they always use
+// INCR.
+int send_content(SelectionOwner *sel, Window requestor, Atom target, Atom property) {
+  if (ContentIsStream(sel->file)) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) return 0;
+    // Only our end is non-blocking; the decompressor waits on a full pipe.
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    pid_t writer = SpawnContent(sel->file, p[1], 0);
+    close(p[1]);
+    if (writer < 0) {
+      close(p[0]);
+      return 0;
+    }
+    return start_incr(sel, requestor, target, property, NULL, 0, p[0], writer, -1);
+  }
+
+  const char *data;
+  size_t size;
+  off_t offset, length;
+  int in = OpenContent(sel->file, &offset, &length);
+  if (!ContentMap(in, offset, length, &data, &size)) return 0;
+
+  if (size <= sel->chunk_size) {
+    XChangeProperty(sel->d, requestor, property, target, 8,
+                    PropModeReplace, (const unsigned char*)data, size);
+    ContentUnmap(data, size);
+    return 1;
+  }
+  return start_incr(sel, requestor, target, property, data, size, -1, -1, -1);
+}
+
+// Conversions too big for one request go out in chunks from their cache,
+// or serialized chunk by chunk as the requestor takes them when they are
+// too big to cache.
+int send_payload(SelectionOwner *sel, size_t provider, Window requestor, Atom target, Atom property) {
+  if (PayloadLength(sel->file, provider) <= sel->chunk_size) {
+    PropertySink sink = {
+      .d = sel->d, .window = requestor, .property = property,
+      .type = target, .mode = PropModeReplace
+    };
+    return SendPayload(sel->file, provider, AppendToProperty, &sink);
+  }
+
+  size_t size = PayloadLength(sel->file, provider);
+  return start_incr(sel, requestor, target, property, NULL, size, -1, -1, (int)provider);
+}
+
+// Reads the pipe without blocking until a chunk is full or the stream
+// ends. Returns 0 while the decompressor has not caught up, and -1 when
+// the read fails or the decompressor did not finish the member.
+static int fill_chunk(SelectionOwner *sel, IncrTransfer *t) {
+  while (t->buffered < sel->chunk_size) {
+    ssize_t n = read(t->pipe, t->buffer + t->buffered, sel->chunk_size - t->buffered);
+    if (n > 0) {
+      t->buffered += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN) return 0;
+    if (n < 0) return -1;
+    break;
+  }
+  if (t->buffered < sel->chunk_size && t->writer > 0) {
+    // The pipe hit EOF: only a clean exit means that is the whole member.
+    int status;
+    pid_t r = waitpid(t->writer, &status, 0);
+    t->writer = -1;
+    if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+  }
+  return 1;
+}
+
+// Sends the next chunk of '*link', or the empty property that ends the
+// transfer, if it is available yet.
+void send_chunk(SelectionOwner *sel, IncrTransfer **link) {
+  IncrTransfer *t = *link;
+  const char *bytes = t->buffer;
+  size_t n = t->buffered;
+  int ready;
+  if (t->provider >= 0) {
+    n = PayloadPeek(sel->file, &t->payload, &bytes);
+    if (n > sel->chunk_size) n = sel->chunk_size;
+    PayloadConsume(&t->payload, n);
+  } else if (t->pipe < 0) {
+    bytes = t->data + t->offset;
+    n = t->size - t->offset;
+    if (n > sel->chunk_size) n = sel->chunk_size;
+  } else if ((ready = fill_chunk(sel, t)) <= 0) {
+    t->waiting = ready == 0; // polled in the main loop
+    if (ready < 0) {
+      // No empty chunk: the requestor must not take this for the whole file.
+      LOG("INCR transfer to 0x%lx failed after %zu bytes, aborting it\n", t->requestor, t->offset);
+      XDeleteProperty(sel->d, t->requestor, t->property);
+      end_incr(sel, link);
+      XFlush(sel->d);
+    }
+    return;
+  } else {
+    n = t->buffered;
+    t->buffered = 0;
+  }
+  t->waiting = 0;
+
+  XChangeProperty(sel->d, t->requestor, t->property, t->type, 8,
+                  PropModeReplace, (const unsigned char*)bytes, n);
+  t->offset += n;
+  t->deadline = WatchdogTransferDeadline(sel->watchdog);
+  if (n == 0) {
+    LOG("Finished INCR transfer of %zu bytes to 0x%lx\n", t->offset, t->requestor);
+    end_incr(sel, link);
+  }
+  XFlush(sel->d);
+}
+
+// The requestor deleted 'property': it is ready for the next chunk.
+void continue_incr(SelectionOwner *sel, Window requestor, Atom property) {
+  for (IncrTransfer **link = &sel->transfers; *link; link = &(*link)->next) {
+    if ((*link)->requestor == requestor && (*link)->property == property) {
+      send_chunk(sel, link);
+      return;
+    }
+  }
+}
+
+// Drops every transfer to a requestor that was destroyed.
+void cancel_incr(SelectionOwner *sel, Window requestor) {
+  for (IncrTransfer **link = &sel->transfers; *link;) {
+    if ((*link)->requestor != requestor) {
+      link = &(*link)->next;
+      continue;
+    }
+    LOG("Requestor 0x%lx went away during an INCR transfer\n", requestor);
+    end_incr(sel, link);
+  }
+}
+
+// Drops transfers whose requestor stopped taking chunks.
+void expire_incr(SelectionOwner *sel, uint64_t now) {
+  for (IncrTransfer **link = &sel->transfers; *link;) {
+    IncrTransfer *t = *link;
+    if (!t->deadline || t->deadline > now) {
+      link = &t->next;
+      continue;
+    }
+    LOG("INCR transfer to 0x%lx stalled after %zu bytes, dropping it\n", t->requestor, t->offset);
+    end_incr(sel, link);
+  }
+}
+
+// Stores 'target' in 'property' on 'requestor'. Returns 0 when the target
+// is not offered or the conversion failed.
+int convert_selection(SelectionOwner *sel, Window requestor, Atom target, Atom property) {
+  size_t n = sel->type_count;
+
+  if (target == sel->atoms.Targets) {
+    Atom targets[PROVIDER_COUNT + 3] = {sel->atoms.Targets, sel->atoms.Multiple, sel->atoms.Timestamp};
+    memcpy(targets + 3, sel->types, n * sizeof(Atom));
+    XChangeProperty(sel->d, requestor, property, XA_ATOM, 32,
+                    PropModeReplace, (unsigned char*)targets, n + 3);
+    return 1;
+  }
+  if (target == sel->atoms.Timestamp) {
+    long time = sel->owned_time;
+    XChangeProperty(sel->d, requestor, property, XA_INTEGER, 32,
+                    PropModeReplace, (unsigned char*)&time, 1);
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (sel->types[i] != target) continue;
+    if (ProviderIsContent(sel->providers[i])) {
+      return send_content(sel, requestor, target, property);
+    }
+    return send_payload(sel, sel->providers[i], requestor, target, property);
+  }
+  return 0;
+}
+
+// MULTIPLE: 'property' holds (target, property) pairs that are converted
+// one by one. Pairs that fail get None as their property, per ICCCM.
+int convert_multiple(SelectionOwner *sel, Window requestor, Atom property) {
+  Atom type; int fmt; unsigned long n, after; unsigned char *prop = NULL;
+  if (XGetWindowProperty(
+    sel->d, requestor, property, 0, 65536, False, sel->atoms.AtomPair,
+    &type, &fmt, &n, &after, &prop
+  ) != Success || !prop) return 0;
+
+  Atom *pairs = (Atom*)prop;
+  for (unsigned long i = 0; i + 1 < n; i += 2) {
+    if (pairs[i] == sel->atoms.Multiple || pairs[i + 1] == None ||
+        !convert_selection(sel, requestor, pairs[i], pairs[i + 1])) {
+      pairs[i + 1] = None;
+    }
+  }
+
+  XChangeProperty(sel->d, requestor, property, sel->atoms.AtomPair, 32,
+                  PropModeReplace, prop, n);
+  XFree(prop);
+  return 1;
+}
+
+void handle_selection_event(SelectionOwner *sel, XEvent *e) {
+  switch (e->type) {
+    case SelectionRequest: {
+     LOG("SelectionRequest for %s\n", atom_name(sel->d, e->xselectionrequest.target));
+     if (sel->drop_time && e->xselectionrequest.time >= sel->drop_time) {
+      LOG("%lums after the drop on 0x%lx\n",
+          e->xselectionrequest.time - sel->drop_time, sel->target);
+     }
+
+     XSelectionEvent s = {
+       .type = SelectionNotify,
+       .requestor = e->xselectionrequest.requestor,
+       .selection = e->xselectionrequest.selection,
+       .target = e->xselectionrequest.target,
+       .property = e->xselectionrequest.property,
+       .time = e->xselectionrequest.time
+     };
+
+     // Obsolete requestors leave the property empty.
+     if (s.property == None) s.property = s.target;
+
+     int ok = s.target == sel->atoms.Multiple
+       ? convert_multiple(sel, s.requestor, s.property)
+       : convert_selection(sel, s.requestor, s.target, s.property);
+     if (!ok) s.property = None;
+
+     XSendEvent(sel->d, s.requestor, True, NoEventMask, (XEvent*)&s);
+     break;
+    }
+
+    case PropertyNotify: {
+     if (e->xproperty.state == PropertyDelete) {
+      continue_incr(sel, e->xproperty.window, e->xproperty.atom);
+     }
+     break;
+    }
+
+    case DestroyNotify: {
+     cancel_incr(sel, e->xdestroywindow.window);
+     break;
+    }
+
+    case SelectionClear: {
+     LOG("Lost %s\n", atom_name(sel->d, e->xselectionclear.selection));
+     if (sel->owned && --sel->owned == 0) {
+      uint64_t one = 1;
+      while (write(sel->lost_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+     }
+     break;
+    }
+
+    default:
+     break;
+  }
+}
+
+// Returns 0 once the input thread asked it to quit.
+static int handle_selection_messages(SelectionOwner *sel) {
+  SelectionMessage m;
+  QueueAck(&sel->queue);
+  while (QueuePop(&sel->queue, &m)) {
+    if (m.kind == SELECTION_QUIT) return 0;
+    if (m.kind == SELECTION_DROP) {
+      sel->target = m.target;
+      sel->drop_time = m.time;
+    }
+  }
+  return 1;
+}
+
+void* selection_thread(void *arg) {
+  SelectionOwner *sel = arg;
+  struct pollfd *fds = NULL;
+  size_t fds_capacity = 0;
+
+  while (1) {
+    while (XPending(sel->d) > 0) {
+      XEvent e;
+      XNextEvent(sel->d, &e);
+      handle_selection_event(sel, &e);
+    }
+
+    // Streamed transfers whose requestor is waiting for the next chunk.
+    size_t nfds = 2;
+    uint64_t deadline = 0;
+    for (IncrTransfer *t = sel->transfers; t; t = t->next) {
+      nfds += t->waiting;
+      deadline = WatchdogEarliest(deadline, t->deadline);
+    }
+    if (nfds > fds_capacity) {
+      size_t capacity = nfds * 2;
+      fds = ArenaGrow(
+        sel->arena, fds,
+        fds_capacity * sizeof(struct pollfd), capacity * sizeof(struct pollfd)
+      );
+      if (!fds) break;
+      fds_capacity = capacity;
+    }
+
+    fds[0] = (struct pollfd){ .fd = ConnectionNumber(sel->d), .events = POLLIN };
+    fds[1] = (struct pollfd){ .fd = sel->queue.fd, .events = POLLIN };
+    nfds = 2;
+    for (IncrTransfer *t = sel->transfers; t; t = t->next) {
+      if (t->waiting) fds[nfds++] = (struct pollfd){ .fd = t->pipe, .events = POLLIN };
+    }
+
+    // The main loop owns the timerfd; a poll timeout is enough here.
+    int timeout = -1;
+    if (deadline) {
+      uint64_t now = WatchdogNow();
+      timeout = deadline > now ? (int)(deadline - now) : 0;
+    }
+
+    XFlush(sel->d);
+    if (poll(fds, nfds, timeout) < 0 && errno != EINTR) break;
+    if ((fds[1].revents & POLLIN) && !handle_selection_messages(sel)) break;
+
+    // Same order as the pollfds above; a sent chunk may end the transfer.
+    IncrTransfer **link = &sel->transfers;
+    for (size_t i = 2; i < nfds; i++) {
+      while (!(*link)->waiting) link = &(*link)->next;
+      IncrTransfer *t = *link;
+      if (fds[i].revents) send_chunk(sel, link);
+      if (*link == t) link = &t->next;
+    }
+
+    if (deadline) expire_incr(sel, WatchdogNow());
+    atomic_store(&sel->busy, sel->transfers != NULL);
+  }
+
+  while (sel->transfers) end_incr(sel, &sel->transfers);
+  atomic_store(&sel->busy, 0);
+  return NULL;
+}
+
+// A server timestamp, from the PropertyNotify of an empty append, since
+// ICCCM wants selections taken at a real time and not CurrentTime.
+Time server_time(Display *d, Window w) {
+  XEvent e;
+  XSelectInput(d, w, PropertyChangeMask);
+  XChangeProperty(d, w, XA_WM_NAME, XA_STRING, 8, PropModeAppend, NULL, 0);
+  XWindowEvent(d, w, PropertyChangeMask, &e);
+  XSelectInput(d, w, NoEventMask);
+  return e.xproperty.time;
+}
+
+// Takes 'selections' on the second connection and starts serving them:
+// XdndSelection for a drag, CLIPBOARD and PRIMARY for --copy.
+int start_selection_owner(SelectionOwner *sel, DndContext *ctx, const Atom *selections, size_t count) {
+  sel->d = ctx->selection_d;
+  sel->arena = ArenaCreate();
+  sel->lost_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (!sel->d || !sel->arena || sel->lost_fd < 0 ||
+      !QueueInit(&sel->queue, sel->arena, sizeof(SelectionMessage))) {
+    LOG("Cannot set up the selection owner\n");
+    return 0;
+  }
+
+  // Requests still queued from an earlier --daemon drag are stale.
+  XSync(sel->d, True);
+  sel->atoms = ctx->atoms;
+  sel->file = ctx->file;
+  sel->chunk_size = incr_chunk_size(sel->d);
+  sel->watchdog = ctx->watchdog;
+  sel->type_count = ctx->type_count;
+  memcpy(sel->types, ctx->types, sizeof(sel->types));
+  memcpy(sel->providers, ctx->providers, sizeof(sel->providers));
+
+  // Any client may own a selection on a window another one created.
+  sel->owned_time = server_time(sel->d, ctx->src_window);
+  for (size_t i = 0; i < count; i++) {
+    XSetSelectionOwner(sel->d, selections[i], ctx->src_window, sel->owned_time);
+    if (XGetSelectionOwner(sel->d, selections[i]) != ctx->src_window) {
+      LOG("Cannot own %s\n", atom_name(sel->d, selections[i]));
+      return 0;
+    }
+  }
+  sel->owned = count;
+  if (pthread_create(&sel->thread, NULL, selection_thread, sel) != 0) {
+    LOG("Cannot start the selection thread\n");
+    return 0;
+  }
+  return 1;
+}
+
+void stop_selection_owner(SelectionOwner *sel) {
+  if (sel->thread) {
+    SelectionMessage quit = { .kind = SELECTION_QUIT };
+    while (!QueuePush(&sel->queue, &quit)) sched_yield();
+    pthread_join(sel->thread, NULL);
+  }
+  QueueClose(&sel->queue);
+  if (sel->lost_fd >= 0) close(sel->lost_fd);
+  if (sel->arena) {
+    ArenaReport(sel->arena, "selection");
+    ArenaDestroy(sel->arena);
+  }
+}
+
 XImage* CreateTextImage(
+  Arena *arena,
   Display *d,
   Visual *visual,
   unsigned int depth,
@@ -144,7 +790,7 @@ XImage* CreateTextImage(
   int w = *out_w;
   int h = *out_h;
 
-  char *data = malloc(w * h * 4);
+  char *data = ArenaAlloc(arena, w * h * 4);
   if (!data) return NULL;
 
   RenderTextToBuffer(text, (unsigned int*)data, w, h);
@@ -155,182 +801,569 @@ XImage* CreateTextImage(
 int XSafeErrorHandler(Display *d, XErrorEvent *e) { (void)d; (void)e; return 0; }
 int XDestroyImage(XImage *ximage) { return (*ximage->f.destroy_image)(ximage); }
 
-int main(int argc, char **argv) {
-  FileInfo* file = CommandLineArguments(argc, argv);
-  if(!file) return 1;
-  defer { if(file) FileInfoFree(file); };
+// Renders 'text' as the window background and resizes the window to fit.
+int DrawLabel(Arena *arena, Display *d, Window w, GC gc, XWindowAttributes *attr, const char *text) {
+  int win_w, win_h;
+  XImage *image = CreateTextImage(arena, d, attr->visual, attr->depth, text, &win_w, &win_h);
+  if (!image) return 0;
 
-  Display *d = XOpenDisplay(NULL);
-  if (!d) {
-    LOG("Cannot open display\n");
-    return 1;
+  XResizeWindow(d, w, win_w, win_h);
+  Pixmap bg_pixmap = XCreatePixmap(d, w, win_w, win_h, attr->depth);
+  XPutImage(d, bg_pixmap, gc, image, 0, 0, 0, 0, win_w, win_h);
+  XSetWindowBackgroundPixmap(d, w, bg_pixmap);
+  XClearWindow(d, w);
+  XFreePixmap(d, bg_pixmap);
+
+  image->data = NULL; // owned by the session arena
+  XDestroyImage(image);
+  return 1;
+}
+
+// Picks text/uri-list and, with --into, the content types to save from the
+// drag entering the window. They are in XdndEnter itself or, past three,
+// in the source's XdndTypeList. Sources list the same data in several
+// formats, best first, so only the first of each kind (image/, audio/,
+// ...) is saved.
+void scan_offer(DndContext *ctx, DropTarget *t, const XClientMessageEvent *m) {
+  Atom *types = (Atom*)&m->data.l[2];
+  unsigned long n = 3;
+  unsigned char *prop = NULL;
+  if (m->data.l[1] & 1) {
+    Atom type; int fmt; unsigned long after;
+    if (XGetWindowProperty(
+      ctx->d, m->data.l[0], ctx->atoms.TypeList, 0, 1024, False, XA_ATOM,
+      &type, &fmt, &n, &after, &prop
+    ) != Success || !prop) n = 0;
+    types = (Atom*)prop;
   }
-  defer { if(d) XCloseDisplay(d); };
 
-  XSetErrorHandler(XSafeErrorHandler);
+  t->uri_list = 0;
+  t->save_type_count = 0;
+  for (unsigned long i = 0; i < n; i++) {
+    if (types[i] == ctx->atoms.UriList) t->uri_list = 1;
+    if (!types[i] || !ctx->file->options.into || t->save_type_count == SAVE_TYPES_MAX) continue;
+
+    char *name = XGetAtomName(ctx->d, types[i]);
+    if (!name) continue;
+    int wanted = SaveWantsType(name);
+    size_t kind = wanted ? (size_t)(strchr(name, '/') - name + 1) : 0;
+    for (size_t j = 0; wanted && j < t->save_type_count; j++) {
+      char *other = XGetAtomName(ctx->d, t->save_types[j]);
+      if (other && !strncmp(other, name, kind)) wanted = 0;
+      if (other) XFree(other);
+    }
+    if (wanted) t->save_types[t->save_type_count++] = types[i];
+    XFree(name);
+  }
+  if (prop) XFree(prop);
+}
 
-  DndContext ctx = {0};
-  ctx.d = d;
-  ctx.root = DefaultRootWindow(d);
-  ctx.version = 5; 
-  init_atoms(d, &ctx.atoms);
+// Feeds 'property' to 'sink' RECEIVE_OUT_SIZE bytes at a time and deletes
+// it, which also asks an INCR sender for its next chunk. Returns the bytes
+// read, or -1 when the property announces an INCR transfer, with the
+// announced lower bound of its size in 'incr_size'.
+long read_drop_property(
+  DndContext *ctx, PayloadSink sink, void *sink_ctx,
+  Window w, Atom property, off_t *incr_size
+) {
+  long offset = 0, total = 0;
+  unsigned long after = 0;
+  do {
+    Atom type; int fmt; unsigned long n; unsigned char *data = NULL;
+    if (XGetWindowProperty(
+      ctx->d, w, property, offset, RECEIVE_OUT_SIZE / 4, False, AnyPropertyType,
+      &type, &fmt, &n, &after, &data
+    ) != Success) break;
+
+    if (type == ctx->atoms.Incr) {
+      total = -1;
+      if (incr_size) *incr_size = fmt == 32 && n && data ? *(long*)data : 0;
+    } else if (fmt == 8 && data) {
+      sink(sink_ctx, (const char*)data, n);
+      total += n;
+      offset += n / 4;
+    }
+    if (data) XFree(data);
+    if (fmt != 8 || total < 0) break;
+  } while (after > 0);
+
+  XDeleteProperty(ctx->d, w, property);
+  return total;
+}
+
+void finish_drop(DndContext *ctx, DropTarget *t, int ok) {
+  send_msg(ctx, t->source, ctx->atoms.Finished, t->window, ok, ok ? ctx->atoms.ActionCopy : None, 0, 0);
+  CoreStop(ctx->core, ok ? EXIT_REASON_DROPPED : EXIT_REASON_ERROR);
+}
+
+// --into: converts the selection to every content type picked from the
+// drag at once, each into its own property. Replies and INCR chunks for
+// all of them are then handled as they come.
+void start_saves(DndContext *ctx, DropTarget *t, Arena *arena, Time time) {
+  if (!t->saves) t->saves = ArenaAlloc(arena, SAVE_TYPES_MAX * sizeof(DropSave));
+  for (size_t i = 0; t->saves && i < t->save_type_count; i++) {
+    DropSave *s = &t->saves[t->save_count];
+    char *type = XGetAtomName(ctx->d, t->save_types[i]);
+    char name[32];
+    SaveName(name, sizeof(name), type ? type : "application/octet-stream");
+    if (type) XFree(type);
+    if (!SaveCreate(&s->file, ctx->file->options.into, name)) continue;
+
+    char property[32];
+    snprintf(property, sizeof(property), "DRAG_SAVE_%zu", t->save_count);
+    s->type = t->save_types[i];
+    s->property = XInternAtom(ctx->d, property, False);
+    s->incr = 0;
+    XConvertSelection(ctx->d, ctx->atoms.Selection, s->type, s->property, t->window, time);
+    t->save_count++;
+  }
+  t->saves_open = t->save_count;
+  if (!t->saves_open) finish_drop(ctx, t, 0);
+}
+
+void finish_save(DndContext *ctx, DropTarget *t, DropSave *s, int ok) {
+  if (SaveFinish(&s->file, ok && s->file.size > 0, ctx->file->options.output)) t->saved++;
+  if (--t->saves_open == 0) finish_drop(ctx, t, t->saved > 0);
+}
+
+DropSave* find_save(DropTarget *t, Atom property) {
+  for (size_t i = 0; i < t->save_count; i++) {
+    if (t->saves[i].property == property && t->saves[i].file.fd >= 0) return &t->saves[i];
+  }
+  return NULL;
+}
+
+int ReceiverSink(void *ctx, const char *data, size_t len) {
+  return ReceiverFeed(ctx, data, len);
+}
+
+// Shows a "Drop files here" window for one drop. Paths go out as they are
+// decoded, whether the list comes in one property or in INCR chunks. With
+// --into, content types are saved into files instead when the drop carries
+// no local file.
+int start_receive(DndContext *ctx) {
+  Display *d = ctx->d;
+  XWindowAttributes *root_attr = &ctx->root_attr;
 
   int win_w, win_h;
-  XWindowAttributes root_attr;
-  XGetWindowAttributes(d, ctx.root, &root_attr);
-  
-  XImage *text_image = CreateTextImage(
-      d, root_attr.visual, root_attr.depth, 
-      file->name, &win_w, &win_h
+  GetTextSize(ctx->file->name, &win_w, &win_h);
+
+  Window w = XCreateSimpleWindow(
+    d, ctx->root,
+    (root_attr->width - win_w) / 2, (root_attr->height - win_h) / 2, win_w, win_h,
+    1, BlackPixel(d, 0), WhitePixel(d, 0)
   );
-  defer { if(text_image) XDestroyImage(text_image); };
+  ctx->src_window = w;
+  XStoreName(d, w, "drag");
+  XSetWMProtocols(d, w, &ctx->atoms.WmDelete, 1);
+  Atom version = ctx->version;
+  XChangeProperty(d, w, ctx->atoms.Aware, XA_ATOM, 32, PropModeReplace, (unsigned char*)&version, 1);
+  XSelectInput(d, w, PropertyChangeMask);
+  XMapWindow(d, w);
+
+  ctx->gc = XCreateGC(d, w, 0, NULL);
+  DrawLabel(ctx->core->arena, d, w, ctx->gc, root_attr, ctx->file->name);
+
+  ctx->drop = (DropTarget){ .window = w, .receiver = ArenaAlloc(ctx->core->arena, sizeof(Receiver)) };
+  ctx->drop_time = CurrentTime;
+  ctx->out = ReceiveOpen(&ctx->file->options);
+  if (!ctx->drop.receiver || ctx->out < 0) return 0;
+  ReceiverInit(ctx->drop.receiver, ctx->out);
+
+  LOG("Waiting for a drop.\n");
+  return 1;
+}
+
+void handle_receive_event(DndContext *ctx, XEvent *e) {
+  Display *d = ctx->d;
+  DropTarget *t = &ctx->drop;
+  Window w = t->window;
+  Arena *ui = ctx->core->arena;
+
+  if (e->type == ClientMessage) {
+    XClientMessageEvent *m = &e->xclient;
+    int accept = t->uri_list || t->save_type_count;
+    if (m->message_type == ctx->atoms.WmProtocols && (Atom)m->data.l[0] == ctx->atoms.WmDelete) {
+      CoreStop(ctx->core, EXIT_REASON_CANCELLED);
+    } else if (t->dropped) {
+      LOG("Ignoring %s during a drop\n", atom_name(d, m->message_type));
+    } else if (m->message_type == ctx->atoms.Enter) {
+      t->source = m->data.l[0];
+      scan_offer(ctx, t, m);
+      LOG("Drag entered from 0x%lx, uri-list: %d, content types: %zu\n",
+          t->source, t->uri_list, t->save_type_count);
+      WatchdogActivity(ctx->watchdog);
+    } else if (m->message_type == ctx->atoms.Position && (Window)m->data.l[0] == t->source) {
+      send_msg(ctx, t->source, ctx->atoms.DndStatus, w, accept, 0, 0,
+               accept ? ctx->atoms.ActionCopy : None);
+      WatchdogActivity(ctx->watchdog);
+    } else if (m->message_type == ctx->atoms.Leave && (Window)m->data.l[0] == t->source) {
+      t->source = 0;
+    } else if (m->message_type == ctx->atoms.Drop && (Window)m->data.l[0] == t->source) {
+      ctx->drop_time = m->data.l[2];
+      if (!accept) {
+        send_msg(ctx, t->source, ctx->atoms.Finished, w, 0, None, 0, 0);
+        t->source = 0;
+        return;
+      }
+      t->dropped = 1;
+      WatchdogDropped(ctx->watchdog);
+      if (t->uri_list) {
+        XConvertSelection(d, ctx->atoms.Selection, ctx->atoms.UriList,
+                          ctx->atoms.Selection, w, ctx->drop_time);
+      } else {
+        start_saves(ctx, t, ui, ctx->drop_time);
+      }
+    }
+    return;
+  }
+
+  // Replies and INCR chunks. Each chunk restarts the drop timeout.
+  long received = 0;
+  int list_done = 0;
+  if (e->type == SelectionNotify && t->dropped && e->xselection.target == ctx->atoms.UriList && !t->incr) {
+    if (e->xselection.property == None) {
+      LOG("Source refused text/uri-list\n");
+      finish_drop(ctx, t, 0);
+      return;
+    }
+    received = read_drop_property(ctx, ReceiverSink, t->receiver, w, e->xselection.property, NULL);
+    t->incr = received < 0;
+    list_done = !t->incr;
+  } else if (e->type == SelectionNotify && t->dropped) {
+    DropSave *s = find_save(t, e->xselection.property);
+    for (size_t i = 0; !s && i < t->save_count; i++) {
+      if (t->saves[i].type == e->xselection.target && t->saves[i].file.fd >= 0) s = &t->saves[i];
+    }
+    if (!s || s->incr) return;
+    if (e->xselection.property == None) {
+      finish_save(ctx, t, s, 0);
+      return;
+    }
+    off_t size = 0;
+    received = read_drop_property(ctx, SaveSink, &s->file, w, s->property, &size);
+    s->incr = received < 0;
+    if (s->incr) SaveReserve(&s->file, size);
+    else finish_save(ctx, t, s, 1);
+  } else if (e->type == PropertyNotify && e->xproperty.state == PropertyNewValue) {
+    DropSave *s = find_save(t, e->xproperty.atom);
+    if (t->incr && e->xproperty.atom == ctx->atoms.Selection) {
+      // An empty chunk ends an INCR transfer.
+      received = read_drop_property(ctx, ReceiverSink, t->receiver, w, ctx->atoms.Selection, NULL);
+      list_done = received == 0;
+    } else if (s && s->incr) {
+      received = read_drop_property(ctx, SaveSink, &s->file, w, s->property, NULL);
+      if (received == 0) finish_save(ctx, t, s, 1);
+    }
+  }
+  if (received) WatchdogDropped(ctx->watchdog);
+
+  if (list_done) {
+    t->incr = 0;
+    int ok = ReceiverFinish(t->receiver);
+    // No local file in the list, like a link from a browser: save what
+    // it points to from the content the source offers instead.
+    if (ok && !t->receiver->count && t->save_type_count) start_saves(ctx, t, ui, ctx->drop_time);
+    else finish_drop(ctx, t, ok);
+  }
+}
+
+void end_receive(DndContext *ctx) {
+  Core *core = ctx->core;
+  DropTarget *t = &ctx->drop;
+  for (size_t i = 0; i < t->save_count; i++) SaveFinish(&t->saves[i].file, 0, -1);
+  int dropped = core->reason == EXIT_REASON_DROPPED;
+  if (!ReceiveClose(&ctx->file->options, ctx->out, dropped) && dropped) core->reason = EXIT_REASON_ERROR;
+}
 
-  ctx.src_window = XCreateSimpleWindow(
-    d, ctx.root,
+// --copy: owns CLIPBOARD and PRIMARY for the files, from an unmapped
+// window, until other clients have taken both over. Every conversion is
+// serialized before the selections are taken, so each paste is answered
+// from the cache.
+int start_copy(DndContext *ctx) {
+  ctx->src_window = XCreateSimpleWindow(ctx->d, ctx->root, 0, 0, 1, 1, 0, 0, 0);
+  offered_types(ctx);
+  PreparePayloads(ctx->file);
+
+  Atom selections[] = { ctx->atoms.Clipboard, XA_PRIMARY };
+  if (!start_selection_owner(&ctx->sel, ctx, selections, 2)) return 0;
+  LOG("Serving the clipboard.\n");
+  return 1;
+}
+
+void copy_lost(Core *core, void *arg, short revents) {
+  (void)core, (void)revents;
+  DndContext *ctx = arg;
+  ctx->lost = 1;
+}
+
+// Pastes still streaming when the clipboard is lost are finished first.
+void prepare_copy(DndContext *ctx) {
+  if (!ctx->lost) {
+    CoreWatch(ctx->core, ctx->sel.lost_fd, POLLIN, copy_lost, ctx);
+  } else if (atomic_load(&ctx->sel.busy)) {
+    ctx->core->deadline = WatchdogNow() + 100;
+  } else {
+    CoreStop(ctx->core, EXIT_REASON_DROPPED);
+  }
+}
+
+// Drags the files: a label that follows the pointer and speaks XDND to
+// whatever is under it.
+int start_drag_files(DndContext *ctx) {
+  Display *d = ctx->d;
+  FileInfo *file = ctx->file;
+
+  int win_w, win_h;
+  GetTextSize(file->name, &win_w, &win_h);
+
+  ctx->src_window = XCreateSimpleWindow(
+    d, ctx->root,
     0, 0, win_w, win_h,
     1, BlackPixel(d, 0), WhitePixel(d, 0)
   );
   XSetWindowAttributes attr;
   attr.override_redirect = True;
 
-  XChangeWindowAttributes(d, ctx.src_window, CWOverrideRedirect, &attr);
-  XSelectInput(d, ctx.src_window, StructureNotifyMask | ExposureMask);
-  XMapWindow(d, ctx.src_window);
-
+  XChangeWindowAttributes(d, ctx->src_window, CWOverrideRedirect, &attr);
+  XSelectInput(d, ctx->src_window, StructureNotifyMask | ExposureMask);
+  XMapWindow(d, ctx->src_window);
 
-  GC gc = XCreateGC(d, ctx.src_window, 0, NULL);
-  defer { if(gc) XFreeGC(d, gc); };
 
-  Pixmap bg_pixmap = XCreatePixmap(d, ctx.src_window, win_w, win_h, root_attr.depth);
-  XPutImage(d, bg_pixmap, gc, text_image, 0, 0, 0, 0, win_w, win_h); 
-  XSetWindowBackgroundPixmap(d, ctx.src_window, bg_pixmap);
-  XClearWindow(d, ctx.src_window);
-  XFreePixmap(d, bg_pixmap);  
-
-  Cursor cursor = XCreateFontCursor(d, XC_cross);
-  defer { XFreeCursor(d, cursor); };
+  ctx->gc = XCreateGC(d, ctx->src_window, 0, NULL);
+  DrawLabel(ctx->core->arena, d, ctx->src_window, ctx->gc, &ctx->root_attr, file->name);
+  offered_types(ctx);
 
   XEvent e;
   while (1) { XMaskEvent(d, StructureNotifyMask, &e); if (e.type == MapNotify) break; }
 
 
   if (XGrabPointer(
-    d, ctx.src_window, False,
+    d, ctx->src_window, False,
     PointerMotionMask | ButtonReleaseMask,
     GrabModeAsync, GrabModeAsync,
-    None, cursor, CurrentTime
+    None, ctx->cursor, CurrentTime
   ) != GrabSuccess) {
     LOG("Failed to grab pointer. Is another app grabbing it?\n");
-    return 1;
+    return 0;
   }
 
-  XSetSelectionOwner(d, ctx.atoms.Selection, ctx.src_window, CurrentTime);
-
-  Window current_target = 0;
-  int dragging = 1;
-  unsigned long last_target_check = 0;
+  if (!start_selection_owner(&ctx->sel, ctx, &ctx->atoms.Selection, 1)) return 0;
 
   LOG("Drag started. Move mouse to target.\n");
+  return 1;
+}
 
-  while (dragging) {
-    XNextEvent(d, &e);
-
-    switch (e.type) {
-      case MotionNotify: {
-      // [OPTIMIZATION] Event Compression
-        while (XPending(d) > 0) {
-          XEvent next_e;
-          XPeekEvent(d, &next_e);
-          if (next_e.type == MotionNotify) {
-            XNextEvent(d, &e); 
-          } else {
-            break;
-          }
+void handle_drag_event(DndContext *ctx, XEvent *e) {
+  Display *d = ctx->d;
+
+  switch (e->type) {
+    case MotionNotify: {
+    // [OPTIMIZATION] Event Compression
+      while (XPending(d) > 0) {
+        XEvent next_e;
+        XPeekEvent(d, &next_e);
+        if (next_e.type == MotionNotify) {
+          XNextEvent(d, e); 
+        } else {
+          break;
         }
+      }
+
+      XMoveWindow(d, ctx->src_window, e->xmotion.x_root + 15, e->xmotion.y_root + 15);
+      WatchdogActivity(ctx->watchdog);
 
-        XMoveWindow(d, ctx.src_window, e.xmotion.x_root + 15, e.xmotion.y_root + 15);
-
-        if (e.xmotion.time - last_target_check > 100) {
-          Window new_target = find_xdnd_target(&ctx, e.xmotion.x_root, e.xmotion.y_root);
-          if (new_target != current_target) {
-            if (current_target) {
-              send_msg(&ctx, current_target, ctx.atoms.Leave, ctx.src_window, 0, 0, 0, 0);
-            }
-            current_target = new_target;
-            if (current_target) {
-              send_msg(&ctx, current_target, ctx.atoms.Enter, ctx.src_window,
-                        ctx.version << 24, ctx.atoms.UriList, ctx.atoms.Targets, 0);
-            }
+      if (e->xmotion.time - ctx->last_target_check > 100) {
+        Window new_target = find_xdnd_target(ctx, e->xmotion.x_root, e->xmotion.y_root);
+        if (new_target != ctx->target) {
+          if (ctx->target) {
+            send_msg(ctx, ctx->target, ctx->atoms.Leave, ctx->src_window, 0, 0, 0, 0);
           }
-          if (current_target) {
-          send_msg(&ctx, current_target, ctx.atoms.Position, ctx.src_window,
-                   0, (e.xmotion.x_root << 16) | (e.xmotion.y_root & 0xFFFF),
-                   e.xmotion.time, ctx.atoms.ActionCopy);
+          ctx->target = new_target;
+          if (ctx->target) {
+            send_enter(ctx, ctx->target);
           }
-          last_target_check = e.xmotion.time;
         }
-        break;
+        if (ctx->target) {
+        send_msg(ctx, ctx->target, ctx->atoms.Position, ctx->src_window,
+                 0, (e->xmotion.x_root << 16) | (e->xmotion.y_root & 0xFFFF),
+                 e->xmotion.time, ctx->atoms.ActionCopy);
+        }
+        ctx->last_target_check = e->xmotion.time;
       }
-
-    case ClientMessage: {
-     if (e.xclient.message_type == ctx.atoms.DndStatus) {
-      LOG("Received DndStatus. Accepted: %ld\n", e.xclient.data.l[1] & 1);
-     } else if (e.xclient.message_type == ctx.atoms.Finished) {
-      LOG("Received Finished. Drop Successful.\n");
-      dragging = 0;
-     }
-     break;
+      break;
     }
 
-    case ButtonRelease: {
-     if (current_target) {
-      LOG("Button Release. Sending Drop.\n");
-      send_msg(
-        &ctx, current_target, ctx.atoms.Drop, ctx.src_window,
-        0, e.xbutton.time, 0, 0
-      );
-     } else {
-      LOG("Button Release on nothing. Aborting.\n");
-      dragging = 0;
-     }
-     XUngrabPointer(d, e.xbutton.time);
-     break;
-    }
+  case ClientMessage: {
+   if (e->xclient.message_type == ctx->atoms.DndStatus) {
+    LOG("Received DndStatus. Accepted: %ld\n", e->xclient.data.l[1] & 1);
+   } else if (e->xclient.message_type == ctx->atoms.Finished) {
+    LOG("Received Finished. Drop Successful.\n");
+    CoreStop(ctx->core, EXIT_REASON_DROPPED);
+   }
+   break;
+  }
 
-    case SelectionRequest: {
-     LOG("SelectionRequest for %s\n", atom_name(d, e.xselectionrequest.target));
+  case ButtonRelease: {
+   if (ctx->target) {
+    LOG("Button Release. Sending Drop.\n");
+    send_msg(
+      ctx, ctx->target, ctx->atoms.Drop, ctx->src_window,
+      0, e->xbutton.time, 0, 0
+    );
+    WatchdogDropped(ctx->watchdog);
+    SelectionMessage drop = { SELECTION_DROP, ctx->target, e->xbutton.time };
+    QueuePush(&ctx->sel.queue, &drop);
+   } else {
+    LOG("Button Release on nothing. Aborting.\n");
+    CoreStop(ctx->core, EXIT_REASON_CANCELLED);
+   }
+   XUngrabPointer(d, e->xbutton.time);
+   break;
+  }
 
-     XSelectionEvent s = {
-       .type = SelectionNotify,
-       .requestor = e.xselectionrequest.requestor,
-       .selection = e.xselectionrequest.selection,
-       .target = e.xselectionrequest.target,
-       .property = e.xselectionrequest.property,
-       .time = e.xselectionrequest.time
-     };
+  default:
+   LOG("Ignoring event type %d\n", e->type);
+   break;
 
-     if (e.xselectionrequest.target == ctx.atoms.Targets) {
-      Atom targets[] = {ctx.atoms.Targets, ctx.atoms.UriList};
-      XChangeProperty(d, s.requestor, s.property, XA_ATOM, 32,
-              PropModeReplace, (unsigned char*)targets, 2);
-     } else if (e.xselectionrequest.target == ctx.atoms.UriList) {
-      XChangeProperty(d, s.requestor, s.property, s.target, 8,
-              PropModeReplace, (unsigned char*)file->uri, strlen(file->uri));
-     } else {
-      s.property = None; 
-     }
+  }
+}
 
-     XSendEvent(d, s.requestor, True, NoEventMask, (XEvent*)&s);
-     XFlush(d);
-     break;
-    }
+// Both connections and what is looked up on them, once per process or
+// once per library. Input and selections run on two threads, each with
+// its own Display. The context is aligned for the SelectionOwner's queue.
+void* x11_connect(void) {
+  XInitThreads();
+  DndContext *warm = aligned_alloc(_Alignof(DndContext), sizeof(DndContext));
+  if (!warm) return NULL;
+  *warm = (DndContext){ .version = 5 };
+  warm->d = XOpenDisplay(NULL);
+  warm->selection_d = XOpenDisplay(NULL);
+  if (!warm->d || !warm->selection_d) {
+    LOG("Cannot open display\n");
+    if (warm->selection_d) XCloseDisplay(warm->selection_d);
+    if (warm->d) XCloseDisplay(warm->d);
+    free(warm);
+    return NULL;
+  }
 
-    default:
-     LOG("Ignoring event type %d\n", e.type);
-     break;
+  XSetErrorHandler(XSafeErrorHandler);
+  warm->root = DefaultRootWindow(warm->d);
+  warm->cursor = XCreateFontCursor(warm->d, XC_cross);
+  init_atoms(warm->d, &warm->atoms);
+  XGetWindowAttributes(warm->d, warm->root, &warm->root_attr);
+  return warm;
+}
 
-   }
+void x11_disconnect(void *context) {
+  DndContext *warm = context;
+  XFreeCursor(warm->d, warm->cursor);
+  XCloseDisplay(warm->selection_d);
+  XCloseDisplay(warm->d);
+  free(warm);
+}
+
+int x11_get_fd(void *context) {
+  return ConnectionNumber(((DndContext*)context)->d);
+}
+
+// Nothing is mapped between --daemon drags; whatever still arrives is
+// about windows that are gone.
+int x11_idle(void *context) {
+  DndContext *warm = context;
+  while (XPending(warm->d) > 0) {
+    XEvent e;
+    XNextEvent(warm->d, &e);
   }
+  return 1;
+}
 
-  return 0;
+// A session runs on a copy of the warm context, so it leaves nothing
+// behind on it for the next --daemon drag.
+int x11_start_drag(Core *core) {
+  DndContext *ctx = aligned_alloc(_Alignof(DndContext), sizeof(DndContext));
+  if (!ctx) return 0;
+  *ctx = *(DndContext*)core->context;
+  ctx->file = core->file;
+  ctx->core = core;
+  ctx->watchdog = &core->watchdog;
+  ctx->sel = (SelectionOwner){ .queue.fd = -1, .lost_fd = -1 };
+  ctx->out = -1;
+  core->session = ctx;
+
+  const Options *o = &ctx->file->options;
+  return o->receive ? start_receive(ctx)
+       : o->copy    ? start_copy(ctx)
+                    : start_drag_files(ctx);
+}
+
+void x11_create_icon(Core *core, const char *text) {
+  DndContext *ctx = core->session;
+  DrawLabel(core->arena, ctx->d, ctx->src_window, ctx->gc, &ctx->root_attr, text);
+}
+
+// Handles what the server already sent. Transfer deadlines are handled on
+// the selection thread.
+int x11_prepare(Core *core) {
+  DndContext *ctx = core->session;
+  const Options *o = &ctx->file->options;
+  if (o->copy) prepare_copy(ctx);
+  while (core->reason == EXIT_REASON_NONE && XPending(ctx->d) > 0) {
+    XEvent e;
+    XNextEvent(ctx->d, &e);
+    if (o->receive) handle_receive_event(ctx, &e);
+    else if (!o->copy) handle_drag_event(ctx, &e);
+  }
+  XFlush(ctx->d);
+  return 1;
+}
+
+// Events are read by XPending() in the next prepare.
+int x11_dispatch(Core *core, short revents) {
+  (void)core;
+  return !(revents & (POLLERR | POLLHUP));
+}
+
+int x11_busy(Core *core) {
+  DndContext *ctx = core->session;
+  return atomic_load(&ctx->sel.busy);
+}
+
+void x11_end_drag(Core *core) {
+  DndContext *ctx = core->session;
+  if (!ctx) return;
+  stop_selection_owner(&ctx->sel);
+  if (ctx->file->options.receive) end_receive(ctx);
+  if (ctx->gc) XFreeGC(ctx->d, ctx->gc);
+  if (ctx->src_window) XDestroyWindow(ctx->d, ctx->src_window);
+  XUngrabPointer(ctx->d, CurrentTime);
+  XSync(ctx->d, True);
+  free(ctx);
+  core->session = NULL;
+}
+
+static const DragBackend Backend = {
+  .name = "X11",
+  .display_env = "DISPLAY",
+  .connect = x11_connect,
+  .disconnect = x11_disconnect,
+  .get_fd = x11_get_fd,
+  .idle = x11_idle,
+  .start_drag = x11_start_drag,
+  .create_icon = x11_create_icon,
+  .prepare = x11_prepare,
+  .dispatch = x11_dispatch,
+  .busy = x11_busy,
+  .end_drag = x11_end_drag,
+};
+
+#if defined(DRAG_MODULE)
+// Loaded by the drag launcher, which has already tried the --daemon.
+__attribute__((visibility("default"))) int drag_module_main(int argc, char **argv) {
+  return CoreServe(&Backend, argc, argv);
+}
+#elif !defined(DRAG_LIBRARY)
+int main(int argc, char **argv) {
+  return CoreMain(&Backend, argc, argv);
 }
+#endif
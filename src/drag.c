@@ -0,0 +1,103 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2026 Klevis Imeri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include "macros.h"
+#include "daemon.h"
+
+// One drag for both display servers. It picks the backend from the
+// environment and loads only that module, and with it only libX11 or only
+// libwayland-client and -cursor. Linking both into one binary would make
+// every start relocate and resolve symbols for both. A running --daemon is
+// tried before anything is loaded at all.
+
+#ifndef DRAG_ARCH
+#define DRAG_ARCH "x86_64"
+#endif
+#ifndef DRAG_MODULE_DIR
+#define DRAG_MODULE_DIR "/usr/lib/drag"
+#endif
+
+typedef int (*ModuleMain)(int argc, char **argv);
+
+// Looks for drag-<backend>-<arch>.so next to the executable, as in build/,
+// then in DRAG_MODULE_DIR.
+static ModuleMain LoadModule(const char *backend) {
+  char name[64];
+  snprintf(name, sizeof(name), "drag-%s-%s.so", backend, DRAG_ARCH);
+
+  char self[PATH_MAX];
+  const char *dirs[] = { NULL, DRAG_MODULE_DIR };
+  ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  char *slash = n > 0 ? memrchr(self, '/', n) : NULL;
+  if (slash) {
+    *slash = '\0';
+    dirs[0] = self;
+  }
+
+  for (size_t i = 0; i < 2; i++) {
+    if (!dirs[i]) continue;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dirs[i], name);
+    // Lazy binding: only what a drag actually calls gets resolved.
+    void *module = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
+    if (!module) {
+      LOG("%s\n", dlerror());
+      continue;
+    }
+    ModuleMain entry = (ModuleMain)dlsym(module, "drag_module_main");
+    if (entry) return entry;
+    dlclose(module);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+
+  const char *wayland = getenv("WAYLAND_DISPLAY");
+  const char *x11 = getenv("DISPLAY");
+  int use_wayland = wayland && *wayland;
+  const char *backend = use_wayland ? "Wayland" : "X11";
+
+  int status = DaemonHandOff(backend, use_wayland ? wayland : x11, argc, argv);
+  if (status >= 0) return status;
+
+  ModuleMain run = LoadModule(backend);
+  // XWayland still takes X11 drags when the Wayland module can't load.
+  if (!run && use_wayland && x11 && *x11) run = LoadModule("X11");
+  if (!run) {
+    fprintf(stderr, "drag: cannot load the %s backend\n", backend);
+    return 1;
+  }
+  return run(argc, argv);
+}
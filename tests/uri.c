@@ -0,0 +1,190 @@
+// Differential test of the URI kernels in include/uri.h: every kernel this
+// CPU can run must match the scalar reference byte for byte, for encoding,
+// the encoded length and decoding, on random, boundary-length and
+// non-ASCII inputs. Built and run by `./nob test`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "uri.h"
+
+#define TEST_MAX 600
+#define TEST_GUARD 64
+#define TEST_RANDOM 20000
+
+typedef struct {
+  const char *name;
+  UriKernel kernel;
+} TestKernel;
+
+static TestKernel Kernels[3];
+static int KernelCount;
+static int Failures;
+
+static void TestAddKernels(void) {
+  Kernels[KernelCount++] = (TestKernel){ "scalar", { UriEncodedLengthScalar, UriEncodeScalar, UriDecodeScalar } };
+#ifdef URI_SIMD
+  Kernels[KernelCount++] = (TestKernel){ "sse2", { UriEncodedLengthSSE2, UriEncodeSSE2, UriDecodeSSE2 } };
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    Kernels[KernelCount++] = (TestKernel){ "avx2", { UriEncodedLengthAVX2, UriEncodeAVX2, UriDecodeAVX2 } };
+  } else {
+    printf("uri: no AVX2 on this CPU, skipping its kernel\n");
+  }
+#endif
+}
+
+static void TestFail(const char *kernel, const char *what, const char *in, size_t len) {
+  if (Failures++ >= 10) return;
+  fprintf(stderr, "FAIL %s %s, input of %zu bytes:", kernel, what, len);
+  for (size_t i = 0; i < len && i < 64; i++) fprintf(stderr, " %02x", (unsigned char)in[i]);
+  fprintf(stderr, "%s\n", len > 64 ? " ..." : "");
+}
+
+// Outputs go into an exact-size buffer followed by a guard, so a block
+// store past the end shows up too.
+static void TestEncode(const char *in, size_t len) {
+  static char expected[TEST_MAX * 3], out[TEST_MAX * 3 + TEST_GUARD];
+  size_t n = UriEncodeScalar(expected, in, len);
+  if (UriEncodedLengthScalar(in, len) != n) TestFail("scalar", "length", in, len);
+
+  for (int k = 0; k < KernelCount; k++) {
+    const TestKernel *t = &Kernels[k];
+    memset(out, 0xA5, sizeof(out));
+    if (t->kernel.length(in, len) != n) TestFail(t->name, "length", in, len);
+    if (t->kernel.encode(out, in, len) != n || memcmp(out, expected, n)) TestFail(t->name, "encode", in, len);
+    for (size_t i = n; i < n + TEST_GUARD; i++) {
+      if ((unsigned char)out[i] != 0xA5) {
+        TestFail(t->name, "encode overrun", in, len);
+        break;
+      }
+    }
+
+    char decoded[TEST_MAX + TEST_GUARD];
+    if (t->kernel.decode(decoded, expected, n) != len || memcmp(decoded, in, len)) {
+      TestFail(t->name, "round trip", in, len);
+    }
+  }
+}
+
+static void TestDecode(const char *in, size_t len) {
+  static char expected[TEST_MAX], out[TEST_MAX + TEST_GUARD];
+  size_t n = UriDecodeScalar(expected, in, len);
+
+  for (int k = 0; k < KernelCount; k++) {
+    const TestKernel *t = &Kernels[k];
+    memset(out, 0xA5, sizeof(out));
+    if (t->kernel.decode(out, in, len) != n || memcmp(out, expected, n)) TestFail(t->name, "decode", in, len);
+    for (size_t i = len; i < len + TEST_GUARD; i++) {
+      if ((unsigned char)out[i] != 0xA5) {
+        TestFail(t->name, "decode overrun", in, len);
+        break;
+      }
+    }
+  }
+}
+
+static const char *Samples[] = {
+  "/home/user/My File.txt",
+  "/tmp/\xe6\x96\x87\xe4\xbb\xb6/\xe5\x86\x99\xe7\x9c\x9f.png",          // CJK
+  "/srv/\xf0\x9f\x93\x81 photos/\xf0\x9f\x8e\x89.jpg",                    // emoji
+  "/data/caf\xc3\xa9/na\xc3\xafve r\xc3\xa9sum\xc3\xa9.pdf",              // Latin-1 in UTF-8
+  "/bad/\xff\xfe\x80 invalid utf-8",
+  "/a/b-c.d_e~f/0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz",
+  "/odd/!#$&'()*+,;=?@[]%",
+  "%", "%4", "%41", "%zz", "%%41", "%4g", "a%2", "%2F%2f%C3%A9",
+};
+
+// Escapes, broken escapes and '%' at the end, spread over block edges.
+static const char *Fragments[] = { "%20", "%", "%4", "%zz", "%C3%A9", "a", "/", "%2f", "%%" };
+
+// The public entry points select their kernel on first use, which may
+// happen on several threads at once.
+static void* TestThread(void *arg) {
+  (void)arg;
+  char out[256], back[256];
+  for (size_t i = 0; i < sizeof(Samples) / sizeof(Samples[0]); i++) {
+    size_t len = strlen(Samples[i]);
+    size_t n = UriEncode(out, Samples[i], len);
+    if (n != UriEncodedLength(Samples[i], len) || UriDecode(back, out, n) != len || memcmp(back, Samples[i], len)) {
+      return (void*)1;
+    }
+  }
+  return NULL;
+}
+
+int main(void) {
+  TestAddKernels();
+  srand(1);
+  static char in[TEST_MAX];
+
+  for (size_t i = 0; i < sizeof(Samples) / sizeof(Samples[0]); i++) {
+    TestEncode(Samples[i], strlen(Samples[i]));
+    TestDecode(Samples[i], strlen(Samples[i]));
+  }
+
+  // Every byte value, alone and at every offset of a 64-byte block.
+  for (int c = 0; c < 256; c++) {
+    for (size_t at = 0; at < 64; at++) {
+      memset(in, 'a', 64);
+      in[at] = (char)c;
+      TestEncode(in, 64);
+      TestDecode(in, 64);
+      TestEncode(in, at + 1);
+    }
+  }
+
+  // Every length around the 16 and 32 byte blocks, safe and unsafe.
+  for (size_t len = 0; len <= 130; len++) {
+    memset(in, 'x', len);
+    TestEncode(in, len);
+    TestDecode(in, len);
+    memset(in, ' ', len);
+    TestEncode(in, len);
+    memset(in, '%', len);
+    TestDecode(in, len);
+    for (size_t i = 0; i < len; i++) in[i] = (char)(0x80 | (i & 0x3f));
+    TestEncode(in, len);
+  }
+
+  for (int round = 0; round < TEST_RANDOM; round++) {
+    size_t len = (size_t)rand() % (TEST_MAX / 3);
+    int mode = rand() % 3;
+    for (size_t i = 0; i < len; i++) {
+      if (mode == 0) in[i] = (char)(rand() & 0xFF);                        // anything
+      else if (mode == 1) in[i] = rand() % 8 ? 'a' + rand() % 26 : (char)(0x80 + rand() % 0x80);
+      else in[i] = "az/._-~ %\xc3\xa9"[rand() % 12];                         // mostly safe
+    }
+    TestEncode(in, len);
+
+    size_t n = 0;
+    while (n + 8 < TEST_MAX) {
+      if (rand() % 3) {
+        in[n++] = (char)(rand() % 2 ? 'a' + rand() % 26 : rand() & 0xFF);
+      } else {
+        const char *f = Fragments[rand() % (sizeof(Fragments) / sizeof(Fragments[0]))];
+        memcpy(in + n, f, strlen(f));
+        n += strlen(f);
+      }
+      if (rand() % 64 == 0) break;
+    }
+    TestDecode(in, n);
+  }
+
+  pthread_t threads[8];
+  for (int i = 0; i < 8; i++) pthread_create(&threads[i], NULL, TestThread, NULL);
+  for (int i = 0; i < 8; i++) {
+    void *failed;
+    pthread_join(threads[i], &failed);
+    if (failed) TestFail("selected", "concurrent first use", "", 0);
+  }
+
+  for (int k = 0; k < KernelCount; k++) printf("uri: checked the %s kernel\n", Kernels[k].name);
+  if (Failures) {
+    fprintf(stderr, "uri: %d failures\n", Failures);
+    return 1;
+  }
+  printf("uri: ok\n");
+  return 0;
+}